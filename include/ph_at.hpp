@@ -0,0 +1,116 @@
+#ifndef PH_AT_HPP_
+#define PH_AT_HPP_
+
+#include "ph_uart.hpp"
+#include <string_view>
+
+//AT command engine over uart::Channel
+//
+//Commands are queued with a deadline each and sent as the modem is ready for them; with SetMaxInFlight > 1
+//several are outstanding at once and final result codes complete them in order. A timeout while several are
+//outstanding fails all of them: results arriving late could no longer be told apart.
+//Received lines are handed out as spans into the channel's receive window, nothing is copied:
+//they are valid only during the callback. Lines starting with a registered URC prefix go to the URC handler
+//even while a command is in flight, unless the command claims that prefix as its response (e.g. "+CREG:").
+//The engine is driven by Process/Execute from a single task; callbacks run in that task and must not call them.
+namespace at
+{
+    enum class Final: uint8_t
+    {
+        Ok,
+        Error,
+        CmeError,//Result::err holds the numeric code, -1 in verbose mode
+        CmsError,
+        NoCarrier,
+        Busy,
+        NoAnswer,
+        NoDialtone,
+        Connect,
+        Prompt,//"> " for commands with Command::wait_prompt
+        Timeout,
+    };
+
+    struct Result
+    {
+        Final code = Final::Timeout;
+        int err = 0;
+
+        bool ok() const { return code == Final::Ok || code == Final::Connect || code == Final::Prompt; }
+    };
+
+    using LineCallback = GenericCallback<void(std::span<const uint8_t>)>;
+    using DoneCallback = GenericCallback<void(Result)>;
+
+    struct Command
+    {
+        std::string_view text;//without the trailing \r; not copied, must stay valid until completion
+        uart::Deadline deadline = uart::Deadline::never();
+        std::string_view response_prefix = {};//lines with this prefix belong to the command even if a URC has it too
+        bool wait_prompt = false;//completes with Final::Prompt on "> " (e.g. AT+CMGS)
+        LineCallback on_line = {};//intermediate response lines
+        DoneCallback on_done = {};
+    };
+
+    class Engine
+    {
+    public:
+        using Ref = std::reference_wrapper<Engine>;
+        using ExpectedResult = std::expected<Ref, Err>;
+
+        template<typename V>
+        using RetVal = RetValT<Ref, V>;
+
+        template<typename V>
+        using ExpectedValue = std::expected<RetVal<V>, Err>;
+
+        static constexpr size_t kMaxQueued = 8;
+        static constexpr size_t kMaxUrcs = 16;
+
+        Engine(uart::Channel &c);
+
+        //how many commands may be outstanding at once; 1 unless the modem is known to queue them
+        Engine& SetMaxInFlight(size_t n);
+        size_t GetMaxInFlight() const { return m_MaxInFlight; }
+
+        //prefix is not copied
+        ExpectedResult RegisterUrc(std::string_view prefix, LineCallback cb);
+        ExpectedResult UnregisterUrc(std::string_view prefix);
+        //lines that are neither a URC nor belong to a command
+        void SetUnhandledCallback(LineCallback cb) { m_Unhandled = std::move(cb); }
+
+        //queues a command; fails with ESP_ERR_NO_MEM when kMaxQueued commands are pending
+        ExpectedResult Submit(Command &&cmd);
+        size_t GetPending() const { return m_Tail - m_Head; }
+
+        //sends what may be sent, dispatches the received lines and expires commands past their deadline
+        //waits up to wait for the first line; returns the amount of lines dispatched
+        ExpectedValue<size_t> Process(duration_ms_t wait);
+
+        //submits the command and processes until it completes, URCs get dispatched meanwhile
+        ExpectedValue<Result> Execute(Command cmd);
+    private:
+        struct Urc
+        {
+            std::string_view prefix;
+            LineCallback cb;
+        };
+
+        Command& slot(size_t i) { return m_Queue[i % kMaxQueued]; }
+        ExpectedResult send_queued();
+        void dispatch(std::span<const uint8_t> line);
+        void complete(Result r);
+        void expire();
+        duration_ms_t next_wait(const uart::Deadline &until);
+
+        uart::Channel &m_C;
+        size_t m_MaxInFlight = 1;
+        Command m_Queue[kMaxQueued];
+        //free running: [m_Head, m_Sent) in flight, [m_Sent, m_Tail) waiting to be sent
+        size_t m_Head = 0;
+        size_t m_Sent = 0;
+        size_t m_Tail = 0;
+        Urc m_Urcs[kMaxUrcs];
+        LineCallback m_Unhandled;
+    };
+}
+#endif
@@ -4,9 +4,18 @@
 #include "lib_expected_results.hpp"
 #include "lib_misc_helpers.hpp"
 #include "driver/i2c_master.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cstring>
 #include <expected>
+#include <span>
+#include <utility>
 #include "lib_thread_lock.hpp"
 #include "lib_type_traits.hpp"
+#include "ph_i2c_layout.hpp"
 
 namespace i2c
 {
@@ -64,6 +73,10 @@ namespace i2c
         I2CBusMaster& SetEnableInternalPullup(bool enable);
         bool GetEnableInternalPullup() const;
 
+        //driver transaction queue, > 0 is needed by devices in async mode (I2CDevice::SetAsync)
+        I2CBusMaster& SetTransQueueDepth(size_t depth);
+        size_t GetTransQueueDepth() const;
+
         ExpectedResult Open();
         ExpectedResult Close();
 
@@ -88,7 +101,9 @@ namespace i2c
 
         I2CDevice(const I2CBusMaster &bus, uint16_t addr = 0xff, uint32_t speed_hz = 100'000);
         I2CDevice(const I2CDevice &rhs) = delete;
+        //a device with async transfers still queued can't be moved: rhs keeps it open and the new one stays closed
         I2CDevice(I2CDevice &&rhs);
+        ~I2CDevice() { Close(); }
 
         I2CDevice& SetAddress(uint16_t addr);
         uint16_t GetAddress() const;
@@ -96,7 +111,45 @@ namespace i2c
         I2CDevice& SetSpeedHz(uint32_t hz);
         uint32_t GetSpeedHz() const;
 
+        //one asynchronous transfer, owned by the caller; waitable like a future
+        class Transfer
+        {
+        public:
+            Transfer();
+            Transfer(const Transfer &) = delete;
+            ~Transfer();
+
+            bool Done() const { return m_Done; }
+            //valid once Done
+            esp_err_t Result() const { return m_Err; }
+            //the result, or ESP_ERR_TIMEOUT if still on its way after d
+            esp_err_t Wait(duration_t d = kForever);
+        private:
+            friend class I2CDevice;
+
+            StaticSemaphore_t m_SemBuf;
+            SemaphoreHandle_t m_Sem;
+            std::atomic<bool> m_Done{true};
+            esp_err_t m_Err = ESP_OK;
+            //accounted into the device's Stats on completion (*Async calls only)
+            bool m_Counted = false;
+            size_t m_Tx = 0;
+            size_t m_Rx = 0;
+            int64_t m_SubmitUs = 0;
+            uint8_t m_Reg = 0;
+            i2c_master_transmit_multi_buffer_info_t m_Bufs[2];
+        };
+
+        //async mode, set before Open; needs a bus with a transaction queue (SetTransQueueDepth)
+        //all transfers of the device go through the driver queue then and the *Async calls return as soon as
+        //theirs is queued, so the next one can be prepared while the current one is on the wire;
+        //the blocking calls queue theirs and wait for it
+        static constexpr size_t kMaxPending = 8;
+        I2CDevice& SetAsync(bool async) { m_Async = async; return *this; }
+        bool GetAsync() const { return m_Async; }
+
         ExpectedResult Open();
+        //waits for the queued async transfers first
         ExpectedResult Close();
 
         ExpectedResult Send(const uint8_t *pBuf, std::size_t len, duration_t d = kForever);
@@ -113,7 +166,61 @@ namespace i2c
         ExpectedResult ReadRegMulti(uint8_t reg, std::span<uint8_t> dst, duration_t d = kForever);
         ExpectedResult WriteRegMulti(uint8_t reg, std::span<const uint8_t> src, duration_t d = kForever);
 
+        //how consecutive registers are accessed by ReadRegs/WriteRegs (and the helpers::Register family)
+        enum class BurstMode: uint8_t
+        {
+            AutoIncrement,//one transaction, the chip advances the register address itself
+            SingleByte,//no auto-increment: one transaction per register
+        };
+        //incFlag is or'ed into the register address of bursts, for chips that only auto-increment when asked
+        //to (e.g. bit 7 on many ST sensors)
+        I2CDevice& SetBurstMode(BurstMode m, uint8_t incFlag = 0) { m_Burst = m; m_BurstFlag = incFlag; return *this; }
+        BurstMode GetBurstMode() const { return m_Burst; }
+
+        //dst.size()/src.size() consecutive registers starting at reg, according to the burst mode
+        ExpectedResult ReadRegs(uint8_t reg, std::span<uint8_t> dst, duration_t d = kForever);
+        ExpectedResult WriteRegs(uint8_t reg, std::span<const uint8_t> src, duration_t d = kForever);
+
+        //same for chips with 16 bit register addresses (sent big endian); the increment flag doesn't apply
+        ExpectedResult ReadRegMulti16(uint16_t reg, std::span<uint8_t> dst, duration_t d = kForever);
+        ExpectedResult WriteRegMulti16(uint16_t reg, std::span<const uint8_t> src, duration_t d = kForever);
+        ExpectedResult ReadRegs16(uint16_t reg, std::span<uint8_t> dst, duration_t d = kForever);
+        ExpectedResult WriteRegs16(uint16_t reg, std::span<const uint8_t> src, duration_t d = kForever);
+
+        //async counterparts: buffers aren't copied and have to stay valid, as does t, until t is Done
+        //fail with ESP_ERR_NO_MEM when kMaxPending transfers are pending on the device
+        ExpectedResult SendAsync(const uint8_t *pBuf, std::size_t len, Transfer &t);
+        ExpectedResult RecvAsync(uint8_t *pBuf, std::size_t len, Transfer &t);
+        ExpectedResult SendRecvAsync(const uint8_t *pSendBuf, std::size_t sendLen, uint8_t *pRecvBuf, std::size_t recvLen, Transfer &t);
+        //bursts only (ESP_ERR_NOT_SUPPORTED in BurstMode::SingleByte); writes aren't reported to the RegCache
+        ExpectedResult ReadRegsAsync(uint8_t reg, std::span<uint8_t> dst, Transfer &t);
+        ExpectedResult WriteRegsAsync(uint8_t reg, std::span<const uint8_t> src, Transfer &t);
+
+        //per-device counters, safe to read from any task
+        struct Stats
+        {
+            std::atomic<uint32_t> transactions{0};
+            std::atomic<uint32_t> tx_bytes{0};
+            std::atomic<uint32_t> rx_bytes{0};
+            std::atomic<uint32_t> bus_us{0};//time spent in the driver calls, bus lock included
+                                            //*Async transfers count on completion, from when they could start
+
+            void reset();
+        };
+        const Stats& GetStats() const { return m_Stats; }
+        void ResetStats() { m_Stats.reset(); }
+
+        //told about every successful register write (WriteReg8/16, WriteRegMulti, WriteRegs) so a register
+        //cache (ph_i2c_shadow.hpp) stays coherent with writes that bypass it
+        struct RegCache
+        {
+            virtual void OnRegWrite(uint8_t reg, std::span<const uint8_t> src) = 0;
+        };
+        I2CDevice& SetRegCache(RegCache *pCache) { m_pRegCache = pCache; return *this; }
+        RegCache* GetRegCache() const { return m_pRegCache; }
+
 #ifndef NDEBUG
+        //transfers go to the trace ring (ph_trace.hpp, needs PH_TRACE_ENABLE)
         void dbg_on_send(bool v) { m_Dbg.print_send = v; }
         void dbg_on_recv(bool v) { m_Dbg.print_recv = v; }
 private:
@@ -125,20 +232,49 @@ private:
 public:
 #endif
     private:
+        //counts one driver transaction and the time it took (bus lock wait included) into m_Stats
+        struct Transaction
+        {
+            Transaction(I2CDevice &d, size_t tx, size_t rx);
+            ~Transaction();
+
+            I2CDevice &m_Dev;
+            size_t m_Tx;
+            size_t m_Rx;
+            int64_t m_StartUs;
+        };
+
+        //queues a transfer through the driver (call) with t at the end of the pending list
+        //counted: tx/rx go into m_Stats on completion (the blocking calls count through Transaction instead)
+        template<class F>
+        esp_err_t submit(Transfer &t, F &&call, bool counted = false, size_t tx = 0, size_t rx = 0);
+        //blocking transfer: straight driver call, or queued and waited for in async mode
+        template<class F>
+        esp_err_t run(F &&call);
+        static bool on_trans_done(i2c_master_dev_handle_t h, const i2c_master_event_data_t *pEvt, void *pArg);
+        //completes the transfers still on the pending list with e
+        void fail_pending(esp_err_t e);
+        esp_err_t register_callbacks();
+
         const I2CBusMaster &m_Bus;
         i2c_master_dev_handle_t m_Handle = nullptr;
         i2c_device_config_t m_Config;
+        BurstMode m_Burst = BurstMode::AutoIncrement;
+        uint8_t m_BurstFlag = 0;
+        Stats m_Stats;
+        RegCache *m_pRegCache = nullptr;
+        bool m_Async = false;
+        //pending async transfers in submission order (the driver completes them in that order), free running indices
+        Transfer *m_Pending[kMaxPending];
+        size_t m_PendingHead = 0;
+        size_t m_PendingTail = 0;
+        portMUX_TYPE m_PendingMux = portMUX_INITIALIZER_UNLOCKED;
+        int64_t m_LastDoneUs = 0;//completion of the previous async transfer, written by on_trans_done
     };
 
     namespace helpers
     {
         constexpr static const duration_t kTimeout = duration_t(500);
-        enum class RegAccess: uint8_t
-        {
-            Read = 0x01,
-            Write = 0x02,
-            RW = 0x03
-        };
 
         enum class ByteOrder
         {
@@ -160,51 +296,19 @@ public:
             ExpectedValue<V> Read() const requires (access == RegAccess::Read || access == RegAccess::RW)
             {
                 V res{};
-                uint8_t *pDst = reinterpret_cast<uint8_t *>(&res);
-                for(size_t i = 0; i < sizeof(V); ++i)
-                {
-                    if (auto res = d.ReadReg8(uint8_t(r) + i, kTimeout); !res)
-                        return std::unexpected(res.error());
-                    else
-                        pDst[i] = res->v;
-                }
+                if (auto ret = d.ReadRegs(uint8_t(r), {reinterpret_cast<uint8_t *>(&res), sizeof(V)}, kTimeout); !ret)
+                    return std::unexpected(ret.error());
                 return res;
             }
 
             ExpectedRes Write(V const& v) const requires (access == RegAccess::Write || access == RegAccess::RW)
             {
-                const uint8_t *pSrc = reinterpret_cast<const uint8_t *>(&v);
-                for(size_t i = 0; i < sizeof(V); ++i)
-                {
-                    if (auto res = d.WriteReg8(uint8_t(r) + i, pSrc[i], kTimeout); !res)
-                        return std::unexpected(res.error());
-                }
+                if (auto ret = d.WriteRegs(uint8_t(r), {reinterpret_cast<const uint8_t *>(&v), sizeof(V)}, kTimeout); !ret)
+                    return std::unexpected(ret.error());
                 return {};
             }
         };
 
-        struct ByteCfg
-        {
-            uint8_t offset;
-            uint8_t bit_off = 0;
-            uint8_t bit_len = 8;
-        };
-        template<uint8_t N>
-        struct RegConfig
-        {
-            using reg_config_tag = void;
-            uint8_t addr;
-            RegAccess access;
-            ByteCfg bytes[N];
-        };
-
-        template<class... T> requires (std::is_same_v<T, ByteCfg> && ...)
-        auto ConfigBytes(uint8_t baseAddr, RegAccess access, T... bytes)
-        {
-            RegConfig<sizeof...(T)> res{baseAddr, access, {bytes...}};
-            return res;
-        }
-
         template<typename V, auto r, RegAccess access, ByteOrder bo = ByteOrder::LE, size_t word_size = 0> 
             requires (!std::is_polymorphic_v<V>) && ((word_size == 0) || ((sizeof(V) % word_size == 0) && (word_size % 2 == 0)))
         struct RegisterMultiByte
@@ -214,7 +318,7 @@ public:
             ExpectedRes Read(V &res) const requires (access == RegAccess::Read || access == RegAccess::RW)
             {
                 uint8_t *pDst = (uint8_t*)&res;
-                auto ret = d.ReadRegMulti(uint8_t(r), {pDst, sizeof(V)}, kTimeout);
+                auto ret = d.ReadRegs(uint8_t(r), {pDst, sizeof(V)}, kTimeout);
                 if (ret)
                 {
                     if constexpr (bo == ByteOrder::BE)
@@ -283,7 +387,7 @@ public:
                     }
                     pSrc = buf;
                 }
-                auto ret = d.WriteRegMulti(uint8_t(r), {pSrc, sizeof(V)}, kTimeout);
+                auto ret = d.WriteRegs(uint8_t(r), {pSrc, sizeof(V)}, kTimeout);
                 if (ret)
                     return {};
                 else
@@ -294,38 +398,43 @@ public:
         template<typename V, auto regCfg> requires (!std::is_polymorphic_v<V> && requires { typename decltype(regCfg)::reg_config_tag; })
         struct RegisterCustomBytes
         {
+            using Layout = CustomBytesLayout<regCfg>;
+            static_assert(Layout::valid(), "bit fields must stay within a byte and sum up to 64 bits at most");
+            static_assert(sizeof(V) <= sizeof(uint64_t) && Layout::kBits <= sizeof(V) * 8, "value too small for the layout");
+
             i2c::I2CDevice &d;
 
+            //bits above the layout keep their value in res
             ExpectedRes Read(V &res) const requires (regCfg.access == RegAccess::Read || regCfg.access == RegAccess::RW)
             {
-                uint8_t *pDst = reinterpret_cast<uint8_t*>(&res);
-                size_t dstBitOffset = 0;
-                uint8_t tempDst[std::size(regCfg.bytes)];
-                if (auto r = d.ReadRegMulti(regCfg.addr, tempDst); !r)
+                uint8_t raw[Layout::kSpan];
+                if (auto r = d.ReadRegs(regCfg.addr, raw, kTimeout); !r)
                     return std::unexpected(r.error());
 
-                for(int i = 0; i < std::size(tempDst); ++i)
+                constexpr uint64_t kValueMask = Layout::kBits == 64 ? ~uint64_t(0) : (uint64_t(1) << Layout::kBits) - 1;
+                uint64_t v = 0;
+                std::memcpy(&v, &res, sizeof(V));
+                v = (v & ~kValueMask) | Layout::extract(raw, std::make_index_sequence<Layout::N>());
+                std::memcpy(&res, &v, sizeof(V));
+                return {};
+            }
+
+            //registers only partially covered by the layout are read first and keep their other bits
+            ExpectedRes Write(V const& val) const
+                requires (regCfg.access == RegAccess::RW || (regCfg.access == RegAccess::Write && Layout::kFullBytes))
+            {
+                uint64_t v = 0;
+                std::memcpy(&v, &val, sizeof(V));
+                uint8_t raw[Layout::kSpan];
+                if constexpr (!Layout::kFullBytes)
                 {
-                    auto b = regCfg.bytes[i];
-                    uint8_t v = tempDst[i];
-                    uint8_t bits_src_left = b.bit_len;
-                    v = (v >> b.bit_off) & ((1 << b.bit_len) - 1);
-                    uint8_t bits_dst_off = dstBitOffset % 8;
-                    uint8_t *pT = pDst + dstBitOffset / 8;
-                    uint8_t bits_dst_eff = std::min(uint8_t(8 - bits_dst_off), bits_src_left);
-                    uint8_t maskToClear = (1 << bits_dst_eff) - 1;
-                    *pT &= ~(maskToClear << bits_dst_off);//clear the bits
-                    *pT |= v << bits_dst_off;
-                    dstBitOffset += bits_dst_eff;
-                    bits_src_left -= bits_dst_eff;
-                    if (bits_src_left)
-                    {
-                        ++pT;
-                        v = tempDst[i];
-                        *pT = (v >> (b.bit_off + b.bit_len - bits_src_left)) & ((1 << bits_src_left) - 1);
-                        dstBitOffset += bits_src_left;
-                    }
+                    if (auto r = d.ReadRegs(regCfg.addr, raw, kTimeout); !r)
+                        return std::unexpected(r.error());
                 }
+                Layout::insert(raw, v, std::make_index_sequence<Layout::N>());
+                if (auto r = d.WriteRegs(regCfg.addr, raw, kTimeout); !r)
+                    return std::unexpected(r.error());
+                return {};
             }
         };
     }
@@ -0,0 +1,118 @@
+#ifndef PH_I2C_LAYOUT_HPP_
+#define PH_I2C_LAYOUT_HPP_
+
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <iterator>
+#include <type_traits>
+#include <utility>
+
+//register access and bit layout descriptions used by i2c::helpers
+//Nothing in here depends on the driver, so it builds for the host as well.
+namespace i2c
+{
+    namespace helpers
+    {
+        enum class RegAccess: uint8_t
+        {
+            Read = 0x01,
+            Write = 0x02,
+            RW = 0x03
+        };
+
+        struct ByteCfg
+        {
+            uint8_t offset;
+            uint8_t bit_off = 0;
+            uint8_t bit_len = 8;
+        };
+        template<uint8_t N>
+        struct RegConfig
+        {
+            using reg_config_tag = void;
+            uint8_t addr;
+            RegAccess access;
+            ByteCfg bytes[N];
+        };
+
+        template<class... T> requires (std::is_same_v<T, ByteCfg> && ...)
+        constexpr auto ConfigBytes(uint8_t baseAddr, RegAccess access, T... bytes)
+        {
+            RegConfig<sizeof...(T)> res{baseAddr, access, {bytes...}};
+            return res;
+        }
+
+        //bit layout of a RegConfig, resolved at compile time: byte i of the config contributes bits
+        //[bit_off, bit_off + bit_len) of register addr + offset and lands at kShift[i] in the value, lsb first
+        template<auto regCfg>
+        struct CustomBytesLayout
+        {
+            static constexpr size_t N = std::size(regCfg.bytes);
+
+            static constexpr std::array<uint8_t, N> kShift = []{
+                std::array<uint8_t, N> s{};
+                uint8_t off = 0;
+                for(size_t i = 0; i < N; ++i)
+                {
+                    s[i] = off;
+                    off += regCfg.bytes[i].bit_len;
+                }
+                return s;
+            }();
+
+            static constexpr size_t kBits = []{
+                size_t bits = 0;
+                for(auto b : regCfg.bytes)
+                    bits += b.bit_len;
+                return bits;
+            }();
+
+            //registers covered, from addr
+            static constexpr size_t kSpan = []{
+                size_t span = 0;
+                for(auto b : regCfg.bytes)
+                    span = std::max(span, size_t(b.offset) + 1);
+                return span;
+            }();
+
+            //every bit of every covered register is owned: writes need no read-modify-write
+            static constexpr bool kFullBytes = []{
+                uint8_t owned[kSpan]{};
+                for(auto b : regCfg.bytes)
+                    owned[b.offset] |= uint8_t(((1u << b.bit_len) - 1) << b.bit_off);
+                for(auto o : owned)
+                    if (o != 0xff)
+                        return false;
+                return true;
+            }();
+
+            static constexpr bool valid()
+            {
+                for(auto b : regCfg.bytes)
+                    if (!b.bit_len || b.bit_off + b.bit_len > 8)
+                        return false;
+                return kBits <= 64;
+            }
+
+            template<size_t I>
+            static constexpr uint64_t kMask = (1u << regCfg.bytes[I].bit_len) - 1;
+
+            template<size_t... I>
+            static constexpr uint64_t extract(const uint8_t *pRaw, std::index_sequence<I...>)
+            {
+                return ((((uint64_t(pRaw[regCfg.bytes[I].offset]) >> regCfg.bytes[I].bit_off) & kMask<I>) << kShift[I]) | ... | 0);
+            }
+
+            template<size_t... I>
+            static constexpr void insert(uint8_t *pRaw, uint64_t v, std::index_sequence<I...>)
+            {
+                ((pRaw[regCfg.bytes[I].offset] = uint8_t((pRaw[regCfg.bytes[I].offset] & ~(kMask<I> << regCfg.bytes[I].bit_off))
+                                                         | (((v >> kShift[I]) & kMask<I>) << regCfg.bytes[I].bit_off))), ...);
+            }
+        };
+    }
+}
+
+#endif
@@ -0,0 +1,209 @@
+#ifndef PH_I2C_REGMAP_HPP_
+#define PH_I2C_REGMAP_HPP_
+#include "ph_i2c.hpp"
+#include <algorithm>
+#include <array>
+#include <cstring>
+
+namespace i2c
+{
+    //compile-time register map: registers are described once, ReadMany plans the bus transfers at compile time
+    //
+    //    using Imu = regmap::Map<regmap::AddrWidth::Bits8>;
+    //    using STATUS = regmap::Reg<0x1e, uint8_t>;
+    //    using TEMP = regmap::Reg<0x20, int16_t>;
+    //    using GYRO = regmap::Reg<0x22, std::array<int16_t, 3>>;
+    //    using ACCEL = regmap::Reg<0x28, std::array<int16_t, 3>>;
+    //    Imu::ReadMany<STATUS, TEMP, GYRO, ACCEL>(dev, status, temp, gyro, accel);//one burst 0x1e..0x2d
+    //
+    //Registers are sorted by address and merged into one burst as long as the hole between them is at most
+    //maxGap bytes (the hole is read and dropped) and the burst stays within maxBurst bytes. Use maxGap = 0
+    //for chips with clear-on-read registers in between.
+    //Values are decoded per element: scalars and arrays of scalars honor the byte order, anything else is
+    //copied as is.
+    namespace regmap
+    {
+        using helpers::ByteOrder;
+        using helpers::RegAccess;
+        using helpers::ExpectedValue;
+        using helpers::ExpectedRes;
+
+        enum class AddrWidth: uint8_t
+        {
+            Bits8,
+            Bits16,//sent big endian
+        };
+
+        template<uint16_t addr, class V, ByteOrder bo = ByteOrder::LE, RegAccess access = RegAccess::Read>
+            requires std::is_trivially_copyable_v<V>
+        struct Reg
+        {
+            using value_type = V;
+            static constexpr uint16_t kAddr = addr;
+            static constexpr size_t kSize = sizeof(V);
+            static constexpr ByteOrder kOrder = bo;
+            static constexpr RegAccess kAccess = access;
+        };
+
+        namespace details
+        {
+            template<class V>
+            struct elem
+            {
+                using type = V;
+            };
+
+            template<class E, size_t N>
+            struct elem<E[N]>
+            {
+                using type = E;
+            };
+
+            template<class E, size_t N>
+            struct elem<std::array<E, N>>
+            {
+                using type = E;
+            };
+
+            template<class R>
+            void swap_elements(uint8_t *p)
+            {
+                using E = typename elem<typename R::value_type>::type;
+                if constexpr (R::kOrder == ByteOrder::BE && std::is_arithmetic_v<E> && sizeof(E) > 1)
+                {
+                    for(size_t i = 0; i < R::kSize; i += sizeof(E))
+                        std::reverse(p + i, p + i + sizeof(E));
+                }
+            }
+
+            struct Burst
+            {
+                uint16_t addr = 0;
+                uint16_t len = 0;
+                uint16_t off = 0;//in the scratch buffer
+            };
+
+            template<size_t N>
+            struct Plan
+            {
+                Burst bursts[N];
+                size_t count = 0;
+                uint16_t regOff[N]{};//register i (in ReadMany order) in the scratch buffer
+                size_t total = 0;
+            };
+
+            template<size_t maxGap, size_t maxBurst, size_t N>
+            constexpr Plan<N> make_plan(std::array<uint16_t, N> addr, std::array<uint16_t, N> size)
+            {
+                std::array<size_t, N> o{};
+                for(size_t i = 0; i < N; ++i)
+                    o[i] = i;
+                for(size_t i = 1; i < N; ++i)
+                    for(size_t j = i; j > 0 && addr[o[j]] < addr[o[j - 1]]; --j)
+                        std::swap(o[j], o[j - 1]);
+
+                Plan<N> p;
+                for(size_t k = 0; k < N; ++k)
+                {
+                    size_t i = o[k];
+                    size_t end = addr[i] + size[i];
+                    if (p.count)
+                    {
+                        Burst &b = p.bursts[p.count - 1];
+                        size_t bEnd = b.addr + b.len;
+                        size_t newEnd = std::max(bEnd, end);
+                        if (addr[i] <= bEnd + maxGap && newEnd - b.addr <= maxBurst)
+                        {
+                            p.total += newEnd - bEnd;
+                            b.len = uint16_t(newEnd - b.addr);
+                            p.regOff[i] = uint16_t(b.off + addr[i] - b.addr);
+                            continue;
+                        }
+                    }
+                    //registers bigger than maxBurst get a burst of their own
+                    p.bursts[p.count++] = Burst{addr[i], size[i], uint16_t(p.total)};
+                    p.regOff[i] = uint16_t(p.total);
+                    p.total += size[i];
+                }
+                return p;
+            }
+        }
+
+        template<AddrWidth aw = AddrWidth::Bits8, size_t maxGap = 2, size_t maxBurst = 32>
+        struct Map
+        {
+            template<class... Regs>
+            static constexpr auto kPlan = details::make_plan<maxGap, maxBurst, sizeof...(Regs)>({Regs::kAddr...}, {uint16_t(Regs::kSize)...});
+
+            //number of bus transactions ReadMany<Regs...> takes
+            template<class... Regs>
+            static constexpr size_t kBursts = kPlan<Regs...>.count;
+
+            template<class... Regs> requires (sizeof...(Regs) > 0)
+            static ExpectedRes ReadMany(I2CDevice &d, typename Regs::value_type&... out)
+            {
+                static_assert(((Regs::kAccess != RegAccess::Write) && ...), "write-only register");
+                static_assert((((aw == AddrWidth::Bits16) || (Regs::kAddr + Regs::kSize <= 0x100)) && ...), "register address out of range");
+                constexpr auto &plan = kPlan<Regs...>;
+
+                uint8_t buf[plan.total];
+                for(size_t b = 0; b < plan.count; ++b)
+                {
+                    auto &burst = plan.bursts[b];
+                    if (auto r = read(d, burst.addr, {buf + burst.off, burst.len}); !r)
+                        return std::unexpected(r.error());
+                }
+
+                size_t i = 0;
+                (decode<Regs>(buf + plan.regOff[i++], out), ...);
+                return {};
+            }
+
+            template<class R>
+            static ExpectedValue<typename R::value_type> Read(I2CDevice &d)
+            {
+                typename R::value_type v{};
+                if (auto r = ReadMany<R>(d, v); !r)
+                    return std::unexpected(r.error());
+                return v;
+            }
+
+            template<class R>
+            static ExpectedRes Write(I2CDevice &d, typename R::value_type const& v)
+            {
+                static_assert(R::kAccess != RegAccess::Read, "read-only register");
+                static_assert(aw == AddrWidth::Bits16 || R::kAddr + R::kSize <= 0x100, "register address out of range");
+                uint8_t buf[R::kSize];
+                std::memcpy(buf, &v, R::kSize);
+                details::swap_elements<R>(buf);
+                if (auto r = write(d, R::kAddr, buf); !r)
+                    return std::unexpected(r.error());
+                return {};
+            }
+        private:
+            static I2CDevice::ExpectedResult read(I2CDevice &d, uint16_t addr, std::span<uint8_t> dst)
+            {
+                if constexpr (aw == AddrWidth::Bits8)
+                    return d.ReadRegs(uint8_t(addr), dst, helpers::kTimeout);
+                else
+                    return d.ReadRegs16(addr, dst, helpers::kTimeout);
+            }
+
+            static I2CDevice::ExpectedResult write(I2CDevice &d, uint16_t addr, std::span<const uint8_t> src)
+            {
+                if constexpr (aw == AddrWidth::Bits8)
+                    return d.WriteRegs(uint8_t(addr), src, helpers::kTimeout);
+                else
+                    return d.WriteRegs16(addr, src, helpers::kTimeout);
+            }
+
+            template<class R>
+            static void decode(const uint8_t *pSrc, typename R::value_type &v)
+            {
+                std::memcpy(&v, pSrc, R::kSize);
+                details::swap_elements<R>(reinterpret_cast<uint8_t*>(&v));
+            }
+        };
+    }
+}
+#endif
@@ -0,0 +1,122 @@
+#ifndef PH_I2C_SCHED_HPP_
+#define PH_I2C_SCHED_HPP_
+#include "ph_i2c.hpp"
+#include "lib_function.hpp"
+#include "freertos/task.h"
+
+namespace i2c
+{
+    //owns the traffic of one bus: tasks hand in jobs with a priority and a deadline, the scheduler task runs
+    //them one at a time in order of urgency
+    //
+    //    sched.Run(imu, {.prio = 5, .deadline = duration_ms_t{2}}, [&](I2CDevice &d){ return Regs::ReadMany<...>(d, ...); });
+    //    sched.Submit(eeprom, {}, [&](I2CDevice &d){ return d.WriteRegs(...); }, [](esp_err_t e){ ... });
+    //
+    //Ordering:
+    //- Policy::EDF: earliest deadline first, jobs without a deadline after those, by priority
+    //- Policy::PriorityAging: priority, raised by one for every Config::agingMs a job has been waiting
+    //Jobs of equal rank go first come first served, except that the device just served wins a tie, up to
+    //Config::batch jobs in a row: back-to-back transfers to one device get batched without ever overtaking a
+    //more urgent job.
+    //A job runs on the scheduler task with the bus to itself, so devices on a scheduled bus need no access
+    //lock; don't use them outside of jobs then.
+    class BusScheduler
+    {
+    public:
+        using Ref = std::reference_wrapper<BusScheduler>;
+        using ExpectedResult = std::expected<Ref, Err>;
+
+        static constexpr size_t kMaxJobs = 16;
+
+        enum class Policy: uint8_t
+        {
+            EDF,
+            PriorityAging,
+        };
+
+        struct Config
+        {
+            Policy policy = Policy::EDF;
+            uint32_t agingMs = 10;
+            size_t batch = 4;
+            uint32_t stackSize = 3072;
+            UBaseType_t prio = 10;
+        };
+
+        struct Request
+        {
+            uint8_t prio = 0;//higher first
+            duration_ms_t deadline = kForever;//from submission; ordering with EDF, Stats::late with either policy
+        };
+
+        struct Stats
+        {
+            std::atomic<uint32_t> jobs{0};
+            std::atomic<uint32_t> batched{0};//jobs that ran right after one for the same device
+            std::atomic<uint32_t> late{0};//jobs that started after their deadline
+            std::atomic<uint32_t> rejected{0};//queue full
+            std::atomic<uint32_t> depth{0};//queued right now
+            std::atomic<uint32_t> max_depth{0};
+            std::atomic<uint32_t> wait_max_us{0};//submission to start
+            std::atomic<uint64_t> wait_total_us{0};//over jobs
+        };
+
+        //runs on the scheduler task
+        using Job = GenericCallback<esp_err_t(I2CDevice&)>;
+        using DoneCallback = GenericCallback<void(esp_err_t)>;
+
+        BusScheduler(I2CBusMaster &bus);
+        BusScheduler(I2CBusMaster &bus, Config cfg);
+        ~BusScheduler();
+
+        ExpectedResult Start();
+        //jobs still queued are completed with ESP_ERR_INVALID_STATE
+        ExpectedResult Stop();
+
+        //queues the job and waits for it to run: the job's result
+        //ESP_ERR_NO_MEM when kMaxJobs jobs are queued
+        esp_err_t Run(I2CDevice &d, Request r, Job job);
+        //queues the job and returns, done (if any) is called on the scheduler task with the job's result
+        ExpectedResult Submit(I2CDevice &d, Request r, Job job, DoneCallback done = {});
+
+        const Stats& GetStats() const { return m_Stats; }
+        I2CBusMaster& GetBus() { return m_Bus; }
+    private:
+        struct Entry
+        {
+            I2CDevice *pDev = nullptr;
+            Job job;
+            DoneCallback done;
+            SemaphoreHandle_t waiter = nullptr;//Run
+            esp_err_t *pResult = nullptr;
+            int64_t submittedUs = 0;
+            int64_t deadlineUs = INT64_MAX;
+            uint32_t seq = 0;
+            uint8_t prio = 0;
+            bool used = false;
+        };
+
+        static void task_loop(void *pArg);
+        //runs the most urgent job, false if there was none
+        bool run_one();
+        esp_err_t queue(I2CDevice &d, Request r, Job &&job, DoneCallback &&done, SemaphoreHandle_t waiter, esp_err_t *pResult);
+        //the next job to run, nullptr if none; under m_Lock
+        Entry* pick(int64_t now);
+        //true if a goes before b
+        bool before(const Entry &a, const Entry &b, int64_t now) const;
+        void finish(Entry &e, esp_err_t err);
+
+        I2CBusMaster &m_Bus;
+        Config m_Config;
+        Entry m_Jobs[kMaxJobs];
+        uint32_t m_Seq = 0;
+        I2CDevice *m_pLastDev = nullptr;
+        size_t m_BatchLen = 0;
+        SemaphoreHandle_t m_Lock = nullptr;
+        SemaphoreHandle_t m_Stopped = nullptr;
+        TaskHandle_t m_Task = nullptr;
+        std::atomic<bool> m_Stop{false};
+        Stats m_Stats;
+    };
+}
+#endif
@@ -0,0 +1,230 @@
+#ifndef PH_I2C_SHADOW_HPP_
+#define PH_I2C_SHADOW_HPP_
+#include "ph_i2c.hpp"
+#include <array>
+#include <bitset>
+
+namespace i2c
+{
+    //shadow register file for an I2CDevice
+    //
+    //    using CTRL1 = shadow::Reg<0x20>;
+    //    using CTRL2 = shadow::Reg<0x21>;
+    //    using STATUS = shadow::Reg<0x27, shadow::Kind::Volatile>;
+    //    using ODR = shadow::Field<CTRL1, 4, 4>;
+    //    using HPF = shadow::Field<CTRL2, 2>;
+    //    shadow::Registers<CTRL1, CTRL2, STATUS> regs{dev};
+    //    regs.Set<ODR>(5); regs.Set<HPF>(1);//staged, no bus traffic once both registers are known
+    //    regs.Commit();//one burst write 0x20..0x21
+    //
+    //Cached registers are read from the device once and served from the shadow afterwards, volatile ones
+    //(status, data, self-clearing bits) always go to the bus. Set stages a new value and marks the register
+    //dirty, Commit writes the dirty registers with one WriteRegs per run of consecutive addresses.
+    //The shadow attaches itself as the device's RegCache, so direct register writes keep it coherent.
+    //Not thread safe: use it from the task that owns the device.
+    namespace shadow
+    {
+        using helpers::ExpectedValue;
+        using helpers::ExpectedRes;
+
+        enum class Kind: uint8_t
+        {
+            Cached,
+            Volatile,
+        };
+
+        template<uint8_t a, Kind k = Kind::Cached>
+        struct Reg
+        {
+            static constexpr uint8_t kAddr = a;
+            static constexpr Kind kKind = k;
+        };
+
+        //bits [off, off + len) of a register
+        template<class R, uint8_t off, uint8_t len = 1> requires (off + len <= 8 && len > 0)
+        struct Field
+        {
+            using reg = R;
+            static constexpr uint8_t kOff = off;
+            static constexpr uint8_t kMask = uint8_t(((1u << len) - 1) << off);
+        };
+
+        template<class T>
+        concept reg_c = requires { T::kAddr; T::kKind; };
+
+        template<class T>
+        concept field_c = reg_c<typename T::reg> && requires { T::kMask; };
+
+        template<reg_c... Regs>
+        class Registers: public I2CDevice::RegCache
+        {
+            static constexpr size_t N = sizeof...(Regs);
+            static constexpr std::array<uint8_t, N> kAddr{Regs::kAddr...};
+            static constexpr std::array<bool, N> kVolatile{(Regs::kKind == Kind::Volatile)...};
+
+            //indices sorted by address, so runs of consecutive registers can be found in one pass
+            static constexpr std::array<uint8_t, N> kOrder = []{
+                std::array<uint8_t, N> o{};
+                for(size_t i = 0; i < N; ++i)
+                    o[i] = uint8_t(i);
+                for(size_t i = 1; i < N; ++i)
+                    for(size_t j = i; j > 0 && kAddr[o[j]] < kAddr[o[j - 1]]; --j)
+                        std::swap(o[j], o[j - 1]);
+                return o;
+            }();
+
+            static_assert(N > 0 && N <= 255);
+            static_assert([]{
+                for(size_t i = 1; i < N; ++i)
+                    if (kAddr[kOrder[i]] == kAddr[kOrder[i - 1]])
+                        return false;
+                return true;
+            }(), "register declared twice");
+
+            template<class R>
+            static constexpr size_t index_of()
+            {
+                static_assert((std::is_same_v<R, Regs> || ...), "register is not part of this shadow");
+                size_t i = 0;
+                ((std::is_same_v<R, Regs> ? false : (++i, true)) && ...);
+                return i;
+            }
+
+        public:
+            Registers(I2CDevice &d): m_Dev(d) { d.SetRegCache(this); }
+            ~Registers()
+            {
+                if (m_Dev.GetRegCache() == this)
+                    m_Dev.SetRegCache(nullptr);
+            }
+            Registers(const Registers &) = delete;
+            Registers& operator=(const Registers &) = delete;
+
+            template<reg_c R>
+            ExpectedValue<uint8_t> Get()
+            {
+                constexpr size_t i = index_of<R>();
+                if (m_Dirty[i] || (!kVolatile[i] && m_Valid[i]))
+                    return m_Val[i];
+                if (auto r = m_Dev.ReadReg8(kAddr[i], helpers::kTimeout); !r)
+                    return std::unexpected(r.error());
+                else
+                {
+                    m_Val[i] = r->v;
+                    m_Valid[i] = !kVolatile[i];
+                    return r->v;
+                }
+            }
+
+            template<field_c F>
+            ExpectedValue<uint8_t> Get()
+            {
+                auto v = Get<typename F::reg>();
+                if (!v)
+                    return v;
+                return uint8_t((*v & F::kMask) >> F::kOff);
+            }
+
+            //staged until Commit
+            template<reg_c R>
+            void Set(uint8_t v)
+            {
+                constexpr size_t i = index_of<R>();
+                m_Val[i] = v;
+                m_Dirty[i] = true;
+            }
+
+            //staged until Commit; reads the register first unless its value is known
+            template<field_c F>
+            ExpectedRes Set(uint8_t v)
+            {
+                auto cur = Get<typename F::reg>();
+                if (!cur)
+                    return std::unexpected(cur.error());
+                Set<typename F::reg>(uint8_t((*cur & ~F::kMask) | ((v << F::kOff) & F::kMask)));
+                return {};
+            }
+
+            //writes the dirty registers, one burst per run of consecutive addresses
+            ExpectedRes Commit()
+            {
+                for(size_t k = 0; k < N; )
+                {
+                    size_t i = kOrder[k];
+                    if (!m_Dirty[i])
+                    {
+                        ++k;
+                        continue;
+                    }
+                    size_t len = 1;
+                    while(k + len < N && m_Dirty[kOrder[k + len]] && kAddr[kOrder[k + len]] == kAddr[i] + len)
+                        ++len;
+                    uint8_t run[N];
+                    for(size_t j = 0; j < len; ++j)
+                        run[j] = m_Val[kOrder[k + j]];
+
+                    if (auto r = m_Dev.WriteRegs(kAddr[i], {run, len}, helpers::kTimeout); !r)
+                        return std::unexpected(r.error());
+                    for(size_t j = 0; j < len; ++j)
+                        m_Dirty[kOrder[k + j]] = false;
+                    k += len;
+                }
+                return {};
+            }
+
+            //reads all cached registers, one burst per run of consecutive addresses
+            ExpectedRes Load()
+            {
+                for(size_t k = 0; k < N; )
+                {
+                    size_t i = kOrder[k];
+                    if (kVolatile[i])
+                    {
+                        ++k;
+                        continue;
+                    }
+                    size_t len = 1;
+                    while(k + len < N && !kVolatile[kOrder[k + len]] && kAddr[kOrder[k + len]] == kAddr[i] + len)
+                        ++len;
+                    uint8_t run[N];
+                    if (auto r = m_Dev.ReadRegs(kAddr[i], {run, len}, helpers::kTimeout); !r)
+                        return std::unexpected(r.error());
+                    for(size_t j = 0; j < len; ++j)
+                    {
+                        size_t idx = kOrder[k + j];
+                        if (m_Dirty[idx])
+                            continue;//staged values win
+                        m_Val[idx] = run[j];
+                        m_Valid[idx] = true;
+                    }
+                    k += len;
+                }
+                return {};
+            }
+
+            //forgets known values (after a chip reset), staged ones stay
+            void Invalidate() { m_Valid.reset(); }
+            //drops staged values
+            void Discard() { m_Dirty.reset(); }
+            bool IsDirty() const { return m_Dirty.any(); }
+
+            void OnRegWrite(uint8_t reg, std::span<const uint8_t> src) override
+            {
+                for(size_t i = 0; i < N; ++i)
+                {
+                    if (kAddr[i] < reg || kAddr[i] - reg >= src.size())
+                        continue;
+                    m_Val[i] = src[kAddr[i] - reg];
+                    m_Valid[i] = !kVolatile[i];
+                    m_Dirty[i] = false;
+                }
+            }
+        private:
+            I2CDevice &m_Dev;
+            std::array<uint8_t, N> m_Val{};
+            std::bitset<N> m_Valid;
+            std::bitset<N> m_Dirty;
+        };
+    }
+}
+#endif
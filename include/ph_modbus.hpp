@@ -0,0 +1,83 @@
+#ifndef PH_MODBUS_HPP_
+#define PH_MODBUS_HPP_
+
+#include "ph_uart.hpp"
+#include "ph_modbus_frame.hpp"
+
+//Modbus RTU master over uart::Channel (RS-485 direction control is left to the driver, UART_MODE_RS485_HALF_DUPLEX)
+namespace modbus
+{
+    class Master
+    {
+    public:
+        using Ref = std::reference_wrapper<Master>;
+        using ExpectedResult = std::expected<Ref, Err>;
+
+        template<typename V>
+        using RetVal = RetValT<Ref, V>;
+
+        template<typename V>
+        using ExpectedValue = std::expected<RetVal<V>, Err>;
+
+        static constexpr duration_ms_t kDefaultTimeout = duration_ms_t{200};
+        static constexpr duration_ms_t kDefaultTurnaround = duration_ms_t{100};
+
+        Master(uart::Channel &c);
+
+        //response timeout used for slaves without one of their own
+        Master& SetTimeout(duration_ms_t t) { m_DefaultTimeout = t; return *this; }
+        duration_ms_t GetTimeout() const { return m_DefaultTimeout; }
+
+        Master& SetSlaveTimeout(uint8_t slave, duration_ms_t t);
+        duration_ms_t GetSlaveTimeout(uint8_t slave) const;
+
+        //how long slaves get to process a broadcast before the next request goes out
+        Master& SetTurnaroundDelay(duration_ms_t t) { m_Turnaround = t; return *this; }
+        duration_ms_t GetTurnaroundDelay() const { return m_Turnaround; }
+
+        //character time and the t1.5/t3.5 silences are taken from the channel's current line settings
+        uint32_t GetCharTimeUs() const;
+        uint32_t GetFrameSilenceUs() const;//t3.5
+
+        //one request/response exchange
+        //the view points into the master's receive buffer and stays valid until the next exchange;
+        //an exception response is a successful exchange, check ResponseView::exception()
+        //broadcasts return an empty view after the turnaround delay
+        ExpectedValue<ResponseView> Transact(const Pdu &req);
+
+        //request of a batch: where the results go and how it ended
+        struct Request
+        {
+            Pdu pdu;
+            std::span<uint16_t> read_regs = {};//ReadHoldingRegisters/ReadInputRegisters, pdu.count values
+            std::span<uint8_t> read_bits = {};//ReadCoils/ReadDiscreteInputs, packed LSB first
+            esp_err_t result = ESP_FAIL;
+            Exception exception = Exception::None;
+        };
+
+        //runs the requests back to back: the next frame is encoded while the current one is on the wire,
+        //requests to a slave that has already timed out in this batch fail right away with ESP_ERR_TIMEOUT
+        //returns the amount of requests that succeeded (result == ESP_OK)
+        ExpectedValue<size_t> Transact(std::span<Request> batch);
+
+        ExpectedResult ReadRegisters(uint8_t slave, uint16_t addr, std::span<uint16_t> dst, bool input = false);
+        ExpectedResult WriteRegister(uint8_t slave, uint16_t addr, uint16_t v);
+        ExpectedResult WriteRegisters(uint8_t slave, uint16_t addr, std::span<const uint16_t> src);
+    private:
+        void wait_silence();
+        ExpectedResult send(std::span<const uint8_t> adu);
+        ExpectedValue<ResponseView> receive(const Pdu &req, size_t txLen);
+        ExpectedResult store(Request &r, const ResponseView &v);
+
+        uart::Channel &m_C;
+        duration_ms_t m_DefaultTimeout = kDefaultTimeout;
+        duration_ms_t m_Turnaround = kDefaultTurnaround;
+        //0 - use m_DefaultTimeout
+        std::array<uint16_t, 248> m_SlaveTimeoutMs{};
+        //end of the last activity on the line (esp_timer us)
+        int64_t m_LineIdleAt = 0;
+        uint8_t m_Tx[2][kMaxAdu];
+        uint8_t m_Rx[kMaxAdu];
+    };
+}
+#endif
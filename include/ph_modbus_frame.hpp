@@ -0,0 +1,154 @@
+#ifndef PH_MODBUS_FRAME_HPP_
+#define PH_MODBUS_FRAME_HPP_
+
+#include <array>
+#include <cstdint>
+#include <cstddef>
+#include <span>
+
+//Modbus RTU framing: CRC, request encoding, response validation and a register model answering requests.
+//Nothing in here depends on the driver, so it builds for the host as well.
+namespace modbus
+{
+    enum class Function: uint8_t
+    {
+        ReadCoils = 0x01,
+        ReadDiscreteInputs = 0x02,
+        ReadHoldingRegisters = 0x03,
+        ReadInputRegisters = 0x04,
+        WriteSingleCoil = 0x05,
+        WriteSingleRegister = 0x06,
+        WriteMultipleCoils = 0x0f,
+        WriteMultipleRegisters = 0x10,
+    };
+
+    enum class Exception: uint8_t
+    {
+        None = 0,
+        IllegalFunction = 0x01,
+        IllegalDataAddress = 0x02,
+        IllegalDataValue = 0x03,
+        SlaveDeviceFailure = 0x04,
+        Acknowledge = 0x05,
+        SlaveDeviceBusy = 0x06,
+        GatewayPathUnavailable = 0x0a,
+        GatewayTargetFailed = 0x0b,
+    };
+
+    constexpr uint8_t kBroadcast = 0;
+    constexpr size_t kMaxAdu = 256;
+    constexpr size_t kExceptionAdu = 5;
+    constexpr uint16_t kMaxReadRegs = 125;
+    constexpr uint16_t kMaxWriteRegs = 123;
+    constexpr uint16_t kMaxReadBits = 2000;
+    constexpr uint16_t kMaxWriteBits = 1968;
+
+    namespace details
+    {
+        constexpr std::array<uint16_t, 256> make_crc_table()
+        {
+            std::array<uint16_t, 256> t{};
+            for(uint32_t i = 0; i < 256; ++i)
+            {
+                uint16_t c = uint16_t(i);
+                for(int b = 0; b < 8; ++b)
+                    c = (c & 1) ? uint16_t((c >> 1) ^ 0xa001) : uint16_t(c >> 1);
+                t[i] = c;
+            }
+            return t;
+        }
+        inline constexpr std::array<uint16_t, 256> kCrcTable = make_crc_table();
+    }
+
+    //CRC-16/MODBUS, one table lookup per byte
+    constexpr uint16_t crc16(std::span<const uint8_t> data, uint16_t crc = 0xffff)
+    {
+        for(uint8_t b : data)
+            crc = uint16_t((crc >> 8) ^ details::kCrcTable[(crc ^ b) & 0xff]);
+        return crc;
+    }
+    static_assert(crc16(std::array<const uint8_t, 9>{'1','2','3','4','5','6','7','8','9'}) == 0x4b37);
+
+    constexpr uint16_t get_be16(const uint8_t *p) { return uint16_t((p[0] << 8) | p[1]); }
+    constexpr void put_be16(uint8_t *p, uint16_t v) { p[0] = uint8_t(v >> 8); p[1] = uint8_t(v & 0xff); }
+
+    //what gets asked; the data to write is referenced, not copied
+    struct Pdu
+    {
+        uint8_t slave = 1;
+        Function fn = Function::ReadHoldingRegisters;
+        uint16_t addr = 0;
+        uint16_t count = 1;//registers or bits; ignored for the single writes
+        std::span<const uint16_t> regs = {};//WriteSingleRegister (first), WriteMultipleRegisters
+        std::span<const uint8_t> bits = {};//packed LSB first: WriteSingleCoil (bit 0), WriteMultipleCoils
+    };
+
+    //builds the ADU (slave, PDU, CRC) into out; returns its size or 0 if the request is invalid or doesn't fit
+    size_t encode_request(const Pdu &req, std::span<uint8_t> out);
+
+    //size of the normal response to req (exception responses are always kExceptionAdu bytes); 0 for broadcasts
+    size_t response_size(const Pdu &req);
+
+    //read-only view of a validated response ADU, decodes on access straight from the frame
+    class ResponseView
+    {
+    public:
+        ResponseView() = default;
+        explicit ResponseView(std::span<const uint8_t> adu): m_Adu(adu) {}
+
+        bool empty() const { return m_Adu.empty(); }
+        uint8_t slave() const { return m_Adu[0]; }
+        Function fn() const { return Function(m_Adu[1] & 0x7f); }
+        Exception exception() const { return (m_Adu[1] & 0x80) ? Exception(m_Adu[2]) : Exception::None; }
+
+        //payload of read responses (after the byte count)
+        std::span<const uint8_t> data() const;
+        size_t reg_count() const { return data().size() / 2; }
+        uint16_t reg(size_t i) const { return get_be16(data().data() + i * 2); }
+        bool bit(size_t i) const { return (data()[i / 8] >> (i % 8)) & 1; }
+
+        std::span<const uint8_t> adu() const { return m_Adu; }
+    private:
+        std::span<const uint8_t> m_Adu;
+    };
+
+    enum class Check: uint8_t
+    {
+        Ok,
+        BadCrc,
+        BadSize,
+        Mismatch,//different slave/function or the echo of a write doesn't match the request
+    };
+
+    //validates a complete response ADU against the request it answers
+    Check check_response(const Pdu &req, std::span<const uint8_t> adu);
+
+    //register/coil image of a slave answering requests; the storage is owned by the caller
+    //meant as the device side of a link and for simulating slaves on the host
+    class SlaveModel
+    {
+    public:
+        struct Storage
+        {
+            std::span<uint8_t> coils;//packed LSB first
+            std::span<uint8_t> discrete;//packed LSB first
+            std::span<uint16_t> holding;
+            std::span<uint16_t> input;
+        };
+
+        SlaveModel(uint8_t addr, Storage s): m_Addr(addr), m_S(s) {}
+
+        uint8_t GetAddress() const { return m_Addr; }
+
+        //processes a request ADU, builds the response into out
+        //returns the response size, 0 if there's nothing to answer (other slave, broadcast, bad CRC)
+        size_t Handle(std::span<const uint8_t> req, std::span<uint8_t> out);
+    private:
+        size_t exception(Function fn, Exception e, std::span<uint8_t> out);
+        size_t finish(std::span<uint8_t> out, size_t len);
+
+        uint8_t m_Addr;
+        Storage m_S;
+    };
+}
+#endif
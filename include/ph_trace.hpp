@@ -0,0 +1,83 @@
+#ifndef PH_TRACE_HPP_
+#define PH_TRACE_HPP_
+
+#include <cstdint>
+#include <cstddef>
+#include <span>
+
+//set for the component (and its users) by CONFIG_PH_TRACE_ENABLE in menuconfig
+#ifndef PH_TRACE_ENABLE
+#define PH_TRACE_ENABLE 0
+#endif
+
+//amount of records kept; power of 2
+#ifndef PH_TRACE_RECORDS
+#define PH_TRACE_RECORDS 128
+#endif
+
+//payload bytes kept per record, the rest is only accounted for in Record::total
+#ifndef PH_TRACE_PAYLOAD
+#define PH_TRACE_PAYLOAD 16
+#endif
+
+//Binary trace of the bus traffic shared by uart::Channel and i2c::I2CDevice.
+//
+//Producers claim a slot with one atomic increment and copy at most PH_TRACE_PAYLOAD bytes into it,
+//nothing gets formatted or printed on the hot path. The ring overwrites the oldest records,
+//a Reader notices that and counts the lost ones.
+//Formatting happens elsewhere: in a low priority task (start_printer) or on the host from a raw dump
+//of the records (Record is a plain little-endian struct, see its layout below).
+//With PH_TRACE_ENABLE == 0 PH_TRACE expands to nothing.
+namespace trace
+{
+    static_assert((PH_TRACE_RECORDS & (PH_TRACE_RECORDS - 1)) == 0, "PH_TRACE_RECORDS must be a power of 2");
+    static_assert(PH_TRACE_PAYLOAD <= 255, "PH_TRACE_PAYLOAD must fit a byte");
+
+    enum class Kind: uint8_t
+    {
+        UartTx = 0,
+        UartRx = 1,
+        I2CTx = 2,
+        I2CRx = 3,
+    };
+
+    struct Record
+    {
+        uint32_t seq;       //1-based sequence number of the record, 0 - slot never written
+        uint32_t ts_us;     //lower 32 bits of esp_timer_get_time()
+        uint16_t id;        //uart port or i2c device address
+        uint16_t total;     //amount of bytes transferred, may exceed len
+        Kind kind;
+        uint8_t len;        //bytes kept in payload
+        uint8_t payload[PH_TRACE_PAYLOAD];
+    };
+
+    void record(Kind k, uint16_t id, std::span<const uint8_t> data);
+
+    //consumes records in order; single consumer
+    class Reader
+    {
+    public:
+        //false if there's no new complete record
+        bool next(Record &r);
+        //records overwritten before this reader got to them
+        uint32_t lost() const { return m_Lost; }
+    private:
+        uint32_t m_Next = 1;
+        uint32_t m_Lost = 0;
+    };
+
+    //one text line per record: "<ts_us> <kind> <id> [<total>]: XX XX ..."; returns the amount of chars written
+    size_t format(const Record &r, char *pBuf, size_t len);
+
+    //starts a task that periodically drains the ring into stdout
+    void start_printer(uint32_t period_ms = 100, int prio = 1);
+}
+
+#if PH_TRACE_ENABLE
+#define PH_TRACE(kind, id, pData, len) ::trace::record(kind, uint16_t(id), std::span<const uint8_t>((const uint8_t*)(pData), (len)))
+#else
+#define PH_TRACE(kind, id, pData, len) ((void)0)
+#endif
+
+#endif
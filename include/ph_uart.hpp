@@ -2,7 +2,12 @@
 #define UART_H_
 
 #include "driver/uart.h"
+#include "esp_timer.h"
+#include <atomic>
+#include <chrono>
 #include <expected>
+#include <memory>
+#include <span>
 #include "lib_function.hpp"
 #include "lib_misc_helpers.hpp"
 #include "lib_thread.hpp"
@@ -51,6 +56,85 @@ namespace uart
         Max = UART_HW_FLOWCTRL_MAX
     };
 
+    //absolute point in time an operation has to be finished by
+    struct Deadline
+    {
+        using clock_t = std::chrono::steady_clock;
+        clock_t::time_point at = clock_t::time_point::max();
+
+        static Deadline never() { return {}; }
+        static Deadline after(duration_ms_t d) 
+        { 
+            if (d == kForever) return never();
+            return {clock_t::now() + d}; 
+        }
+
+        bool is_never() const { return at == clock_t::time_point::max(); }
+        bool expired() const { return !is_never() && clock_t::now() >= at; }
+        duration_ms_t remaining() const
+        {
+            if (is_never()) return kForever;
+            auto now = clock_t::now();
+            if (now >= at) return duration_ms_t{0};
+            return std::chrono::ceil<duration_ms_t>(at - now);
+        }
+    };
+
+    //how received bytes are cut into chunks for Channel::SetDataCallback
+    struct RxFraming
+    {
+        enum class Mode: uint8_t
+        {
+            IdleTimeout,//a chunk ends when the line has been idle for rx_timeout symbols (uart_set_rx_timeout)
+            FullThreshold,//a chunk is delivered every time full_threshold bytes are in the RX FIFO
+            Pattern,//AT-style: a chunk ends with pattern_count times the pattern character (e.g. a line)
+        };
+
+        Mode mode = Mode::IdleTimeout;
+        uint8_t rx_timeout = 10;
+        int full_threshold = 120;
+        char pattern = '\n';
+        uint8_t pattern_count = 1;
+        //see uart_enable_pattern_det_baud_intr
+        int pattern_chr_tout = 9;
+        int pattern_post_idle = 0;
+        int pattern_pre_idle = 0;
+        //longer chunks are split (IdleTimeout, FullThreshold) or truncated (Pattern)
+        size_t max_chunk = 256;
+    };
+
+    //single producer/single consumer byte ring, storage from heap_caps_malloc
+    class ByteRing
+    {
+    public:
+        ByteRing() = default;
+        ByteRing(const ByteRing &) = delete;
+        ~ByteRing() { release(); }
+
+        bool allocate(size_t sz, uint32_t caps);
+        void release();
+        bool valid() const { return m_pBuf != nullptr; }
+
+        size_t size() const { return m_Head.load(std::memory_order_acquire) - m_Tail.load(std::memory_order_acquire); }
+        size_t free() const { return m_Cap - size(); }
+
+        //producer side
+        size_t write(const uint8_t *pData, size_t len);
+        //consumer side
+        size_t read(uint8_t *pDst, size_t len);
+        void clear() { m_Tail.store(m_Head.load(std::memory_order_acquire), std::memory_order_release); }
+    private:
+        uint8_t *m_pBuf = nullptr;
+        size_t m_Cap = 0;
+        //free running, wrap with % m_Cap
+        std::atomic<size_t> m_Head{0};
+        std::atomic<size_t> m_Tail{0};
+    };
+
+    namespace async{ class ReadAwaiter; }
+    namespace capture{ class Recorder; }
+    class EventDispatcher;
+
     class Channel
     {
     public:
@@ -64,6 +148,9 @@ namespace uart
         using ExpectedValue = std::expected<RetVal<V>, Err>;
 
         static const constexpr duration_ms_t kDefaultWait = duration_ms_t{-1};
+        static const constexpr size_t kDefaultRxWindowSize = 128;
+        static const constexpr size_t kSendVStackBuf = 128;
+        static const constexpr size_t kTxQueueDepth = 8;
 
         Channel(Port p = Port::Port1, int baud_rate = 115200, Parity parity = Parity::Disable);
         ~Channel();
@@ -95,6 +182,15 @@ namespace uart
         Channel& SetQueueSize(int sz);
         int GetQueueSize() const;
 
+        //stack of the channel's own event task (not used with SetDispatcher); it runs the data, event and
+        //SendAsync completion callbacks, so size it for what those do
+        Channel& SetEventTaskStackSize(uint32_t sz);
+        uint32_t GetEventTaskStackSize() const;
+
+        //size of the local receive window that is refilled with one bulk driver read
+        Channel& SetRxWindowSize(size_t sz);
+        size_t GetRxWindowSize() const;
+
         ExpectedResult Configure();
 
         ExpectedResult SetPins(int tx, int rx, int rts = UART_PIN_NO_CHANGE, int cts = UART_PIN_NO_CHANGE);
@@ -103,60 +199,343 @@ namespace uart
         duration_ms_t GetDefaultWait() const { return m_DefaultWait; }
 
         ExpectedResult Open();
+        //stops the event task (or leaves the dispatcher) and uninstalls the driver; pending SendAsync requests
+        //complete with ESP_ERR_INVALID_STATE. Configure and SetPins are needed again before the next Open
+        //ESP_ERR_INVALID_STATE when called from the task running the channel's callbacks
         ExpectedResult Close();
+        bool IsOpen() const { return m_State.open; }
+
+        //applies the current settings (Set... above) to the open channel without reinstalling the driver:
+        //ring buffers, the event task and its queue stay, only the line parameters change (e.g. a bootloader
+        //switching to a higher baud rate after the handshake)
+        //drainTx: waits until everything queued so far has been sent with the old settings
+        //on a channel that is not open this is Configure
+        ExpectedResult Reconfigure(bool drainTx = true);
+        //the rate the hardware actually runs at (integer divider), only while open
+        ExpectedValue<uint32_t> GetActualBaudRate();
+
+        //per-channel counters, safe to read from any task
+        struct Stats
+        {
+            static constexpr size_t kLatencyBuckets = 8;
+            //upper bounds (us) of the blocking read latency histogram, the last bucket takes everything above
+            static constexpr uint32_t kLatencyBoundsUs[kLatencyBuckets - 1] = {100, 1'000, 5'000, 10'000, 50'000, 100'000, 500'000};
+
+            std::atomic<uint32_t> rx_bytes{0};
+            std::atomic<uint32_t> tx_bytes{0};
+            std::atomic<uint32_t> tx_writes{0};//driver write calls
+            std::atomic<uint32_t> buffer_full{0};//UART_BUFFER_FULL events
+            std::atomic<uint32_t> fifo_overrun{0};//UART_FIFO_OVF events
+            std::atomic<uint32_t> dropped_events{0};//events discarded by queue resets on overflow
+            std::atomic<uint32_t> max_rx_fill{0};//highest driver ring buffer fill seen on UART_DATA
+            std::atomic<uint32_t> overflow_saved{0};//bytes moved into the overflow ring
+            std::atomic<uint32_t> overflow_lost{0};//bytes flushed because the overflow ring was full
+            std::atomic<uint32_t> read_latency[kLatencyBuckets] = {};
+
+            void reset();
+        };
+        const Stats& GetStats() const { return m_Stats; }
+        void ResetStats() { m_Stats.reset(); }
+
+        //emergency drain: on UART_BUFFER_FULL/UART_FIFO_OVF the driver's ring buffer is moved into this
+        //bigger ring (PSRAM if possible) instead of losing it; reads take from it first
+        //must be set before Open, 0 disables; only used with events (an event callback or SetAsync), nothing drains it otherwise
+        Channel& SetOverflowRingSize(size_t sz, bool psram = true) { m_OverflowRingSize = sz; m_OverflowPSRAM = psram; return *this; }
+        size_t GetOverflowRingSize() const { return m_OverflowRingSize; }
 
         ExpectedValue<size_t> GetReadyToReadDataLen();
         ExpectedValue<size_t> GetReadyToWriteDataLen();
         
         ExpectedResult Send(const uint8_t *pData, size_t len);
         ExpectedResult SendWithBreak(const uint8_t *pData, size_t len, size_t breakLen);
+        //gather-send: chunks are packed into a stack buffer and go to the driver in one call
+        //(one call per kSendVStackBuf bytes for bigger frames, chunks of that size or more are written in place)
+        ExpectedResult SendV(std::span<const std::span<const uint8_t>> chunks);
+
+        //write coalescing (Nagle style) for many small Send/SendV calls: writes shorter than stageSize are
+        //collected and go to the driver in one call once the stage is full, delayUs after the first staged
+        //byte (esp_timer), on FlushTx, or before anything that depends on TX order or completion
+        //(SendWithBreak, SendAsync, WaitAllSent, Reconfigure, Close, a blocking read)
+        //stageSize 0 disables it (the default); errors of a deferred write show up in the next Send/FlushTx
+        //the timer only hands over what fits into the driver's TX buffer (SetTxBufferSize), the rest stays
+        //staged for its next round; with no TX buffer the bytes wait for the next Send/FlushTx
+        Channel& SetTxCoalescing(size_t stageSize, uint32_t delayUs = 1000);
+        size_t GetTxCoalescingSize() const { return m_StageSize; }
+        //hands staged bytes to the driver now
+        ExpectedResult FlushTx();
 
+        //non-blocking transmit, requires an event task (SetAsync(true), an event callback or a dispatcher)
+        //data is not copied: it has to stay valid until completion is signalled
+        //bytes are pushed into the driver only as far as its TX ring has room, the rest follows from the event task;
+        //completion fires once the bytes have left the FIFO (requests pushed back to back complete together)
+        //fails with ESP_ERR_NO_MEM when kTxQueueDepth requests are pending
+        //don't mix with the blocking Send on the same channel while requests are pending
+        using TxDoneCallback = GenericCallback<void(esp_err_t)>;
+        ExpectedResult SendAsync(std::span<const uint8_t> data, TxDoneCallback cb = {});
+        //completion via xTaskNotifyGive to the given task
+        ExpectedResult SendAsync(std::span<const uint8_t> data, TaskHandle_t notify);
+        size_t GetTxQueueFree() const;
+        bool IsTxIdle() const;
+
+        //wait: per call; kDefaultWait means m_DefaultWait, or the remaining time of an active DeadlineScope
+        //an explicit wait is capped by an active DeadlineScope as well
         ExpectedValue<size_t> Read(uint8_t *pBuf, size_t len, duration_ms_t wait=kDefaultWait);
+        //reads len bytes in bulk, waiting at most until the deadline
+        ExpectedValue<size_t> Read(uint8_t *pBuf, size_t len, Deadline deadline);
         ExpectedResult Flush();
         ExpectedResult WaitAllSent();
         ExpectedValue<uint8_t> ReadByte(duration_ms_t wait=kDefaultWait);
         ExpectedValue<uint8_t> PeekByte(duration_ms_t wait=kDefaultWait);
 
+        //receive window access for the primitives: bytes already pulled from the driver but not consumed yet
+        std::span<const uint8_t> Buffered() const { return {m_pRxWindow.get() + m_RxBegin, m_RxEnd - m_RxBegin}; }
+        void Consume(size_t n) { m_RxBegin += std::min(n, m_RxEnd - m_RxBegin); }
+        //appends at least one byte to the window with a single driver read (takes everything the driver has, up to the window free space)
+        //and waits for up to need bytes, so a caller short of n bytes gets them in one go instead of one wait per byte
+        //returns the amount of buffered bytes afterwards
+        ExpectedValue<size_t> Fill(duration_ms_t wait=kDefaultWait, size_t need = 1);
+        //pushes bytes back in front of the window, grows the window if needed
+        ExpectedResult Unread(std::span<const uint8_t> bytes);
+
+        //awaitables (see ph_uart_async.hpp) park themselves here while suspended
+        //the event task polls the waiter on every event and on its deadline and resumes it once Poll returns true
+        struct AsyncWaiter
+        {
+            virtual bool Poll(Channel &c) = 0;
+            virtual void Resume() = 0;
+            Deadline deadline;
+        };
+
+        //starts the event task on Open even without an event callback, required for the async API
+        Channel& SetAsync(bool async) { m_Async = async; return *this; }
+        bool IsAsync() const { return m_Async; }
+
+        async::ReadAwaiter AsyncRead(uint8_t *pBuf, size_t len, Deadline deadline = Deadline::never());
+        void SetAsyncWaiter(AsyncWaiter *pW);
+        //drives the pending awaiter; called by the event task, can be called by hand where there's none
+        void PollAsync();
+
         using EventCallback = GenericCallback<void(uart_event_type_t)>;
         void SetEventCallback(EventCallback cb) { m_EventCallback = std::move(cb); }
         bool HasEventCallback() const { return (bool)m_EventCallback; }
 
+        //receive mode: the event task reads the data itself and hands it over in chunks cut according to framing
+        //the span is only valid during the call; don't mix with Read & co on the same channel
+        //must be set before Open; on an open channel only the callback is swapped (e.g. cleared), the framing stays,
+        //and the call waits for a callback in progress
+        using DataCallback = GenericCallback<void(std::span<const uint8_t>)>;
+        Channel& SetDataCallback(DataCallback cb, RxFraming framing = {});
+        bool HasDataCallback() const { return (bool)m_DataCallback; }
+
+        //replaces the UART driver underneath Read/Send/Fill & co, e.g. a virtual channel of a multiplexer (ph_uart_mux.hpp)
+        //a channel with a backend needs no Configure/SetPins/Open; events, the async API and SendWithBreak are not available
+        struct Backend
+        {
+            //same contract as uart_read_bytes: waits up to ticks for len bytes, returns what arrived
+            virtual int Read(uint8_t *pDst, size_t len, TickType_t ticks) = 0;
+            //queues all of it (may block), returns len or -1
+            virtual int Write(const uint8_t *pData, size_t len) = 0;
+            virtual size_t ReadyToRead() = 0;
+            virtual size_t ReadyToWrite() = 0;
+            virtual void FlushInput() = 0;
+            virtual esp_err_t WaitAllSent(TickType_t ticks) = 0;
+        };
+        Channel& SetBackend(Backend *pB) { m_pBackend = pB; return *this; }
+        Backend* GetBackend() const { return m_pBackend; }
+
+        //events get serviced by the shared dispatcher task instead of a task of this channel's own
+        //must be set before Open
+        Channel& SetDispatcher(EventDispatcher *pD) { m_pDispatcher = pD; return *this; }
+        EventDispatcher* GetDispatcher() const { return m_pDispatcher; }
+
+        //one deadline for a whole operation (a primitive or a protocol exchange) instead of a wait per read:
+        //while alive every read waits only for the remaining time; nested scopes can only shorten it
+        struct DeadlineScope
+        {
+            DeadlineScope(Channel &c, Deadline d): m_C(c), m_Prev(c.m_OpDeadline) { if (d.at < m_Prev.at) c.m_OpDeadline = d; }
+            ~DeadlineScope() { m_C.m_OpDeadline = m_Prev; }
+
+            Channel &m_C;
+            Deadline m_Prev;
+        };
+        //what the primitives open for their whole call: the active scope if any, otherwise a scope of
+        //m_DefaultWait from now, so a primitive waits m_DefaultWait in total rather than per read
+        struct OpScope: DeadlineScope
+        {
+            OpScope(Channel &c): DeadlineScope(c, c.m_OpDeadline.is_never() ? Deadline::after(c.m_DefaultWait) : c.m_OpDeadline) {}
+        };
+        Deadline GetOpDeadline() const { return m_OpDeadline; }
+
+        //every chunk to/from the driver (or backend) is logged by the recorder (ph_uart_capture.hpp), nullptr stops it
+        Channel& SetCapture(capture::Recorder *pR) { m_pCapture = pR; return *this; }
+        capture::Recorder* GetCapture() const { return m_pCapture; }
+
+        //traffic of this channel goes to the trace ring (ph_trace.hpp, needs PH_TRACE_ENABLE)
         bool m_Dbg = false;
 
         struct DbgNow
         {
             DbgNow(Channel *pC): m_Dbg(pC->m_Dbg), m_PrevDbg(pC->m_Dbg) { m_Dbg = true; }
-            ~DbgNow() { 
-                printf("\n");
-                m_Dbg = m_PrevDbg; 
-            }
+            ~DbgNow() { m_Dbg = m_PrevDbg; }
 
             bool &m_Dbg;
             bool m_PrevDbg;
         };
     private:
         static void uart_event_loop(Channel &c);
+        void process_event(const uart_event_t &event);
+        void handle_event(const uart_event_t &event);
+        bool needs_events() const { return m_EventCallback || m_DataCallback || m_Async; }
+        ExpectedResult apply_rx_framing();
+        //everything the event side needs once the driver is installed: locks, framing, the event task
+        ExpectedResult start_events();
+        void deliver_data(const uart_event_t &event);
+        void deliver_pattern();
+
+        //not a driver event: only wakes the event side to re-evaluate its wait, the EventCallback never sees it
+        static constexpr uart_event_type_t kWakeEvent = uart_event_type_t(UART_EVENT_MAX + 1);
+        void wake_events();
+        TickType_t event_wait_ticks() const;
+        void poll_pending();
+        void cancel_tx(esp_err_t err);
+        ExpectedResult queue_tx(std::span<const uint8_t> data, TxDoneCallback &&cb, TaskHandle_t notify);
+        void pump_tx();
+        ExpectedResult write_raw(const uint8_t *pData, size_t len);
+        ExpectedResult drv_write(const uint8_t *pData, size_t len);
+        bool ensure_stage();
+        ExpectedResult flush_stage_locked();
+        static void stage_timer_cb(void *pArg);
+        int drv_read(uint8_t *pDst, size_t len, TickType_t ticks);
+        int drv_read_locked(uint8_t *pDst, size_t len, TickType_t ticks);
+        size_t drv_available();
+        void drain_on_overflow();
+        void drain_on_overflow_locked();
+        bool ensure_rx_window();
+        TickType_t wait_ticks(duration_ms_t wait) const;
+        ExpectedValue<size_t> fill_window(size_t need, TickType_t ticks);
 
-        bool m_DbgPrintSend = false;
         uart_port_t m_Port;
         uart_config_t m_Config;
         QueueHandle_t m_Handle = nullptr;
         int m_RxBufferSize = 1024;
         int m_TxBufferSize = 1024;
         int m_QueueSize = 10;
+        uint32_t m_EventStackSize = 4096;
         duration_ms_t m_DefaultWait{0};
+        Deadline m_OpDeadline;
         union{
             struct{
                 uint8_t configured: 1;
                 uint8_t pins_set: 1;
+                uint8_t open: 1;
             }m_State;
             uint8_t m_StateU8 = 0;
         };
-        bool m_HasPeekByte = false;
-        uint8_t m_PeekByte = 0;
+        std::unique_ptr<uint8_t[]> m_pRxWindow;
+        size_t m_RxWindowCapacity = 0;
+        size_t m_RxWindowSize = kDefaultRxWindowSize;
+        size_t m_RxBegin = 0;
+        size_t m_RxEnd = 0;
         std::atomic<bool> m_DataReady={false};
+        Stats m_Stats;
+        ByteRing m_OverflowRing;
+        SemaphoreHandle_t m_RxLock = nullptr;//ring + driver reads vs. drain_on_overflow
+        size_t m_OverflowRingSize = 0;
+        bool m_OverflowPSRAM = true;
+        struct TxRequest
+        {
+            const uint8_t *pData = nullptr;
+            size_t len = 0;
+            size_t pushed = 0;
+            TxDoneCallback cb;
+            TaskHandle_t notify = nullptr;
+            esp_err_t err = ESP_OK;
+        };
+        //[m_TxHead, m_TxPushed) fully in the driver, [m_TxPushed, m_TxTail) waiting for room; free running indices
+        //changed under m_TxLock, read without it by IsTxIdle/GetTxQueueFree and the event side
+        TxRequest m_TxQueue[kTxQueueDepth];
+        std::atomic<size_t> m_TxHead{0};
+        std::atomic<size_t> m_TxPushed{0};
+        std::atomic<size_t> m_TxTail{0};
+        SemaphoreHandle_t m_TxLock = nullptr;
+        //write coalescing
+        std::unique_ptr<uint8_t[]> m_pStage;
+        size_t m_StageSize = 0;
+        size_t m_StageCapacity = 0;
+        std::atomic<size_t> m_StageLen{0};//written under m_StageLock
+        uint32_t m_StageDelayUs = 1000;
+        bool m_StageArmed = false;
+        esp_err_t m_StageErr = ESP_OK;//failure of a write done by the timer
+        SemaphoreHandle_t m_StageLock = nullptr;
+        esp_timer_handle_t m_StageTimer = nullptr;
+
         EventCallback m_EventCallback;
+        DataCallback m_DataCallback;
+        RxFraming m_Framing;
+        std::unique_ptr<uint8_t[]> m_pChunk;
+        size_t m_ChunkLen = 0;
+        EventDispatcher *m_pDispatcher = nullptr;
+        Backend *m_pBackend = nullptr;
+        capture::Recorder *m_pCapture = nullptr;
+        bool m_Async = false;
+        std::atomic<AsyncWaiter*> m_pAsyncWaiter{nullptr};
         thread::TaskBase m_QueueTask;
+        SemaphoreHandle_t m_EventsStopped = nullptr;//given by the own event task on its way out
+        std::atomic<TaskHandle_t> m_EventTask{nullptr};//the own event task while it runs
+        SemaphoreHandle_t m_CallbackLock = nullptr;//recursive, held while an event is processed
+
+        friend class EventDispatcher;
+    };
+
+    //one task servicing the events of many Channels through a FreeRTOS queue set
+    //blocks without timeout while idle (only pending async deadlines wake it up)
+    class EventDispatcher
+    {
+    public:
+        using Ref = std::reference_wrapper<EventDispatcher>;
+        using ExpectedResult = std::expected<Ref, Err>;
+
+        static const constexpr size_t kMaxChannels = UART_NUM_MAX;
+
+        struct Config
+        {
+            const char *pName = "uart::dispatch";
+            uint32_t stackSize = 3072;
+            int prio = thread::kPrioHigh;
+            BaseType_t core = tskNO_AFFINITY;
+            //total event queue length of all channels that will be registered at the same time
+            size_t maxEvents = kMaxChannels * 10;
+        };
+
+        EventDispatcher();
+        EventDispatcher(Config cfg);
+        EventDispatcher(const EventDispatcher &) = delete;
+        ~EventDispatcher();
+
+        ExpectedResult Start();
+        ExpectedResult Stop();
+        bool IsRunning() const { return m_Task != nullptr; }
+
+        //channels register on Open and unregister on Close by themselves if SetDispatcher was used
+        //the channel's driver has to be installed with an event queue
+        ExpectedResult Register(Channel &c);
+        ExpectedResult Unregister(Channel &c);
+    private:
+        static void dispatch_loop(void *p);
+        TickType_t wait_ticks() const;
+        void kick();
+        void leave_set(Channel &c);
+
+        Config m_Config;
+        QueueSetHandle_t m_Set = nullptr;
+        QueueHandle_t m_Ctrl = nullptr;
+        SemaphoreHandle_t m_Lock = nullptr;
+        SemaphoreHandle_t m_Stopped = nullptr;
+        TaskHandle_t m_Task = nullptr;
+        Channel *m_Channels[kMaxChannels] = {};
+        size_t m_UsedEvents = 0;
+
+        friend class Channel;
     };
 }
 #endif
@@ -0,0 +1,300 @@
+#ifndef UART_ASYNC_HPP_
+#define UART_ASYNC_HPP_
+#include "ph_uart_primitives.hpp"
+#include <coroutine>
+#include <cstddef>
+#include <optional>
+#include <utility>
+
+//frame pool size from menuconfig (set by the component's CMakeLists), the defaults are for builds without it
+#ifndef PH_UART_ASYNC_FRAME_BLOCKS
+#define PH_UART_ASYNC_FRAME_BLOCKS 8
+#endif
+
+#ifndef PH_UART_ASYNC_FRAME_SIZE
+#define PH_UART_ASYNC_FRAME_SIZE 512
+#endif
+
+//C++20 coroutine API for uart::Channel
+//
+//Awaitables suspend the calling coroutine and park themselves in the Channel (Channel::SetAsyncWaiter),
+//the channel's event task resumes them once the data is there or the deadline has passed.
+//After the first suspension a coroutine therefore runs in the event task, so several protocol
+//state machines can be driven without a task of their own. Channels must be opened with SetAsync(true).
+//Only one awaitable per Channel may be pending at a time.
+namespace uart
+{
+    namespace async
+    {
+        //coroutine frames come from a fixed pool of blocks, nothing is taken from the heap
+        class FramePool
+        {
+        public:
+            static constexpr size_t kBlocks = PH_UART_ASYNC_FRAME_BLOCKS;
+            static constexpr size_t kBlockSize = PH_UART_ASYNC_FRAME_SIZE;
+            static_assert(kBlocks <= 32, "FramePool tracks its blocks in a 32-bit mask");
+            static_assert(kBlockSize % alignof(std::max_align_t) == 0, "blocks follow each other, each one must stay aligned");
+
+            static void* allocate(size_t sz) noexcept;
+            static void free(void *p) noexcept;
+        };
+
+        template<class T>
+        class Task;
+
+        namespace details
+        {
+            struct promise_base
+            {
+                std::coroutine_handle<> continuation;
+                bool detached = false;
+
+                static void* operator new(size_t sz) noexcept { return FramePool::allocate(sz); }
+                static void operator delete(void *p) noexcept { FramePool::free(p); }
+
+                std::suspend_always initial_suspend() noexcept { return {}; }
+
+                struct final_awaiter
+                {
+                    bool await_ready() noexcept { return false; }
+                    void await_resume() noexcept {}
+
+                    template<class P>
+                    std::coroutine_handle<> await_suspend(std::coroutine_handle<P> h) noexcept
+                    {
+                        auto &p = h.promise();
+                        if (p.continuation)
+                            return p.continuation;
+                        if (p.detached)
+                            h.destroy();
+                        return std::noop_coroutine();
+                    }
+                };
+                final_awaiter final_suspend() noexcept { return {}; }
+
+                void unhandled_exception() { std::abort(); }
+            };
+
+            template<class T>
+            struct promise: promise_base
+            {
+                std::optional<T> value;
+
+                Task<T> get_return_object();
+                static Task<T> get_return_object_on_allocation_failure() { return {}; }
+
+                template<class V>
+                void return_value(V &&v) { value.emplace(std::forward<V>(v)); }
+            };
+
+            template<>
+            struct promise<void>: promise_base
+            {
+                Task<void> get_return_object();
+                static Task<void> get_return_object_on_allocation_failure();
+
+                void return_void() {}
+            };
+        }
+
+        //lazy coroutine; starts when awaited or passed to spawn()
+        //a Task whose frame could not be allocated is invalid, awaiting it yields a ESP_ERR_NO_MEM error
+        //for T constructible from std::unexpected<Err>
+        //Task<void> has no way to report that and can only be spawned, awaited tasks return e.g. std::expected<void, Err>
+        template<class T>
+        class Task
+        {
+        public:
+            using promise_type = details::promise<T>;
+            using handle_t = std::coroutine_handle<promise_type>;
+
+            Task() = default;
+            explicit Task(handle_t h): m_H(h) {}
+            Task(Task &&rhs): m_H(std::exchange(rhs.m_H, nullptr)) {}
+            Task& operator=(Task &&rhs) { if (m_H) m_H.destroy(); m_H = std::exchange(rhs.m_H, nullptr); return *this; }
+            ~Task() { if (m_H) m_H.destroy(); }
+
+            bool valid() const { return (bool)m_H; }
+
+            bool await_ready() const
+            {
+                static_assert(!std::is_void_v<T>, "an awaited Task<void> would complete as if it ran when its frame is missing, use Task<std::expected<void, Err>>");
+                return !m_H;
+            }
+            std::coroutine_handle<> await_suspend(std::coroutine_handle<> h)
+            {
+                m_H.promise().continuation = h;
+                return m_H;
+            }
+            T await_resume()
+            {
+                if constexpr (!std::is_void_v<T>)
+                {
+                    if (!m_H)
+                    {
+                        static_assert(std::is_constructible_v<T, std::unexpected<::Err>>, "Task<T> needs an error representation for allocation failures");
+                        return T(std::unexpected(::Err{"uart::async::Task no frame", ESP_ERR_NO_MEM}));
+                    }
+                    return std::move(*m_H.promise().value);
+                }
+            }
+
+            handle_t release() { return std::exchange(m_H, nullptr); }
+        private:
+            handle_t m_H;
+        };
+
+        namespace details
+        {
+            template<class T>
+            inline Task<T> promise<T>::get_return_object() { return Task<T>{Task<T>::handle_t::from_promise(*this)}; }
+
+            inline Task<void> promise<void>::get_return_object() { return Task<void>{Task<void>::handle_t::from_promise(*this)}; }
+            inline Task<void> promise<void>::get_return_object_on_allocation_failure() { return {}; }
+        }
+
+        //starts a detached coroutine, its frame is released when it finishes
+        inline bool spawn(Task<void> &&t)
+        {
+            auto h = t.release();
+            if (!h)
+                return false;
+            h.promise().detached = true;
+            h.resume();
+            return true;
+        }
+
+        //common suspend/resume part of the channel awaitables
+        template<class Derived>
+        class ChannelAwaiter: public Channel::AsyncWaiter
+        {
+        public:
+            ChannelAwaiter(Channel &c, Deadline d): m_C(c) { deadline = d; }
+
+            bool await_ready() { return Poll(m_C); }
+            void await_suspend(std::coroutine_handle<> h)
+            {
+                m_H = h;
+                //from here on the event task may resume us at any moment, don't touch *this anymore
+                m_C.SetAsyncWaiter(this);
+            }
+
+            void Resume() override { m_H.resume(); }
+            bool Poll(Channel &c) override
+            {
+                if (static_cast<Derived*>(this)->poll_impl(c))
+                    return true;
+                return deadline.expired();
+            }
+        protected:
+            Channel &m_C;
+            std::coroutine_handle<> m_H;
+            std::optional<::Err> m_Err;
+        };
+
+        //co_await ch.AsyncRead(buf, len, deadline): completes when len bytes were read or on the deadline,
+        //returns the amount of bytes read like Channel::Read
+        class ReadAwaiter: public ChannelAwaiter<ReadAwaiter>
+        {
+        public:
+            ReadAwaiter(Channel &c, uint8_t *pBuf, size_t len, Deadline d): ChannelAwaiter(c, d), m_pBuf(pBuf), m_Len(len) {}
+
+            bool poll_impl(Channel &c)
+            {
+                if (auto r = c.Read(m_pBuf + m_Got, m_Len - m_Got, duration_ms_t{0}); !r)
+                {
+                    m_Err = r.error();
+                    return true;
+                }
+                else
+                    m_Got += r.value().v;
+                return m_Got == m_Len;
+            }
+
+            Channel::ExpectedValue<size_t> await_resume()
+            {
+                if (m_Err)
+                    return std::unexpected(*m_Err);
+                return Channel::RetVal<size_t>{std::ref(m_C), m_Got};
+            }
+        private:
+            uint8_t *m_pBuf;
+            size_t m_Len;
+            size_t m_Got = 0;
+        };
+
+        //co_await AsyncReadUntil(ch, '\n', dst, deadline): copies bytes into dst up to and including 'until',
+        //returns the amount of bytes copied; fails if dst is full before 'until' arrives or on the deadline
+        class ReadUntilAwaiter: public ChannelAwaiter<ReadUntilAwaiter>
+        {
+        public:
+            ReadUntilAwaiter(Channel &c, uint8_t until, std::span<uint8_t> dst, Deadline d): ChannelAwaiter(c, d), m_Dst(dst), m_Until(until) {}
+
+            bool poll_impl(Channel &c)
+            {
+                while(true)
+                {
+                    auto w = c.Buffered();
+                    if (w.empty())
+                    {
+                        if (auto r = c.GetReadyToReadDataLen(); !r)
+                        {
+                            m_Err = r.error();
+                            return true;
+                        }else if (!r.value().v)
+                            return false;
+
+                        if (auto r = c.Fill(duration_ms_t{0}); !r)
+                        {
+                            m_Err = r.error();
+                            return true;
+                        }
+                        continue;
+                    }
+
+                    size_t n = std::min(w.size(), m_Dst.size() - m_Got);
+                    auto *pFound = (const uint8_t*)std::memchr(w.data(), m_Until, n);
+                    size_t take = pFound ? (pFound - w.data() + 1) : n;
+                    std::memcpy(m_Dst.data() + m_Got, w.data(), take);
+                    c.Consume(take);
+                    m_Got += take;
+                    if (pFound)
+                    {
+                        m_Found = true;
+                        return true;
+                    }
+                    if (m_Got == m_Dst.size())
+                    {
+                        m_Err = ::Err{"AsyncReadUntil: insufficient buffer", ESP_ERR_INVALID_SIZE};
+                        return true;
+                    }
+                }
+            }
+
+            Channel::ExpectedValue<size_t> await_resume()
+            {
+                if (m_Err)
+                    return std::unexpected(*m_Err);
+                if (!m_Found)
+                    return std::unexpected(::Err{"AsyncReadUntil timeout", ESP_OK});
+                return Channel::RetVal<size_t>{std::ref(m_C), m_Got};
+            }
+        private:
+            std::span<uint8_t> m_Dst;
+            size_t m_Got = 0;
+            uint8_t m_Until;
+            bool m_Found = false;
+        };
+
+        inline ReadUntilAwaiter AsyncReadUntil(Channel &c, uint8_t until, std::span<uint8_t> dst, Deadline d = Deadline::never())
+        {
+            return {c, until, dst, d};
+        }
+    }
+
+    inline async::ReadAwaiter Channel::AsyncRead(uint8_t *pBuf, size_t len, Deadline deadline)
+    {
+        return {*this, pBuf, len, deadline};
+    }
+}
+#endif
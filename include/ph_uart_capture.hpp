@@ -0,0 +1,205 @@
+#ifndef UART_CAPTURE_HPP_
+#define UART_CAPTURE_HPP_
+#include "ph_uart.hpp"
+#include <cstdio>
+#include "esp_partition.h"
+
+namespace uart
+{
+    //record/replay of Channel traffic
+    //
+    //A Recorder set on a Channel (Channel::SetCapture) logs every chunk going to/coming from the driver with
+    //a timestamp into a Sink: a memory buffer, a FILE (host or VFS on target) or a flash partition.
+    //Replay is a Channel::Backend that plays such a log back through an ordinary Channel, so parsers run
+    //unchanged on the host from real traffic, at the original pace, faster, or as fast as they can.
+    //
+    //Log format: "PHUC", version byte, then per chunk
+    //  varint  microseconds since the previous chunk (since Start for the first one)
+    //  varint  (length << 1) | direction (0 RX, 1 TX)
+    //  length  payload bytes
+    namespace capture
+    {
+        enum class Dir: uint8_t
+        {
+            Rx = 0,
+            Tx = 1,
+        };
+
+        inline constexpr uint8_t kMagic[] = {'P', 'H', 'U', 'C'};
+        inline constexpr uint8_t kVersion = 1;
+        inline constexpr size_t kHeaderSize = sizeof(kMagic) + 1;
+
+        //takes a chunk in parts, all or nothing
+        struct Sink
+        {
+            virtual bool Write(std::span<const std::span<const uint8_t>> parts) = 0;
+            virtual void Flush() {}
+        };
+
+        class MemorySink: public Sink
+        {
+        public:
+            MemorySink(std::span<uint8_t> buf): m_Buf(buf) {}
+
+            bool Write(std::span<const std::span<const uint8_t>> parts) override;
+            std::span<const uint8_t> Data() const { return m_Buf.first(m_Len); }
+            void Clear() { m_Len = 0; }
+        private:
+            std::span<uint8_t> m_Buf;
+            size_t m_Len = 0;
+        };
+
+        class FileSink: public Sink
+        {
+        public:
+            FileSink(FILE *pF): m_pF(pF) {}
+
+            bool Write(std::span<const std::span<const uint8_t>> parts) override;
+            void Flush() override { fflush(m_pF); }
+        private:
+            FILE *m_pF;
+        };
+
+        //appends from the start of the partition, erasing sector by sector ahead of the data;
+        //writes go through a page buffer, Flush (or Recorder::Stop) writes out the rest
+        class PartitionSink: public Sink
+        {
+        public:
+            static constexpr size_t kPageSize = 256;
+
+            PartitionSink(const esp_partition_t *pPart): m_pPart(pPart) {}
+
+            bool Write(std::span<const std::span<const uint8_t>> parts) override;
+            void Flush() override;
+            size_t Size() const { return m_Off + m_PageLen; }
+        private:
+            bool program(const uint8_t *pData, size_t len);
+
+            const esp_partition_t *m_pPart;
+            size_t m_Off = 0;//programmed so far
+            size_t m_Erased = 0;//erased up to
+            uint8_t m_Page[kPageSize];
+            size_t m_PageLen = 0;
+        };
+
+        class Recorder
+        {
+        public:
+            using Ref = std::reference_wrapper<Recorder>;
+            using ExpectedResult = std::expected<Ref, Err>;
+
+            struct Stats
+            {
+                std::atomic<uint32_t> chunks{0};
+                std::atomic<uint32_t> bytes{0};
+                std::atomic<uint32_t> dropped{0};//chunks the sink didn't take
+                std::atomic<uint32_t> busy{0};//chunks dropped because another task was writing
+            };
+
+            Recorder(Sink &s);
+            ~Recorder();
+
+            //writes the log header, the time base starts here
+            ExpectedResult Start();
+            ExpectedResult Stop();
+            bool IsRunning() const { return m_Running; }
+
+            //called by the Channel, any task (the stage timer and the event task included);
+            //never waits: a chunk arriving while another one is being written is dropped and counted in busy
+            void Record(Dir d, const uint8_t *pData, size_t len);
+
+            const Stats& GetStats() const { return m_Stats; }
+        private:
+            Sink &m_Sink;
+            SemaphoreHandle_t m_Lock = nullptr;
+            int64_t m_LastUs = 0;
+            std::atomic<bool> m_Running{false};
+            Stats m_Stats;
+        };
+
+        struct Chunk
+        {
+            uint64_t ts_us = 0;//since Start of the recording
+            Dir dir = Dir::Rx;
+            std::span<const uint8_t> data;
+        };
+
+        //walks a log in memory
+        class Reader
+        {
+        public:
+            Reader(std::span<const uint8_t> log);
+
+            bool Valid() const { return m_Valid; }
+            //false at the end or on a truncated/garbled chunk (Valid() turns false then)
+            bool Next(Chunk &c);
+            void Rewind();
+        private:
+            bool varint(uint64_t &v);
+
+            std::span<const uint8_t> m_Log;
+            size_t m_Off = kHeaderSize;
+            uint64_t m_Ts = 0;
+            bool m_Valid = false;
+        };
+
+        //Channel backend playing back the RX chunks of a log; writes are accepted and checked against the TX chunks
+        class Replay: public Channel::Backend
+        {
+        public:
+            struct Config
+            {
+                float speed = 1.0f;//1 original timing, >1 accelerated, 0 no delays at all
+                //an RX chunk recorded after a TX chunk is held back until the same amount of bytes has been written,
+                //so request/response exchanges stay in order however fast the code under test runs
+                //a Read held back like that waits out a finite timeout, but returns what it has right away when
+                //asked to wait forever: with reader and writer usually being the same task the request would
+                //never come
+                bool syncTx = true;
+            };
+
+            struct Stats
+            {
+                uint32_t rx_chunks = 0;
+                uint32_t tx_chunks = 0;
+                uint32_t tx_mismatch = 0;//written bytes that differ from the recording
+            };
+
+            Replay(std::span<const uint8_t> log);
+            Replay(std::span<const uint8_t> log, Config cfg);
+
+            bool Valid() const { return m_Reader.Valid(); }
+            //all RX data has been handed out
+            bool Done() { return m_Rx.data.empty() && (m_End || !advance()); }
+            //starts over, the time base restarts with the next access
+            void Rewind();
+            const Stats& GetStats() const { return m_Stats; }
+
+            int Read(uint8_t *pDst, size_t len, TickType_t ticks) override;
+            int Write(const uint8_t *pData, size_t len) override;
+            size_t ReadyToRead() override;
+            size_t ReadyToWrite() override { return SIZE_MAX; }
+            void FlushInput() override;
+            esp_err_t WaitAllSent(TickType_t) override { return ESP_OK; }
+        private:
+            //moves on to the next RX chunk, bookkeeping the TX chunks in between
+            bool advance();
+            //microseconds until the current RX chunk is due, 0 if it is
+            int64_t due_in(int64_t now);
+            bool blocked() const { return m_Config.syncTx && m_TxRecorded > m_TxWritten; }
+
+            Reader m_Reader;
+            Config m_Config;
+            Stats m_Stats;
+            Chunk m_Rx;//rest of the current RX chunk
+            std::span<const uint8_t> m_TxExpected[4];//recorded TX data not written yet
+            size_t m_TxCount = 0;
+            //totals, the code under test may well write before the recorded TX chunk has been reached
+            size_t m_TxRecorded = 0;
+            size_t m_TxWritten = 0;
+            int64_t m_StartUs = -1;
+            bool m_End = false;
+        };
+    }
+}
+#endif
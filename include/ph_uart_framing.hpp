@@ -0,0 +1,110 @@
+#ifndef UART_FRAMING_HPP_
+#define UART_FRAMING_HPP_
+#include "ph_uart.hpp"
+#include <array>
+
+namespace uart
+{
+    namespace details
+    {
+        constexpr std::array<uint32_t, 256> make_crc32_table()
+        {
+            std::array<uint32_t, 256> t{};
+            for(uint32_t i = 0; i < 256; ++i)
+            {
+                uint32_t c = i;
+                for(int b = 0; b < 8; ++b)
+                    c = (c & 1) ? (c >> 1) ^ 0xedb88320u : (c >> 1);
+                t[i] = c;
+            }
+            return t;
+        }
+        inline constexpr std::array<uint32_t, 256> kCrc32Table = make_crc32_table();
+    }
+
+    //CRC-32 (IEEE 802.3), one table lookup per byte; pass the previous result to continue over several chunks
+    constexpr uint32_t crc32(std::span<const uint8_t> data, uint32_t prev = 0)
+    {
+        uint32_t crc = ~prev;
+        for(uint8_t b : data)
+            crc = (crc >> 8) ^ details::kCrc32Table[(crc ^ b) & 0xff];
+        return ~crc;
+    }
+    static_assert(crc32(std::array<const uint8_t, 9>{'1','2','3','4','5','6','7','8','9'}) == 0xcbf43926);
+
+    //binary frames over a Channel: COBS (0x00 delimited) or SLIP (RFC 1055) with a little-endian CRC-32 trailer
+    //
+    //Sending encodes straight from the payload: unescaped runs go to the driver in place, only the
+    //COBS code bytes/SLIP escapes are added (see Channel::SendV).
+    //Receiving decodes straight from the channel's receive window (Process) or from any chunk of bytes (Feed,
+    //e.g. from Channel::SetDataCallback) into the caller's buffer; complete frames with a valid CRC are reported
+    //through the frame callback, the span stays valid until the callback returns.
+    class FramedLink
+    {
+    public:
+        using Ref = std::reference_wrapper<FramedLink>;
+        using ExpectedResult = std::expected<Ref, Err>;
+
+        template<typename V>
+        using RetVal = RetValT<Ref, V>;
+
+        template<typename V>
+        using ExpectedValue = std::expected<RetVal<V>, Err>;
+
+        enum class Encoding: uint8_t
+        {
+            COBS,
+            SLIP,
+        };
+
+        using FrameCallback = GenericCallback<void(std::span<const uint8_t>)>;
+
+        struct Stats
+        {
+            uint32_t frames = 0;
+            uint32_t crc_errors = 0;
+            uint32_t oversize = 0;//frames longer than the receive buffer
+            uint32_t bad_encoding = 0;
+        };
+
+        static constexpr size_t kCrcSize = 4;
+
+        FramedLink(Channel &c, Encoding e = Encoding::COBS);
+
+        Encoding GetEncoding() const { return m_Encoding; }
+
+        //decoded frames (payload + CRC) are assembled here, must hold the biggest expected frame + kCrcSize
+        FramedLink& SetRxBuffer(std::span<uint8_t> buf) { m_Rx = buf; m_RxLen = 0; return *this; }
+        FramedLink& SetFrameCallback(FrameCallback cb) { m_FrameCallback = std::move(cb); return *this; }
+
+        ExpectedResult Send(std::span<const uint8_t> payload);
+
+        //decodes bytes received by other means
+        void Feed(std::span<const uint8_t> bytes);
+        //decodes what the channel has, waiting up to wait for the first bytes; returns the amount of frames reported
+        ExpectedValue<size_t> Process(duration_ms_t wait = Channel::kDefaultWait);
+
+        const Stats& GetStats() const { return m_Stats; }
+    private:
+        void put(const uint8_t *pData, size_t len);
+        void end_frame();
+        void reset_frame();
+        void feed_cobs(std::span<const uint8_t> bytes);
+        void feed_slip(std::span<const uint8_t> bytes);
+
+        Channel &m_C;
+        Encoding m_Encoding;
+        std::span<uint8_t> m_Rx;
+        size_t m_RxLen = 0;
+        FrameCallback m_FrameCallback;
+        Stats m_Stats;
+        size_t m_Reported = 0;
+        //decoder state
+        bool m_InFrame = false;
+        bool m_Dropping = false;//the current frame is invalid, skip to the next delimiter
+        uint8_t m_CobsLeft = 0;//bytes left in the current COBS block
+        bool m_CobsZero = false;//a zero is due before the next block
+        bool m_SlipEsc = false;
+    };
+}
+#endif
@@ -0,0 +1,194 @@
+#ifndef UART_MATCHER_HPP_
+#define UART_MATCHER_HPP_
+#include "ph_uart_primitives.hpp"
+#include <array>
+
+namespace uart
+{
+    namespace primitives
+    {
+        //string literal usable as a template argument: StrMatcher<"OK", "ERROR">
+        template<size_t N>
+        struct fixed_str
+        {
+            char data[N]{};
+
+            constexpr fixed_str(const char (&s)[N]) { for(size_t i = 0; i < N; ++i) data[i] = s[i]; }
+            static constexpr size_t size() { return N - 1; }
+            constexpr uint8_t operator[](size_t i) const { return uint8_t(data[i]); }
+        };
+
+        //Aho-Corasick automaton over the given literals, built at compile time into a flat transition table.
+        //Bytes that don't occur in any literal share one input class, so the table is states x (distinct bytes + 1).
+        //Matching is unanchored: leading garbage is skipped and a match may start anywhere in the stream.
+        //The state survives between feed() calls, so input may arrive in arbitrary chunks.
+        //If several literals end on the same byte the longest one wins.
+        template<fixed_str... Strs>
+        class StrMatcher
+        {
+            static_assert(sizeof...(Strs) > 0, "StrMatcher needs at least one literal");
+            static_assert(((Strs.size() > 0) && ...), "StrMatcher literals must not be empty");
+
+            static constexpr size_t kMaxStates = (Strs.size() + ... + 1);
+
+            static constexpr auto build_classes()
+            {
+                struct { std::array<uint8_t, 256> classOf{}; size_t count = 1; } res;
+                auto add = [&](auto const& s){
+                    for(size_t i = 0; i < s.size(); ++i)
+                        if (!res.classOf[s[i]])
+                            res.classOf[s[i]] = uint8_t(res.count++);
+                };
+                (add(Strs), ...);
+                return res;
+            }
+            static constexpr auto kClassInfo = build_classes();
+            static constexpr size_t kClasses = kClassInfo.count;
+
+            template<size_t States>
+            struct Trie
+            {
+                std::array<int, States * kClasses> go{};
+                std::array<int, States> term{};
+                size_t states = 1;
+            };
+
+            static constexpr auto build_trie()
+            {
+                Trie<kMaxStates> t;
+                t.go.fill(-1);
+                t.term.fill(-1);
+                int idx = 0;
+                auto add = [&](auto const& s){
+                    size_t st = 0;
+                    for(size_t i = 0; i < s.size(); ++i)
+                    {
+                        auto &next = t.go[st * kClasses + kClassInfo.classOf[s[i]]];
+                        if (next < 0)
+                            next = int(t.states++);
+                        st = size_t(next);
+                    }
+                    if (t.term[st] < 0)
+                        t.term[st] = idx;
+                    ++idx;
+                };
+                (add(Strs), ...);
+                return t;
+            }
+
+        public:
+            static constexpr size_t kStates = build_trie().states;
+            using state_t = std::conditional_t<(kStates <= 256), uint8_t, uint16_t>;
+            using match_t = std::conditional_t<(sizeof...(Strs) < 128), int8_t, int16_t>;
+
+        private:
+            struct Tables
+            {
+                std::array<uint8_t, 256> classOf;
+                std::array<state_t, kStates * kClasses> next;
+                std::array<match_t, kStates> out;
+            };
+
+            static constexpr Tables build_tables()
+            {
+                auto t = build_trie();
+                Tables res{};
+                res.classOf = kClassInfo.classOf;
+
+                std::array<size_t, kStates> fail{};
+                std::array<size_t, kStates> queue{};
+                size_t qHead = 0, qTail = 0;
+                for(size_t s = 0; s < kStates; ++s)
+                    res.out[s] = match_t(t.term[s]);
+
+                queue[qTail++] = 0;
+                while(qHead != qTail)
+                {
+                    size_t u = queue[qHead++];
+                    for(size_t c = 0; c < kClasses; ++c)
+                    {
+                        int v = t.go[u * kClasses + c];
+                        if (v >= 0)
+                        {
+                            fail[v] = u ? res.next[fail[u] * kClasses + c] : 0;
+                            if (res.out[v] < 0)
+                                res.out[v] = res.out[fail[v]];
+                            res.next[u * kClasses + c] = state_t(v);
+                            queue[qTail++] = size_t(v);
+                        }else
+                            res.next[u * kClasses + c] = u ? res.next[fail[u] * kClasses + c] : 0;
+                    }
+                }
+                return res;
+            }
+
+            static constexpr Tables kTables = build_tables();
+
+        public:
+            struct FeedResult
+            {
+                size_t consumed;
+                int match;//-1 if none
+            };
+
+            static constexpr size_t size() { return sizeof...(Strs); }
+
+            constexpr void reset() { m_State = 0; }
+
+            //advances by one byte, returns the index of the literal that ends on it or -1
+            constexpr int feed(uint8_t b)
+            {
+                m_State = kTables.next[m_State * kClasses + kTables.classOf[b]];
+                return kTables.out[m_State];
+            }
+
+            //advances until the first match (inclusive) or the end of bytes
+            constexpr FeedResult feed(std::span<const uint8_t> bytes)
+            {
+                for(size_t i = 0, n = bytes.size(); i < n; ++i)
+                {
+                    if (int m = feed(bytes[i]); m >= 0)
+                        return {i + 1, m};
+                }
+                return {bytes.size(), -1};
+            }
+
+        private:
+            state_t m_State = 0;
+        };
+
+        //consumes bytes until one of the matcher's literals has been received, returns its index
+        //the matcher keeps its state if the read fails, so a retry continues where it stopped
+        template<fixed_str... Strs>
+        inline auto match_any(Channel &c, StrMatcher<Strs...> &m)
+        {
+            using MatchAnyResult = Channel::RetVal<int>;
+            using ExpectedResult = std::expected<MatchAnyResult, Err>;
+            Channel::OpScope scope(c);
+            while(true)
+            {
+                if (auto r = buffered_or_fill(c); !r)
+                    return ExpectedResult(std::unexpected(r.error()));
+                else
+                {
+                    auto res = m.feed(*r);
+                    c.Consume(res.consumed);
+                    if (res.match >= 0)
+                    {
+                        m.reset();
+                        return ExpectedResult(MatchAnyResult{std::ref(c), res.match});
+                    }
+                }
+            }
+        }
+
+        //match_any_str<"OK", "ERROR">(c): searching counterpart of match_any_str(c, "OK", "ERROR")
+        template<fixed_str... Strs>
+        inline auto match_any_str(Channel &c)
+        {
+            StrMatcher<Strs...> m;
+            return uart::primitives::match_any(c, m);
+        }
+    }
+}
+#endif
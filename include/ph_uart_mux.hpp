@@ -0,0 +1,127 @@
+#ifndef UART_MUX_HPP_
+#define UART_MUX_HPP_
+#include "ph_uart.hpp"
+#include "freertos/stream_buffer.h"
+
+namespace uart
+{
+    //3GPP TS 27.010 basic mode multiplexer (AT+CMUX=0): one physical Channel carries several virtual ones
+    //
+    //Every virtual channel is a uart::Channel with a Backend, so Read/Send and the primitives work on it unchanged
+    //and different tasks can use different virtual channels at the same time.
+    //- receiving: the physical channel's data callback demultiplexes UIH frames into per-channel stream buffers;
+    //  a channel whose buffer runs full is throttled towards the modem (MSC with FC set) until its reader catches up
+    //- sending: writers queue into per-channel stream buffers, the mux task sends them round robin, at most
+    //  one frame (N1 bytes) per channel and turn, and skips channels the modem has throttled
+    class Mux
+    {
+    public:
+        using Ref = std::reference_wrapper<Mux>;
+        using ExpectedResult = std::expected<Ref, Err>;
+        using ExpectedChannel = std::expected<Channel::Ref, Err>;
+
+        static constexpr size_t kMaxChannels = 4;
+        static constexpr size_t kMaxN1 = 127;//single length byte frames
+
+        struct Config
+        {
+            size_t n1 = kMaxN1;//max payload per frame, <= kMaxN1
+            uint32_t stackSize = 3072;
+            UBaseType_t prio = 10;
+            duration_ms_t connect_timeout = duration_ms_t{1000};
+        };
+
+        struct Stats
+        {
+            std::atomic<uint32_t> frames_rx{0};
+            std::atomic<uint32_t> frames_tx{0};
+            std::atomic<uint32_t> bad_fcs{0};
+            std::atomic<uint32_t> rx_dropped{0};//payload bytes that didn't fit a channel's receive buffer
+        };
+
+        //phys must be configured (baud, pins) but not opened yet, the mux installs its data callback on it
+        Mux(Channel &phys);
+        Mux(Channel &phys, Config cfg);
+        ~Mux();
+
+        //virtual channel for the dlci (1..63); before Start
+        ExpectedChannel AddChannel(uint8_t dlci, size_t rxBufSize = 1024, size_t txBufSize = 512);
+
+        //opens the physical channel, starts the mux task and establishes DLCI 0 and the added channels (SABM/UA)
+        //the modem must be in multiplexer mode already
+        //ESP_ERR_INVALID_STATE if the physical channel has been opened by someone else
+        ExpectedResult Start();
+        //closes the DLCIs (DISC) and stops the mux task; the physical channel stays open
+        ExpectedResult Stop();
+
+        const Stats& GetStats() const { return m_Stats; }
+    private:
+        struct Virtual: Channel::Backend
+        {
+            int Read(uint8_t *pDst, size_t len, TickType_t ticks) override;
+            int Write(const uint8_t *pData, size_t len) override;
+            size_t ReadyToRead() override;
+            size_t ReadyToWrite() override;
+            void FlushInput() override;
+            esp_err_t WaitAllSent(TickType_t ticks) override;
+
+            Mux *pMux = nullptr;
+            Channel ch;
+            uint8_t dlci = 0;
+            StreamBufferHandle_t rx = nullptr;
+            StreamBufferHandle_t tx = nullptr;
+            size_t rxSize = 0;
+            size_t txSize = 0;
+            std::atomic<bool> connected{false};
+            std::atomic<bool> remoteStopped{false};//the modem asked us to stop sending (FC)
+            std::atomic<bool> throttled{false};//we asked the modem to stop sending
+        };
+
+        enum class RxState: uint8_t
+        {
+            Flag,
+            Address,
+            Control,
+            Length,
+            Data,
+            Fcs,
+            End,
+        };
+
+        static void task_loop(void *pArg);
+        void on_data(std::span<const uint8_t> bytes);
+        void on_frame();
+        void on_control(std::span<const uint8_t> info);
+        Virtual* find(uint8_t dlci);
+        bool send_frame(uint8_t dlci, uint8_t control, bool command, std::span<const uint8_t> info);
+        bool send_msc(Virtual &v, bool stop);
+        ExpectedResult connect(uint8_t dlci);
+        void kick();
+        size_t pump_round();
+
+        Channel &m_Phys;
+        Config m_Config;
+        Virtual m_Channels[kMaxChannels];
+        size_t m_Count = 0;
+        size_t m_RoundRobin = 0;
+        TaskHandle_t m_Task = nullptr;
+        SemaphoreHandle_t m_TxLock = nullptr;
+        SemaphoreHandle_t m_Ack = nullptr;//UA/DM for the pending SABM/DISC
+        std::atomic<uint8_t> m_AckDlci{0xff};
+        std::atomic<bool> m_AckOk{false};
+        std::atomic<bool> m_Stop{false};
+        bool m_PhysOpened = false;//phys has been opened by Start, with the mux's framing
+        Stats m_Stats;
+
+        //receive state machine
+        RxState m_RxState = RxState::Flag;
+        uint8_t m_RxAddr = 0;
+        uint8_t m_RxCtrl = 0;
+        uint8_t m_RxLen = 0;
+        uint8_t m_RxGot = 0;
+        uint8_t m_RxFcs = 0;
+        uint8_t m_RxData[kMaxN1];
+        uint8_t m_TxFrame[kMaxN1 + 6];
+    };
+}
+#endif
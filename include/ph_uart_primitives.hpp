@@ -1,6 +1,10 @@
 #ifndef UART_PRIMITIVES_HPP_
 #define UART_PRIMITIVES_HPP_
 #include "ph_uart.hpp"
+#include <algorithm>
+#include <array>
+#include <cstring>
+#include <tuple>
 
 namespace uart
 {
@@ -17,16 +21,32 @@ namespace uart
             return ExpectedResult(std::ref(c));
         }
 
+        //returns the current receive window, refilling it with one bulk read if it's empty
+        //need: what the caller is still short of, the read waits for that much
+        inline auto buffered_or_fill(Channel &c, size_t need = 1)
+        {
+            using ExpectedResult = std::expected<std::span<const uint8_t>, ::Err>;
+            if (auto w = c.Buffered(); !w.empty())
+                return ExpectedResult(w);
+            if (auto r = c.Fill(Channel::kDefaultWait, need); !r)
+                return ExpectedResult(std::unexpected(r.error()));
+            return ExpectedResult(c.Buffered());
+        }
+
         inline auto skip_bytes(Channel &c, size_t bytes, const char *pCtx = "")
         {
             using ExpectedResult = std::expected<Channel::Ref, ::Err>;
-            uint8_t buf[16];
+            Channel::OpScope scope(c);
             while(bytes)
             {
-                if (auto r = c.Read(buf, std::min(sizeof(buf), bytes)); !r)
+                if (auto r = buffered_or_fill(c, bytes); !r)
                     return ExpectedResult(std::unexpected(r.error()));
                 else
-                    bytes -= r.value().v;
+                {
+                    size_t n = std::min(r->size(), bytes);
+                    c.Consume(n);
+                    bytes -= n;
+                }
             }
 
             return ExpectedResult(std::ref(c));
@@ -35,12 +55,25 @@ namespace uart
         inline auto match_bytes(Channel &c, std::span<const uint8_t> bytes, const char *pCtx = "")
         {
             using ExpectedResult = std::expected<Channel::Ref, ::Err>;
-            for(size_t idx = 0, n = bytes.size(); idx < n; ++idx)
+            Channel::OpScope scope(c);
+            while(!bytes.empty())
             {
-                if (auto r = c.ReadByte(); !r)
+                if (auto r = buffered_or_fill(c, bytes.size()); !r)
                     return ExpectedResult(std::unexpected(r.error()));
-                else if (bytes[idx] != r.value().v)
-                    return ExpectedResult(std::unexpected(::Err{"match_bytes", ESP_OK}));
+                else
+                {
+                    auto w = *r;
+                    size_t n = std::min(w.size(), bytes.size());
+                    if (std::memcmp(w.data(), bytes.data(), n) != 0)
+                    {
+                        //consume up to and including the first mismatching byte
+                        auto m = std::mismatch(w.begin(), w.begin() + n, bytes.begin());
+                        c.Consume(m.first - w.begin() + 1);
+                        return ExpectedResult(std::unexpected(::Err{"match_bytes", ESP_OK}));
+                    }
+                    c.Consume(n);
+                    bytes = bytes.subspan(n);
+                }
             }
             return ExpectedResult(std::ref(c));
         }
@@ -52,6 +85,7 @@ namespace uart
             using ExpectedResult = std::expected<MatchAnyResult, Err>;
 
             std::span<uint8_t> sequences[sizeof...(Seqs)] = {bytes...};
+            Channel::OpScope scope(c);
             bool anyValidLeft = true;
             size_t idx = 0;
             while(anyValidLeft)
@@ -69,7 +103,7 @@ namespace uart
                         if (s.empty())
                             continue;
 
-                        if ((s.size() <= idx) && s[idx] != b)
+                        if ((s.size() <= idx) || s[idx] != b)
                             s = {};
                         else if (s.size() == (idx + 1)) //match
                             return ExpectedResult(MatchAnyResult{std::ref(c), match});
@@ -84,16 +118,10 @@ namespace uart
 
         inline auto match_bytes(Channel &c, const uint8_t *pBytes, uint8_t terminator, const char *pCtx = "")
         {
-            using ExpectedResult = std::expected<Channel::Ref, ::Err>;
-            while(*pBytes != terminator)
-            {
-                if (auto r = c.ReadByte(); !r)
-                    return ExpectedResult(std::unexpected(r.error()));
-                else if (r.value().v != *pBytes)
-                    return ExpectedResult(std::unexpected(::Err{"match_bytes", ESP_OK}));
-                ++pBytes;
-            }
-            return ExpectedResult(std::ref(c));
+            const uint8_t *pEnd = pBytes;
+            while(*pEnd != terminator)
+                ++pEnd;
+            return uart::primitives::match_bytes(c, std::span<const uint8_t>(pBytes, pEnd), pCtx);
         }
 
         inline auto match_bytes(Channel &c, const char *pStr, const char *pCtx = "")
@@ -119,6 +147,7 @@ namespace uart
             using MatchAnyResult = Channel::RetVal<int>;
             using ExpectedResult = std::expected<MatchAnyResult, Err>;
             const uint8_t* sequences[sizeof...(BytePtr)]={(const uint8_t*)bytes...};
+            Channel::OpScope scope(c);
             bool anyValidLeft = true;
             size_t idx = 0;
 
@@ -161,25 +190,47 @@ namespace uart
             return uart::primitives::match_any_bytes_term(c, 0, std::forward<BytePtr>(bytes)...);
         }
 
+        //runs f (a sequence of primitives) with one deadline for all of it, see Channel::DeadlineScope
+        template<class F>
+        inline auto with_deadline(Channel &c, Deadline d, F &&f)
+        {
+            Channel::DeadlineScope scope(c, d);
+            return f();
+        }
+
+        template<class F>
+        inline auto with_timeout(Channel &c, duration_ms_t t, F &&f)
+        {
+            return uart::primitives::with_deadline(c, Deadline::after(t), std::forward<F>(f));
+        }
+
+        //skips bytes until 'until' (not consumed) within maxWait for the whole operation, kForever waits indefinitely
         inline auto read_until(Channel &c, uint8_t until, duration_ms_t maxWait = kForever, const char *pCtx = "")
         {
             using ExpectedResult = std::expected<Channel::Ref, ::Err>;
-            using clock_t = std::chrono::system_clock;
-            using time_point_t = std::chrono::time_point<clock_t>;
-            time_point_t start = clock_t::now();
-
-            while((maxWait != kForever) 
-                    && (std::chrono::duration_cast<std::chrono::milliseconds>(clock_t::now() - start) < maxWait))
+            Channel::DeadlineScope scope(c, Deadline::after(maxWait));
+            const duration_ms_t fillWait = c.GetOpDeadline().is_never() ? kForever : Channel::kDefaultWait;
+            while(true)
             {
-                if (auto r = c.PeekByte(); !r)
-                    return ExpectedResult(std::unexpected(r.error()));
-                else if (r.value().v == until)
-                    return ExpectedResult(std::ref(c));
+                auto w = c.Buffered();
+                if (w.empty())
+                {
+                    if (auto r = c.Fill(fillWait); !r)
+                    {
+                        if (c.GetOpDeadline().expired())
+                            return ExpectedResult(std::unexpected(::Err{"read_until timeout", ESP_OK}));
+                        return ExpectedResult(std::unexpected(r.error()));
+                    }
+                    w = c.Buffered();
+                }
 
-                if (auto r = c.ReadByte(); !r)
-                    return ExpectedResult(std::unexpected(r.error()));
+                if (auto *pFound = (const uint8_t*)std::memchr(w.data(), until, w.size()))
+                {
+                    c.Consume(pFound - w.data());
+                    return ExpectedResult(std::ref(c));
+                }
+                c.Consume(w.size());
             }
-            return ExpectedResult(std::unexpected(::Err{"read_until timeout", ESP_OK}));
         }
 
         template<class T>
@@ -205,13 +256,68 @@ namespace uart
             return ExpectedResult(std::ref(c));
         }
 
+        //frames up to that size are assembled on the stack (see write_any, read_any)
+        constexpr size_t kMaxFrameStackBuf = 256;
+
+        //write_any arguments that encode themselves (e.g. schema::out): size() bytes written by gather(p)
+        //into the frame, or sent on their own by run(c) when they can't say their size up front
+        template<class C>
+        concept is_functional_write_helper = requires{ typename C::functional_write_helper; };
+
+        template<class T>
+        concept is_frame_write_arg = !is_functional_write_helper<T> || requires(const T &a, uint8_t *p) { a.gather(p); };
+
+        template<class T>
+        constexpr size_t uart_write_sizeof()
+        {
+            if constexpr (is_functional_write_helper<T>)
+                return T::size();
+            else
+                return sizeof(T);
+        }
+
+        //packs all arguments into one contiguous frame at compile time and sends it with a single driver call,
+        //frames bigger than kMaxFrameStackBuf are gather-sent from the arguments in place;
+        //with write helpers that don't fit the frame the arguments are sent one after the other
         template<class... Args>
         inline auto write_any(Channel &c, Args&&... args)
         {
             using ExpectedResult = std::expected<Channel::Ref, ::Err>;
-            ExpectedResult r{std::ref(c)};
-            (void)((bool)(r = c.Send((uint8_t const*)&args, sizeof(args))) &&...);
-            return r;
+            constexpr bool kPacked = (is_frame_write_arg<std::remove_cvref_t<Args>> && ...);
+            constexpr bool kRaw = (!is_functional_write_helper<std::remove_cvref_t<Args>> && ...);
+            constexpr size_t kFrameSize = (uart_write_sizeof<std::remove_cvref_t<Args>>() + ... + 0);
+            if constexpr (kPacked && kFrameSize == 0)
+                return ExpectedResult(std::ref(c));
+            else if constexpr (kPacked && kFrameSize <= kMaxFrameStackBuf)
+            {
+                uint8_t frame[kFrameSize];
+                size_t off = 0;
+                ([&]{
+                    using A = std::remove_cvref_t<Args>;
+                    if constexpr (is_functional_write_helper<A>)
+                        args.gather(frame + off);
+                    else
+                        std::memcpy(frame + off, &args, sizeof(args));
+                    off += uart_write_sizeof<A>();
+                }(), ...);
+                return c.Send(frame, kFrameSize);
+            }
+            else if constexpr (kRaw)
+            {
+                std::span<const uint8_t> chunks[] = {std::span<const uint8_t>((uint8_t const*)&args, sizeof(args))...};
+                return c.SendV(chunks);
+            }
+            else
+            {
+                ExpectedResult res(std::ref(c));
+                (void)((res = [&]{
+                    if constexpr (is_functional_write_helper<std::remove_cvref_t<Args>>)
+                        return ExpectedResult(args.run(c));
+                    else
+                        return ExpectedResult(c.Send((const uint8_t*)&args, sizeof(args)));
+                }(), res.has_value()) && ...);
+                return res;
+            }
         }
 
         template<class T>
@@ -223,6 +329,12 @@ namespace uart
 
             static constexpr size_t size() { return sizeof(std::remove_cvref_t<T>); }
             auto run(Channel &c) { return uart::primitives::match_bytes(c, std::span<const uint8_t>((uint8_t const*)&v, sizeof(T)), pCtx); }
+            auto scatter(Channel &c, const uint8_t *pSrc) 
+            { 
+                if (std::memcmp(pSrc, &v, sizeof(T)) != 0)
+                    return Channel::ExpectedResult(std::unexpected(::Err{"match_bytes", ESP_OK}));
+                return Channel::ExpectedResult(std::ref(c));
+            }
         };
 
         template<size_t N>
@@ -231,6 +343,7 @@ namespace uart
             using functional_read_helper = void;
             static constexpr size_t size() { return N; }
             auto run(Channel &c) { return uart::primitives::skip_bytes(c, N); }
+            auto scatter(Channel &c, const uint8_t *pSrc) { return Channel::ExpectedResult(std::ref(c)); }
         };
 
         template<class CB>
@@ -306,20 +419,131 @@ namespace uart
                 return uart::primitives::read_into(c, a);
         }
 
+        //fields with a size known at compile time that can be decoded from memory
+        //(everything except read_var_t and callback_t)
+        template<class T>
+        concept is_frame_field = !is_functional_read_helper<T> || requires(T &a, Channel &c, const uint8_t *p) { a.scatter(c, p); };
+
+        namespace details
+        {
+            struct no_limit_t{};
+
+            template<class Tup, size_t I>
+            using frame_arg_t = std::remove_cvref_t<std::tuple_element_t<I, Tup>>;
+
+            template<class Tup, size_t I>
+            constexpr size_t frame_run_len()
+            {
+                if constexpr (I == std::tuple_size_v<Tup>)
+                    return 0;
+                else if constexpr (is_frame_field<frame_arg_t<Tup, I>>)
+                    return 1 + frame_run_len<Tup, I + 1>();
+                else
+                    return 0;
+            }
+
+            template<class Tup, size_t I, size_t... Is>
+            constexpr auto frame_run_offsets(std::index_sequence<Is...>)
+            {
+                std::array<size_t, sizeof...(Is) + 1> res{};
+                size_t off = 0, idx = 0;
+                ((res[idx++] = off, off += uart::primitives::uart_sizeof<frame_arg_t<Tup, I + Is>>()), ...);
+                res[idx] = off;
+                return res;
+            }
+
+            template<class T>
+            inline auto scatter_field(Channel &c, T &a, const uint8_t *pSrc)
+            {
+                using PureT = std::remove_cvref_t<T>;
+                if constexpr (is_functional_read_helper<PureT>)
+                    return a.scatter(c, pSrc);
+                else
+                {
+                    std::memcpy((void*)&a, pSrc, sizeof(PureT));
+                    return Channel::ExpectedResult(std::ref(c));
+                }
+            }
+
+            template<size_t I, class Tup, size_t... Is>
+            inline auto scatter_run(Channel &c, Tup &args, const uint8_t *pSrc, std::index_sequence<Is...> seq)
+            {
+                constexpr auto offsets = frame_run_offsets<Tup, I>(seq);
+                Channel::ExpectedResult r(std::ref(c));
+                (void)((bool)(r = scatter_field(c, std::get<I + Is>(args), pSrc + offsets[Is])) && ...);
+                return r;
+            }
+
+            template<size_t I, class Tup, class Limit>
+            inline Channel::ExpectedResult read_frame_from(Channel &c, Tup &args, Limit &limit)
+            {
+                constexpr bool limited = !std::is_same_v<Limit, no_limit_t>;
+                if constexpr (I == std::tuple_size_v<Tup>)
+                    return std::ref(c);
+                else
+                {
+                    constexpr size_t run = frame_run_len<Tup, I>();
+                    constexpr auto offsets = frame_run_offsets<Tup, I>(std::make_index_sequence<run>());
+                    constexpr size_t sz = offsets[run];
+                    //one field at a time: the limit is charged per field, so the fields that still fit are read
+                    //before the one that doesn't fails
+                    auto incremental = [&]() -> Channel::ExpectedResult {
+                        auto &a = std::get<I>(args);
+                        Channel::ExpectedResult r(std::ref(c));
+                        if constexpr (limited)
+                            r = uart::primitives::recv_for_checked(c, limit, a);
+                        else
+                            r = uart::primitives::recv_for(c, a);
+                        if (!r)
+                            return r;
+                        return read_frame_from<I + 1>(c, args, limit);
+                    };
+                    //a run of frame fields bigger than kMaxFrameStackBuf (or of empty ones) is read field by field
+                    //instead of through a stack buffer
+                    if constexpr ((run < 2) || (sz > kMaxFrameStackBuf) || (sz == 0))
+                        return incremental();
+                    else
+                    {
+                        if constexpr (limited)
+                        {
+                            //what the limit can't cover goes field by field, with the same outcome as before the
+                            //runs were batched
+                            if (limit < sz)
+                                return incremental();
+                            limit -= sz;
+                        }
+
+                        uint8_t buf[sz];
+                        if (auto r = uart::primitives::read_into_bytes(c, buf, sz); !r)
+                            return r;
+                        if (auto r = scatter_run<I>(c, args, buf, std::make_index_sequence<run>()); !r)
+                            return r;
+                        return read_frame_from<I + run>(c, args, limit);
+                    }
+                }
+            }
+        }
+
+        //reads consecutive fixed-size fields with one Read into a stack buffer and decodes them from there,
+        //read_var_t/callback_t fields are read/called in between as they come
+        //a match_t mismatch is detected only after the whole run of fixed fields has been consumed
         template<class... Args>
         inline auto read_any(Channel &c, Args&&... args)
         {
-            Channel::ExpectedResult r(std::ref(c));
-            (void)((bool)(r = uart::primitives::recv_for(c, args)) && ...);
-            return r;
+            Channel::OpScope scope(c);
+            details::no_limit_t noLimit;
+            std::tuple<Args&...> refs{args...};
+            return details::read_frame_from<0>(c, refs, noLimit);
         }
 
+        //as read_any, each field is charged against limit (remaining length of the frame) before it's read;
+        //a field that doesn't fit fails with "Insufficient length", the ones before it have been read
         template<class Sz, class... Args>
         inline auto read_any_limited(Channel &c, Sz &limit, Args&&... args)
         {
-            Channel::ExpectedResult r(std::ref(c));
-            (void)((bool)(r = uart::primitives::recv_for_checked(c, limit, args)) && ...);
-            return r;
+            Channel::OpScope scope(c);
+            std::tuple<Args&...> refs{args...};
+            return details::read_frame_from<0>(c, refs, limit);
         }
     }
 }
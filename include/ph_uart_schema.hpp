@@ -0,0 +1,567 @@
+#ifndef UART_SCHEMA_HPP_
+#define UART_SCHEMA_HPP_
+#include "ph_uart_primitives.hpp"
+#include <bit>
+#include <utility>
+
+namespace uart
+{
+    //declarative wire layout of a struct: which members, in which order and byte order, with constants and padding
+    //
+    //    struct Status{ uint16_t id; int32_t temp; uint8_t n; uint16_t samples[8]; };
+    //    using StatusWire = schema::Schema<Status,
+    //          schema::constant<uint8_t(0xA5)>,
+    //          schema::field<&Status::id, std::endian::big>,
+    //          schema::pad<2>,
+    //          schema::field<&Status::temp, std::endian::big>,
+    //          schema::prefixed<&Status::n, &Status::samples, std::endian::big>>;
+    //    StatusWire::read(c, status); StatusWire::write(c, status);
+    //
+    //Everything up to and including the next length prefix is a run of known size: it is decoded straight from
+    //the channel's receive window (one bulk Fill if needed) with one load + std::byteswap per scalar,
+    //the elements of a length-prefixed array are read in place into the destination and swapped there.
+    //Runs bigger than primitives::kMaxFrameStackBuf go field by field, fields bigger than that straight to the member.
+    namespace schema
+    {
+        namespace details
+        {
+            template<class M>
+            struct member_ptr;
+
+            template<class C, class V>
+            struct member_ptr<V C::*>
+            {
+                using cls = C;
+                using type = V;
+            };
+
+            template<auto M>
+            using member_t = typename member_ptr<decltype(M)>::type;
+
+            template<class A>
+            struct array_traits
+            {
+                using elem_t = A;
+                static constexpr size_t kCount = 1;
+                static constexpr bool kArray = false;
+            };
+
+            template<class E, size_t N>
+            struct array_traits<E[N]>
+            {
+                using elem_t = E;
+                static constexpr size_t kCount = N;
+                static constexpr bool kArray = true;
+            };
+
+            template<class E, size_t N>
+            struct array_traits<std::array<E, N>>
+            {
+                using elem_t = E;
+                static constexpr size_t kCount = N;
+                static constexpr bool kArray = true;
+            };
+
+            template<class V>
+            concept scalar = std::is_arithmetic_v<V> || std::is_enum_v<V>;
+
+            template<size_t N>
+            using uint_of_t = std::conditional_t<N == 1, uint8_t, std::conditional_t<N == 2, uint16_t, std::conditional_t<N == 4, uint32_t, uint64_t>>>;
+
+            template<scalar V, std::endian E>
+            inline V load(const uint8_t *p)
+            {
+                uint_of_t<sizeof(V)> u;
+                std::memcpy(&u, p, sizeof(u));
+                if constexpr (sizeof(V) > 1 && E != std::endian::native)
+                    u = std::byteswap(u);
+                return std::bit_cast<V>(u);
+            }
+
+            template<std::endian E, scalar V>
+            inline void store(V v, uint8_t *p)
+            {
+                auto u = std::bit_cast<uint_of_t<sizeof(V)>>(v);
+                if constexpr (sizeof(V) > 1 && E != std::endian::native)
+                    u = std::byteswap(u);
+                std::memcpy(p, &u, sizeof(u));
+            }
+
+            //the wire image of n elements is in place already, only the byte order needs fixing
+            template<scalar V, std::endian E>
+            inline void swap_in_place(V *pV, size_t n)
+            {
+                if constexpr (sizeof(V) > 1 && E != std::endian::native)
+                {
+                    for(size_t i = 0; i < n; ++i)
+                        pV[i] = load<V, E>((const uint8_t*)&pV[i]);
+                }
+            }
+
+            //reads n elements in place, see swap_in_place
+            template<scalar V, std::endian E>
+            inline Channel::ExpectedResult read_elements(Channel &c, V *pV, size_t n)
+            {
+                if (auto r = primitives::read_into_bytes(c, (uint8_t*)pV, n * sizeof(V)); !r)
+                    return r;
+                swap_in_place<V, E>(pV, n);
+                return std::ref(c);
+            }
+
+            //sends n elements, straight from memory when the byte order matches,
+            //otherwise swapped in kMaxFrameStackBuf chunks
+            template<scalar V, std::endian E>
+            inline Channel::ExpectedResult send_elements(Channel &c, const V *pV, size_t n)
+            {
+                if constexpr (sizeof(V) == 1 || E == std::endian::native)
+                    return c.Send((const uint8_t*)pV, n * sizeof(V));
+                else
+                {
+                    constexpr size_t kPerChunk = std::max<size_t>(primitives::kMaxFrameStackBuf / sizeof(V), 1);
+                    uint8_t buf[kPerChunk * sizeof(V)];
+                    for(size_t i = 0; i < n; i += kPerChunk)
+                    {
+                        size_t k = std::min(kPerChunk, n - i);
+                        for(size_t j = 0; j < k; ++j)
+                            store<E>(pV[i + j], buf + j * sizeof(V));
+                        if (auto r = c.Send(buf, k * sizeof(V)); !r)
+                            return r;
+                    }
+                    return std::ref(c);
+                }
+            }
+
+            template<class V>
+            inline auto& elements(V &v)
+            {
+                if constexpr (array_traits<std::remove_const_t<V>>::kArray)
+                    return v;
+                else
+                    return *reinterpret_cast<V(*)[1]>(&v);
+            }
+
+            //calls decode with Sz contiguous bytes from the channel: from the receive window when they fit there,
+            //otherwise through a stack buffer
+            template<size_t Sz, class F>
+            inline Channel::ExpectedResult with_bytes(Channel &c, const char *pCtx, F &&decode)
+            {
+                static_assert(Sz <= primitives::kMaxFrameStackBuf, "bigger runs are read field by field");
+                auto w = c.Buffered();
+                if (w.size() < Sz && Sz <= c.GetRxWindowSize())
+                {
+                    while((w = c.Buffered()).size() < Sz)
+                    {
+                        if (auto r = c.Fill(Channel::kDefaultWait, Sz - w.size()); !r)
+                            return std::unexpected(r.error());
+                    }
+                }
+
+                esp_err_t e;
+                if (w.size() >= Sz)
+                {
+                    e = decode(w.data());
+                    c.Consume(Sz);
+                }
+                else
+                {
+                    uint8_t buf[Sz];
+                    if (auto r = primitives::read_into_bytes(c, buf, Sz); !r)
+                        return r;
+                    e = decode(buf);
+                }
+                if (e != ESP_OK)
+                    return std::unexpected(::Err{pCtx, e});
+                return std::ref(c);
+            }
+        }
+
+        //a scalar member (integral, enum, floating point) or a fixed array of them
+        template<auto M, std::endian E = std::endian::little>
+        struct field
+        {
+            using value_t = details::member_t<M>;
+            using traits_t = details::array_traits<value_t>;
+            using elem_t = typename traits_t::elem_t;
+            static_assert(details::scalar<elem_t>, "schema::field: scalars or arrays of scalars only");
+
+            static constexpr size_t kSize = sizeof(elem_t) * traits_t::kCount;
+            static constexpr size_t kMaxTail = 0;
+            static constexpr bool kVariable = false;
+
+            template<class T>
+            static esp_err_t decode(T &o, const uint8_t *p)
+            {
+                auto &a = details::elements(o.*M);
+                for(size_t i = 0; i < traits_t::kCount; ++i)
+                    a[i] = details::load<elem_t, E>(p + i * sizeof(elem_t));
+                return ESP_OK;
+            }
+
+            template<class T>
+            static esp_err_t encode(const T &o, uint8_t *p)
+            {
+                auto &a = details::elements(o.*M);
+                for(size_t i = 0; i < traits_t::kCount; ++i)
+                    details::store<E>(a[i], p + i * sizeof(elem_t));
+                return ESP_OK;
+            }
+
+            //fields bigger than primitives::kMaxFrameStackBuf go to and from the member directly
+            template<class T>
+            static Channel::ExpectedResult read_direct(Channel &c, T &o) { return details::read_elements<elem_t, E>(c, &details::elements(o.*M)[0], traits_t::kCount); }
+            template<class T>
+            static Channel::ExpectedResult write_direct(Channel &c, const T &o) { return details::send_elements<elem_t, E>(c, &details::elements(o.*M)[0], traits_t::kCount); }
+        };
+
+        //a value that has to be there (sync bytes, ids, versions); written as is, a mismatch fails the read
+        template<auto V, std::endian E = std::endian::little>
+        struct constant
+        {
+            static_assert(details::scalar<decltype(V)>);
+            static constexpr size_t kSize = sizeof(V);
+            static constexpr size_t kMaxTail = 0;
+            static constexpr bool kVariable = false;
+
+            template<class T>
+            static esp_err_t decode(T &, const uint8_t *p) { return details::load<decltype(V), E>(p) == V ? ESP_OK : ESP_ERR_INVALID_RESPONSE; }
+            template<class T>
+            static esp_err_t encode(const T &, uint8_t *p) { details::store<E>(V, p); return ESP_OK; }
+        };
+
+        //N bytes that are skipped when reading and written as Fill
+        template<size_t N, uint8_t Fill = 0>
+        struct pad
+        {
+            static constexpr size_t kSize = N;
+            static constexpr size_t kMaxTail = 0;
+            static constexpr bool kVariable = false;
+
+            template<class T>
+            static esp_err_t decode(T &, const uint8_t *) { return ESP_OK; }
+            template<class T>
+            static esp_err_t encode(const T &, uint8_t *p) { std::memset(p, Fill, N); return ESP_OK; }
+
+            template<class T>
+            static Channel::ExpectedResult read_direct(Channel &c, T &) { return primitives::skip_bytes(c, N); }
+            template<class T>
+            static Channel::ExpectedResult write_direct(Channel &c, const T &)
+            {
+                constexpr size_t kChunk = std::min(N, primitives::kMaxFrameStackBuf);
+                uint8_t buf[kChunk];
+                std::memset(buf, Fill, kChunk);
+                for(size_t left = N; left; )
+                {
+                    size_t k = std::min(kChunk, left);
+                    if (auto r = c.Send(buf, k); !r)
+                        return r;
+                    left -= k;
+                }
+                return std::ref(c);
+            }
+        };
+
+        //element count (as WireCount) followed by that many elements of the array member DataM,
+        //the count lives in CountM; counts bigger than the array fail with ESP_ERR_INVALID_SIZE
+        template<auto CountM, auto DataM, std::endian E = std::endian::little, class WireCount = details::member_t<CountM>>
+        struct prefixed
+        {
+            using count_t = details::member_t<CountM>;
+            using traits_t = details::array_traits<details::member_t<DataM>>;
+            using elem_t = typename traits_t::elem_t;
+            static_assert(traits_t::kArray && details::scalar<elem_t>, "schema::prefixed: the data member must be an array of scalars");
+            static_assert(std::is_integral_v<WireCount>);
+
+            static constexpr size_t kCapacity = traits_t::kCount;
+            static constexpr size_t kSize = sizeof(WireCount);
+            static constexpr size_t kMaxTail = kCapacity * sizeof(elem_t);
+            static constexpr bool kVariable = true;
+
+            template<class T>
+            static esp_err_t decode(T &o, const uint8_t *p)
+            {
+                auto n = details::load<WireCount, E>(p);
+                if (std::cmp_less(n, 0) || std::cmp_greater(n, kCapacity))
+                    return ESP_ERR_INVALID_SIZE;
+                o.*CountM = count_t(n);
+                return ESP_OK;
+            }
+
+            template<class T>
+            static esp_err_t encode(const T &o, uint8_t *p)
+            {
+                if (size_t(o.*CountM) > kCapacity)
+                    return ESP_ERR_INVALID_SIZE;
+                details::store<E>(WireCount(o.*CountM), p);
+                return ESP_OK;
+            }
+
+            template<class T>
+            static size_t tail_size(const T &o) { return std::min(size_t(o.*CountM), kCapacity) * sizeof(elem_t); }
+
+            template<class T>
+            static void decode_tail(T &o, const uint8_t *p)
+            {
+                auto &a = o.*DataM;
+                for(size_t i = 0, n = size_t(o.*CountM); i < n; ++i)
+                    a[i] = details::load<elem_t, E>(p + i * sizeof(elem_t));
+            }
+
+            template<class T>
+            static void encode_tail(const T &o, uint8_t *p)
+            {
+                auto &a = o.*DataM;
+                for(size_t i = 0, n = size_t(o.*CountM); i < n; ++i)
+                    details::store<E>(a[i], p + i * sizeof(elem_t));
+            }
+
+            template<class T>
+            static Channel::ExpectedResult read_tail(Channel &c, T &o)
+            {
+                return details::read_elements<elem_t, E>(c, &(o.*DataM)[0], size_t(o.*CountM));
+            }
+
+            template<class T>
+            static Channel::ExpectedResult write_tail(Channel &c, const T &o)
+            {
+                return details::send_elements<elem_t, E>(c, &(o.*DataM)[0], size_t(o.*CountM));
+            }
+        };
+
+        template<class T, class... F>
+        struct Schema
+        {
+            using ExpectedSize = std::expected<size_t, ::Err>;
+
+            static constexpr size_t kFields = sizeof...(F);
+            static constexpr bool kFixedSize = (!F::kVariable && ...);
+            static constexpr size_t kMinSize = (F::kSize + ... + 0);
+            static constexpr size_t kMaxSize = ((F::kSize + F::kMaxTail) + ... + 0);
+
+            static size_t wire_size(const T &o)
+            {
+                size_t sz = kMinSize;
+                ([&]{ if constexpr (F::kVariable) sz += F::tail_size(o); }(), ...);
+                return sz;
+            }
+
+            //reads and decodes one T from the channel
+            static Channel::ExpectedResult read(Channel &c, T &o)
+            {
+                Channel::OpScope scope(c);
+                return read_from<0>(c, o);
+            }
+
+            //encodes o and sends it, with a single driver call when kMaxSize fits primitives::kMaxFrameStackBuf
+            static Channel::ExpectedResult write(Channel &c, const T &o)
+            {
+                if constexpr (kMaxSize <= primitives::kMaxFrameStackBuf)
+                {
+                    uint8_t buf[kMaxSize];
+                    auto n = encode(buf, o);
+                    if (!n)
+                        return std::unexpected(n.error());
+                    return c.Send(buf, *n);
+                }
+                else
+                    return write_from<0>(c, o);
+            }
+
+            //memory variants, e.g. for FramedLink payloads; return the amount of bytes used
+            static ExpectedSize decode(std::span<const uint8_t> in, T &o)
+            {
+                size_t off = 0;
+                esp_err_t e = ESP_OK;
+                ([&]{
+                    if (e != ESP_OK)
+                        return;
+                    if (in.size() - off < F::kSize)
+                    {
+                        e = ESP_ERR_INVALID_SIZE;
+                        return;
+                    }
+                    e = F::decode(o, in.data() + off);
+                    off += F::kSize;
+                    if constexpr (F::kVariable)
+                    {
+                        if (e != ESP_OK)
+                            return;
+                        size_t t = F::tail_size(o);
+                        if (in.size() - off < t)
+                        {
+                            e = ESP_ERR_INVALID_SIZE;
+                            return;
+                        }
+                        F::decode_tail(o, in.data() + off);
+                        off += t;
+                    }
+                }(), ...);
+                if (e != ESP_OK)
+                    return std::unexpected(::Err{"uart::schema::decode", e});
+                return off;
+            }
+
+            static ExpectedSize encode(std::span<uint8_t> out, const T &o)
+            {
+                size_t off = 0;
+                esp_err_t e = ESP_OK;
+                ([&]{
+                    if (e != ESP_OK)
+                        return;
+                    if (out.size() - off < F::kSize)
+                    {
+                        e = ESP_ERR_INVALID_SIZE;
+                        return;
+                    }
+                    e = F::encode(o, out.data() + off);
+                    off += F::kSize;
+                    if constexpr (F::kVariable)
+                    {
+                        if (e != ESP_OK)
+                            return;
+                        size_t t = F::tail_size(o);
+                        if (out.size() - off < t)
+                        {
+                            e = ESP_ERR_INVALID_SIZE;
+                            return;
+                        }
+                        F::encode_tail(o, out.data() + off);
+                        off += t;
+                    }
+                }(), ...);
+                if (e != ESP_OK)
+                    return std::unexpected(::Err{"uart::schema::encode", e});
+                return off;
+            }
+        private:
+            template<size_t I>
+            using field_t = std::tuple_element_t<I, std::tuple<F...>>;
+
+            //fields from I up to and including the next variable one
+            template<size_t I>
+            static constexpr size_t run_len()
+            {
+                if constexpr (I == kFields)
+                    return 0;
+                else if constexpr (field_t<I>::kVariable)
+                    return 1;
+                else
+                    return 1 + run_len<I + 1>();
+            }
+
+            template<size_t I, size_t... Is>
+            static constexpr size_t run_size(std::index_sequence<Is...>) { return (field_t<I + Is>::kSize + ... + 0); }
+
+            template<size_t I, size_t... Is>
+            static esp_err_t decode_run(T &o, const uint8_t *p, std::index_sequence<Is...>)
+            {
+                esp_err_t e = ESP_OK;
+                size_t off = 0;
+                (void)(((e = field_t<I + Is>::decode(o, p + off), off += field_t<I + Is>::kSize, e == ESP_OK)) && ...);
+                return e;
+            }
+
+            template<size_t I, size_t... Is>
+            static esp_err_t encode_run(const T &o, uint8_t *p, std::index_sequence<Is...>)
+            {
+                esp_err_t e = ESP_OK;
+                size_t off = 0;
+                (void)(((e = field_t<I + Is>::encode(o, p + off), off += field_t<I + Is>::kSize, e == ESP_OK)) && ...);
+                return e;
+            }
+
+            template<size_t I>
+            static Channel::ExpectedResult read_from(Channel &c, T &o)
+            {
+                if constexpr (I == kFields)
+                    return std::ref(c);
+                else
+                {
+                    constexpr size_t n0 = run_len<I>();
+                    //a run bigger than the stack buffer goes field by field, big fields straight into the member
+                    constexpr bool kSplit = run_size<I>(std::make_index_sequence<n0>()) > primitives::kMaxFrameStackBuf;
+                    constexpr size_t n = kSplit ? 1 : n0;
+                    using seq_t = std::make_index_sequence<n>;
+                    constexpr size_t sz = run_size<I>(seq_t{});
+                    if constexpr (sz > primitives::kMaxFrameStackBuf)
+                    {
+                        if (auto r = field_t<I>::read_direct(c, o); !r)
+                            return r;
+                    }
+                    else if (auto r = details::with_bytes<sz>(c, "uart::schema::read", [&](const uint8_t *p){ return decode_run<I>(o, p, seq_t{}); }); !r)
+                        return r;
+                    if constexpr (field_t<I + n - 1>::kVariable)
+                    {
+                        if (auto r = field_t<I + n - 1>::read_tail(c, o); !r)
+                            return r;
+                    }
+                    return read_from<I + n>(c, o);
+                }
+            }
+
+            template<size_t I>
+            static Channel::ExpectedResult write_from(Channel &c, const T &o)
+            {
+                if constexpr (I == kFields)
+                    return std::ref(c);
+                else
+                {
+                    constexpr size_t n0 = run_len<I>();
+                    constexpr bool kSplit = run_size<I>(std::make_index_sequence<n0>()) > primitives::kMaxFrameStackBuf;
+                    constexpr size_t n = kSplit ? 1 : n0;
+                    using seq_t = std::make_index_sequence<n>;
+                    constexpr size_t sz = run_size<I>(seq_t{});
+                    if constexpr (sz > primitives::kMaxFrameStackBuf)
+                    {
+                        if (auto r = field_t<I>::write_direct(c, o); !r)
+                            return r;
+                    }
+                    else
+                    {
+                        uint8_t buf[sz];
+                        if (esp_err_t e = encode_run<I>(o, buf, seq_t{}); e != ESP_OK)
+                            return std::unexpected(::Err{"uart::schema::write", e});
+                        if (auto r = c.Send(buf, sizeof(buf)); !r)
+                            return r;
+                    }
+                    if constexpr (field_t<I + n - 1>::kVariable)
+                    {
+                        if (auto r = field_t<I + n - 1>::write_tail(c, o); !r)
+                            return r;
+                    }
+                    return write_from<I + n>(c, o);
+                }
+            }
+        };
+
+        //lets a schema take part in primitives::read_any: read_any(c, match_t{...}, schema::in<StatusWire>(status))
+        template<class S, class T>
+        struct in_t
+        {
+            using functional_read_helper = void;
+            T &v;
+
+            static constexpr size_t size() { return 0; }
+            auto run(Channel &c) { return S::read(c, v); }
+        };
+
+        template<class S, class T>
+        inline auto in(T &v) { return in_t<S, T>{v}; }
+
+        //the same for primitives::write_any: write_any(c, hdr, schema::out<StatusWire>(status), crc)
+        //fixed size schemas are encoded into write_any's frame, variable ones are sent on their own
+        template<class S, class T>
+        struct out_t
+        {
+            using functional_write_helper = void;
+            const T &v;
+
+            static constexpr size_t size() { return S::kFixedSize ? S::kMinSize : 0; }
+            void gather(uint8_t *pDst) const requires (S::kFixedSize) { (void)S::encode({pDst, S::kMinSize}, v); }
+            auto run(Channel &c) const { return S::write(c, v); }
+        };
+
+        template<class S, class T>
+        inline auto out(const T &v) { return out_t<S, T>{v}; }
+    }
+}
+#endif
@@ -0,0 +1,271 @@
+#include "ph_at.hpp"
+#include <algorithm>
+#include <cstring>
+#include <optional>
+
+namespace at
+{
+    namespace
+    {
+        std::string_view as_sv(std::span<const uint8_t> line) { return {(const char*)line.data(), line.size()}; }
+
+        int parse_err_code(std::string_view s)
+        {
+            while(!s.empty() && s.front() == ' ')
+                s.remove_prefix(1);
+            if (s.empty())
+                return -1;
+            int v = 0;
+            for(char c : s)
+            {
+                if (c < '0' || c > '9')
+                    return -1;
+                v = v * 10 + (c - '0');
+            }
+            return v;
+        }
+
+        std::optional<Result> parse_final(std::string_view l)
+        {
+            constexpr std::string_view kCme = "+CME ERROR:";
+            constexpr std::string_view kCms = "+CMS ERROR:";
+            if (l == "OK") return Result{Final::Ok};
+            if (l == "ERROR") return Result{Final::Error};
+            if (l.starts_with(kCme)) return Result{Final::CmeError, parse_err_code(l.substr(kCme.size()))};
+            if (l.starts_with(kCms)) return Result{Final::CmsError, parse_err_code(l.substr(kCms.size()))};
+            if (l == "NO CARRIER") return Result{Final::NoCarrier};
+            if (l == "BUSY") return Result{Final::Busy};
+            if (l == "NO ANSWER") return Result{Final::NoAnswer};
+            if (l == "NO DIALTONE") return Result{Final::NoDialtone};
+            if (l.starts_with("CONNECT")) return Result{Final::Connect};
+            return std::nullopt;
+        }
+    }
+
+    Engine::Engine(uart::Channel &c):
+        m_C(c)
+    {
+    }
+
+    Engine& Engine::SetMaxInFlight(size_t n)
+    {
+        m_MaxInFlight = std::clamp<size_t>(n, 1, kMaxQueued);
+        return *this;
+    }
+
+    Engine::ExpectedResult Engine::RegisterUrc(std::string_view prefix, LineCallback cb)
+    {
+        if (prefix.empty())
+            return std::unexpected(Err{"at::Engine::RegisterUrc", ESP_ERR_INVALID_ARG});
+        for(auto &u : m_Urcs)
+        {
+            if (u.prefix.empty())
+            {
+                u.prefix = prefix;
+                u.cb = std::move(cb);
+                return std::ref(*this);
+            }
+        }
+        return std::unexpected(Err{"at::Engine::RegisterUrc", ESP_ERR_NO_MEM});
+    }
+
+    Engine::ExpectedResult Engine::UnregisterUrc(std::string_view prefix)
+    {
+        for(auto &u : m_Urcs)
+        {
+            if (u.prefix == prefix)
+            {
+                u = {};
+                return std::ref(*this);
+            }
+        }
+        return std::unexpected(Err{"at::Engine::UnregisterUrc", ESP_ERR_NOT_FOUND});
+    }
+
+    Engine::ExpectedResult Engine::Submit(Command &&cmd)
+    {
+        if (m_Tail - m_Head == kMaxQueued)
+            return std::unexpected(Err{"at::Engine::Submit queue full", ESP_ERR_NO_MEM});
+        slot(m_Tail) = std::move(cmd);
+        ++m_Tail;
+        return std::ref(*this);
+    }
+
+    void Engine::complete(Result r)
+    {
+        auto cb = std::move(slot(m_Head).on_done);
+        slot(m_Head) = {};
+        ++m_Head;
+        if (cb)
+            cb(r);
+    }
+
+    void Engine::expire()
+    {
+        //completions go in order, so only the oldest command can time out
+        if (m_Head == m_Sent || !slot(m_Head).deadline.expired())
+            return;
+        //its result may still come and would be taken for the next one's: with more outstanding,
+        //none of the results can be matched anymore, fail them all
+        size_t n = m_Sent - m_Head;
+        while(n--)
+            complete({Final::Timeout});
+    }
+
+    Engine::ExpectedResult Engine::send_queued()
+    {
+        while(m_Sent != m_Tail && (m_Sent - m_Head) < m_MaxInFlight)
+        {
+            auto &c = slot(m_Sent);
+            ++m_Sent;
+            if (c.deadline.expired() && m_Head == m_Sent - 1)
+            {
+                complete({Final::Timeout});
+                continue;
+            }
+
+            static constexpr uint8_t kCR[] = {'\r'};
+            std::span<const uint8_t> chunks[] = {{(const uint8_t*)c.text.data(), c.text.size()}, kCR};
+            if (auto r = m_C.SendV(chunks); !r)
+                return std::unexpected(r.error());
+        }
+        return std::ref(*this);
+    }
+
+    void Engine::dispatch(std::span<const uint8_t> line)
+    {
+        auto l = as_sv(line);
+        if (m_Head != m_Sent)
+        {
+            //echoes come as the modem takes the commands, ahead of the head's result when several are outstanding
+            for(size_t i = m_Head; i != m_Sent; ++i)
+                if (l == slot(i).text)
+                    return;
+            auto &c = slot(m_Head);
+            if (auto r = parse_final(l))
+            {
+                complete(*r);
+                return;
+            }
+            if (!c.response_prefix.empty() && l.starts_with(c.response_prefix))
+            {
+                if (c.on_line)
+                    c.on_line(line);
+                return;
+            }
+        }
+
+        for(auto &u : m_Urcs)
+        {
+            if (!u.prefix.empty() && l.starts_with(u.prefix))
+            {
+                if (u.cb)
+                    u.cb(line);
+                return;
+            }
+        }
+
+        if (m_Head != m_Sent)
+        {
+            if (auto &c = slot(m_Head); c.on_line)
+                c.on_line(line);
+        }else if (m_Unhandled)
+            m_Unhandled(line);
+    }
+
+    duration_ms_t Engine::next_wait(const uart::Deadline &until)
+    {
+        uart::Deadline d = until;
+        if (m_Head != m_Tail && slot(m_Head).deadline.at < d.at)
+            d = slot(m_Head).deadline;
+        return d.remaining();
+    }
+
+    Engine::ExpectedValue<size_t> Engine::Process(duration_ms_t wait)
+    {
+        auto until = uart::Deadline::after(wait);
+        size_t lines = 0;
+        while(true)
+        {
+            expire();
+            if (auto r = send_queued(); !r)
+                return std::unexpected(r.error());
+
+            auto w = m_C.Buffered();
+            if (!w.empty())
+            {
+                if (m_Head != m_Sent && slot(m_Head).wait_prompt && w.size() >= 2 && w[0] == '>' && w[1] == ' ')
+                {
+                    m_C.Consume(2);
+                    complete({Final::Prompt});
+                    ++lines;
+                    continue;
+                }
+
+                if (auto *pNL = (const uint8_t*)std::memchr(w.data(), '\n', w.size()))
+                {
+                    size_t len = pNL - w.data();
+                    auto line = w.first(len);
+                    //the echo ends with a single \r and runs into the response's \r\n
+                    while(!line.empty() && line.back() == '\r')
+                        line = line.first(line.size() - 1);
+                    while(!line.empty() && line.front() == '\r')
+                        line = line.subspan(1);
+                    if (!line.empty())
+                    {
+                        dispatch(line);
+                        ++lines;
+                    }
+                    m_C.Consume(len + 1);
+                    continue;
+                }
+            }
+
+            if (auto f = m_C.Fill(lines ? duration_ms_t{0} : next_wait(until)); !f)
+            {
+                if (f.error().code == ESP_ERR_NO_MEM && !w.empty())
+                {
+                    //longer than the receive window: hand out what fits
+                    dispatch(w);
+                    ++lines;
+                    m_C.Consume(w.size());
+                    continue;
+                }
+                if (f.error().code != ESP_OK)
+                    return std::unexpected(f.error());
+                if (lines || until.expired())
+                    break;
+            }
+        }
+        return RetVal<size_t>{*this, lines};
+    }
+
+    Engine::ExpectedValue<Result> Engine::Execute(Command cmd)
+    {
+        Result res;
+        bool done = false;
+        auto user = std::move(cmd.on_done);
+        cmd.on_done = [&](Result r){
+            res = r;
+            done = true;
+            if (user)
+                user(r);
+        };
+        auto deadline = cmd.deadline;
+        if (auto r = Submit(std::move(cmd)); !r)
+            return std::unexpected(r.error());
+        size_t idx = m_Tail - 1;
+
+        while(!done)
+        {
+            if (auto r = Process(deadline.remaining()); !r)
+            {
+                //still queued: must not refer to this frame anymore
+                if (!done && (idx - m_Head) < (m_Tail - m_Head))
+                    slot(idx).on_done = std::move(user);
+                return std::unexpected(r.error());
+            }
+        }
+        return RetVal<Result>{*this, res};
+    }
+}
@@ -1,5 +1,8 @@
 #include "ph_i2c.hpp"
+#include "ph_trace.hpp"
 #include <functional>
+#include <algorithm>
+#include "esp_timer.h"
 
 namespace i2c
 {
@@ -96,6 +99,17 @@ namespace i2c
         return m_Config.flags.enable_internal_pullup;
     }
 
+    I2CBusMaster& I2CBusMaster::SetTransQueueDepth(size_t depth)
+    {
+        m_Config.trans_queue_depth = depth;
+        return *this;
+    }
+
+    size_t I2CBusMaster::GetTransQueueDepth() const
+    {
+        return m_Config.trans_queue_depth;
+    }
+
     I2CBusMaster::ExpectedResult I2CBusMaster::Open()
     {
         CALL_ESP_EXPECTED("I2CBusMaster::Open", i2c_new_master_bus(&m_Config, &m_Handle));
@@ -132,10 +146,30 @@ namespace i2c
 
     I2CDevice::I2CDevice(I2CDevice &&rhs):
         m_Bus(rhs.m_Bus),
-        m_Handle(rhs.m_Handle),
-        m_Config(rhs.m_Config)
-    {
+        m_Config(rhs.m_Config),
+        m_Burst(rhs.m_Burst),
+        m_BurstFlag(rhs.m_BurstFlag),
+        m_pRegCache(rhs.m_pRegCache),
+        m_Async(rhs.m_Async)
+    {
+        m_Stats.transactions = rhs.m_Stats.transactions.load();
+        m_Stats.tx_bytes = rhs.m_Stats.tx_bytes.load();
+        m_Stats.rx_bytes = rhs.m_Stats.rx_bytes.load();
+        m_Stats.bus_us = rhs.m_Stats.bus_us.load();
+        rhs.m_pRegCache = nullptr;
+
+        //queued transfers complete through rhs, so rhs keeps the device then and this one stays closed
+        portENTER_CRITICAL(&rhs.m_PendingMux);
+        bool pending = rhs.m_PendingHead != rhs.m_PendingTail;
+        portEXIT_CRITICAL(&rhs.m_PendingMux);
+        if (pending)
+            return;
+
+        m_Handle = rhs.m_Handle;
         rhs.m_Handle = nullptr;
+        //the callbacks carry the device pointer
+        if (m_Handle && m_Async)
+            register_callbacks();
     }
 
     I2CDevice& I2CDevice::SetAddress(uint16_t addr)
@@ -164,6 +198,15 @@ namespace i2c
     {
         thread::LockGuard busLock{m_Bus.m_pLock};
         CALL_ESP_EXPECTED("I2CDevice::Open", i2c_master_bus_add_device(m_Bus.m_Handle, &m_Config, &m_Handle));
+        if (m_Async)
+        {
+            if (esp_err_t e = register_callbacks(); e != ESP_OK)
+            {
+                i2c_master_bus_rm_device(m_Handle);
+                m_Handle = nullptr;
+                return std::unexpected(Err{"I2CDevice::Open callbacks", e});
+            }
+        }
         return std::ref(*this);
     }
 
@@ -172,22 +215,159 @@ namespace i2c
         if (m_Handle)
         {
             thread::LockGuard busLock{m_Bus.m_pLock};
+            //queued transfers still point into this device: let the driver finish them, whatever it didn't
+            //complete fails
+            if (m_PendingHead != m_PendingTail)
+                i2c_master_bus_wait_all_done(m_Bus.m_Handle, -1);
+            fail_pending(ESP_ERR_INVALID_STATE);
             i2c_master_bus_rm_device(m_Handle);
             m_Handle = nullptr;
         }
         return std::ref(*this);
     }
 
+    I2CDevice::Transfer::Transfer():
+        m_Sem(xSemaphoreCreateBinaryStatic(&m_SemBuf))
+    {
+    }
+
+    I2CDevice::Transfer::~Transfer()
+    {
+        vSemaphoreDelete(m_Sem);
+    }
+
+    esp_err_t I2CDevice::Transfer::Wait(duration_t d)
+    {
+        if (m_Done)
+            return m_Err;
+        TickType_t ticks = d == kForever ? portMAX_DELAY : pdMS_TO_TICKS(d.count());
+        if (xSemaphoreTake(m_Sem, ticks) != pdTRUE)
+            return ESP_ERR_TIMEOUT;
+        //the completion gives the semaphore before its last touch of the transfer
+        while(!m_Done);
+        return m_Err;
+    }
+
+    esp_err_t I2CDevice::register_callbacks()
+    {
+        i2c_master_event_callbacks_t cbs{};
+        cbs.on_trans_done = &I2CDevice::on_trans_done;
+        return i2c_master_register_event_callbacks(m_Handle, &cbs, this);
+    }
+
+    bool I2CDevice::on_trans_done(i2c_master_dev_handle_t h, const i2c_master_event_data_t *pEvt, void *pArg)
+    {
+        if (pEvt->event == I2C_EVENT_ALIVE)
+            return false;
+        I2CDevice *pDev = static_cast<I2CDevice*>(pArg);
+        Transfer *pT = nullptr;
+        portENTER_CRITICAL_ISR(&pDev->m_PendingMux);
+        if (pDev->m_PendingHead != pDev->m_PendingTail)
+            pT = pDev->m_Pending[pDev->m_PendingHead++ % kMaxPending];
+        portEXIT_CRITICAL_ISR(&pDev->m_PendingMux);
+        if (!pT)
+            return false;
+
+        switch(pEvt->event)
+        {
+            case I2C_EVENT_DONE: pT->m_Err = ESP_OK; break;
+            case I2C_EVENT_NACK: pT->m_Err = ESP_ERR_INVALID_RESPONSE; break;
+            case I2C_EVENT_TIMEOUT: pT->m_Err = ESP_ERR_TIMEOUT; break;
+            default: pT->m_Err = ESP_FAIL; break;
+        }
+        //on the bus from the later of its submission and the end of the transfer before it
+        int64_t now = esp_timer_get_time();
+        if (pT->m_Counted)
+        {
+            auto &s = pDev->m_Stats;
+            s.transactions.fetch_add(1, std::memory_order_relaxed);
+            s.tx_bytes.fetch_add(pT->m_Tx, std::memory_order_relaxed);
+            s.rx_bytes.fetch_add(pT->m_Rx, std::memory_order_relaxed);
+            s.bus_us.fetch_add(uint32_t(now - std::max(pT->m_SubmitUs, pDev->m_LastDoneUs)), std::memory_order_relaxed);
+        }
+        pDev->m_LastDoneUs = now;
+
+        BaseType_t woken = pdFALSE;
+        xSemaphoreGiveFromISR(pT->m_Sem, &woken);
+        pT->m_Done = true;//last access, the owner may drop t from here on
+        return woken == pdTRUE;
+    }
+
+    void I2CDevice::fail_pending(esp_err_t e)
+    {
+        for(;;)
+        {
+            Transfer *pT = nullptr;
+            portENTER_CRITICAL(&m_PendingMux);
+            if (m_PendingHead != m_PendingTail)
+                pT = m_Pending[m_PendingHead++ % kMaxPending];
+            portEXIT_CRITICAL(&m_PendingMux);
+            if (!pT)
+                return;
+            pT->m_Err = e;
+            xSemaphoreGive(pT->m_Sem);
+            pT->m_Done = true;
+        }
+    }
+
+    template<class F>
+    esp_err_t I2CDevice::submit(Transfer &t, F &&call, bool counted, size_t tx, size_t rx)
+    {
+        if (!m_Handle || !m_Async || !t.m_Done)
+            return ESP_ERR_INVALID_STATE;
+
+        //the bus lock (taken by the callers) keeps the pending list in driver order when several tasks submit
+        portENTER_CRITICAL(&m_PendingMux);
+        if (m_PendingTail - m_PendingHead == kMaxPending)
+        {
+            portEXIT_CRITICAL(&m_PendingMux);
+            return ESP_ERR_NO_MEM;
+        }
+        m_Pending[m_PendingTail++ % kMaxPending] = &t;
+        t.m_Done = false;
+        t.m_Counted = counted;
+        t.m_Tx = tx;
+        t.m_Rx = rx;
+        t.m_SubmitUs = esp_timer_get_time();
+        portEXIT_CRITICAL(&m_PendingMux);
+        xSemaphoreTake(t.m_Sem, 0);//a completion nobody waited for
+
+        esp_err_t e = call();
+        if (e != ESP_OK)
+        {
+            //never queued, so t is still the last entry
+            portENTER_CRITICAL(&m_PendingMux);
+            --m_PendingTail;
+            portEXIT_CRITICAL(&m_PendingMux);
+            t.m_Err = e;
+            t.m_Done = true;
+        }
+        return e;
+    }
+
+    template<class F>
+    esp_err_t I2CDevice::run(F &&call)
+    {
+        if (!m_Async)
+            return call();
+        Transfer t;
+        if (esp_err_t e = submit(t, call); e != ESP_OK)
+            return e;
+        //the driver times the transfer out itself, t must not go away before that
+        return t.Wait(kForever);
+    }
+
     I2CDevice::ExpectedResult I2CDevice::Send(const uint8_t *pBuf, std::size_t len, duration_t d)
     {
         if (!m_Handle) return std::unexpected(Err{"I2CDevice::Send", ESP_ERR_INVALID_STATE});
 
 #ifndef NDEBUG
         if (m_Dbg.print_send)
-            FMT_PRINT("Send: {}\n", std::span<const uint8_t>(pBuf, len));
+            PH_TRACE(trace::Kind::I2CTx, m_Config.device_address, pBuf, len);
 #endif
+        Transaction t{*this, len, 0};
         thread::LockGuard busLock{m_Bus.m_pLock};
-        CALL_ESP_EXPECTED("I2CDevice::Send", i2c_master_transmit(m_Handle, pBuf, len, d.count()));
+        CALL_ESP_EXPECTED("I2CDevice::Send", run([&]{ return i2c_master_transmit(m_Handle, pBuf, len, d.count()); }));
         return std::ref(*this);
     }
 
@@ -198,16 +378,16 @@ namespace i2c
 #ifndef NDEBUG
         if (m_Dbg.print_send)
         {
-            FMT_PRINT("SendMulti:\n");
             for(auto &b : bufs)
-            {
-                FMT_PRINT("{}\n", std::span<const uint8_t>(b.write_buffer, b.buffer_size));
-            }
-            FMT_PRINT("SendMulti End\n");
+                PH_TRACE(trace::Kind::I2CTx, m_Config.device_address, b.write_buffer, b.buffer_size);
         }
 #endif
+        size_t total = 0;
+        for(auto &b : bufs)
+            total += b.buffer_size;
+        Transaction t{*this, total, 0};
         thread::LockGuard busLock{m_Bus.m_pLock};
-        CALL_ESP_EXPECTED("I2CDevice::SendMulti", i2c_master_multi_buffer_transmit(m_Handle, bufs.data(), bufs.size(), d.count()));
+        CALL_ESP_EXPECTED("I2CDevice::SendMulti", run([&]{ return i2c_master_multi_buffer_transmit(m_Handle, bufs.data(), bufs.size(), d.count()); }));
         return std::ref(*this);
     }
 
@@ -216,12 +396,13 @@ namespace i2c
         if (!m_Handle) return std::unexpected(Err{"I2CDevice::Recv", ESP_ERR_INVALID_STATE});
 
         {
+            Transaction t{*this, 0, len};
             thread::LockGuard busLock{m_Bus.m_pLock};
-            CALL_ESP_EXPECTED("I2CDevice::Recv", i2c_master_receive(m_Handle, pBuf, len, d.count()));
+            CALL_ESP_EXPECTED("I2CDevice::Recv", run([&]{ return i2c_master_receive(m_Handle, pBuf, len, d.count()); }));
         }
 #ifndef NDEBUG
         if (m_Dbg.print_recv)
-            FMT_PRINT("Recv: {}\n", std::span<uint8_t>(pBuf, len));
+            PH_TRACE(trace::Kind::I2CRx, m_Config.device_address, pBuf, len);
 #endif
         return std::ref(*this);
     }
@@ -232,23 +413,85 @@ namespace i2c
 
 #ifndef NDEBUG
         if (m_Dbg.print_send)
-            FMT_PRINT("Send: {}\n", std::span<const uint8_t>(pSendBuf, sendLen));
+            PH_TRACE(trace::Kind::I2CTx, m_Config.device_address, pSendBuf, sendLen);
 #endif
         {
+            Transaction t{*this, sendLen, recvLen};
             thread::LockGuard busLock{m_Bus.m_pLock};
-            CALL_ESP_EXPECTED("I2CDevice::SendRecv", i2c_master_transmit_receive(m_Handle, pSendBuf, sendLen, pRecvBuf, recvLen, d.count()));
+            CALL_ESP_EXPECTED("I2CDevice::SendRecv", run([&]{ return i2c_master_transmit_receive(m_Handle, pSendBuf, sendLen, pRecvBuf, recvLen, d.count()); }));
         }
 #ifndef NDEBUG
         if (m_Dbg.print_recv)
-            FMT_PRINT("Recv: {}\n", std::span<uint8_t>(pRecvBuf, recvLen));
+            PH_TRACE(trace::Kind::I2CRx, m_Config.device_address, pRecvBuf, recvLen);
+#endif
+        return std::ref(*this);
+    }
+
+    I2CDevice::ExpectedResult I2CDevice::SendAsync(const uint8_t *pBuf, std::size_t len, Transfer &t)
+    {
+#ifndef NDEBUG
+        if (m_Dbg.print_send)
+            PH_TRACE(trace::Kind::I2CTx, m_Config.device_address, pBuf, len);
+#endif
+        thread::LockGuard busLock{m_Bus.m_pLock};
+        CALL_ESP_EXPECTED("I2CDevice::SendAsync", submit(t, [&]{ return i2c_master_transmit(m_Handle, pBuf, len, -1); }, true, len, 0));
+        return std::ref(*this);
+    }
+
+    I2CDevice::ExpectedResult I2CDevice::RecvAsync(uint8_t *pBuf, std::size_t len, Transfer &t)
+    {
+        thread::LockGuard busLock{m_Bus.m_pLock};
+        CALL_ESP_EXPECTED("I2CDevice::RecvAsync", submit(t, [&]{ return i2c_master_receive(m_Handle, pBuf, len, -1); }, true, 0, len));
+        return std::ref(*this);
+    }
+
+    I2CDevice::ExpectedResult I2CDevice::SendRecvAsync(const uint8_t *pSendBuf, std::size_t sendLen, uint8_t *pRecvBuf, std::size_t recvLen, Transfer &t)
+    {
+#ifndef NDEBUG
+        if (m_Dbg.print_send)
+            PH_TRACE(trace::Kind::I2CTx, m_Config.device_address, pSendBuf, sendLen);
 #endif
+        thread::LockGuard busLock{m_Bus.m_pLock};
+        CALL_ESP_EXPECTED("I2CDevice::SendRecvAsync", submit(t, [&]{ return i2c_master_transmit_receive(m_Handle, pSendBuf, sendLen, pRecvBuf, recvLen, -1); }, true, sendLen, recvLen));
+        return std::ref(*this);
+    }
+
+    I2CDevice::ExpectedResult I2CDevice::ReadRegsAsync(uint8_t reg, std::span<uint8_t> dst, Transfer &t)
+    {
+        if (m_Burst != BurstMode::AutoIncrement && dst.size() > 1)
+            return std::unexpected(Err{"I2CDevice::ReadRegsAsync", ESP_ERR_NOT_SUPPORTED});
+
+        thread::LockGuard busLock{m_Bus.m_pLock};
+        CALL_ESP_EXPECTED("I2CDevice::ReadRegsAsync", submit(t, [&]{
+            //the register address lives in t, the caller's stack frame may be gone by the time it's sent
+            t.m_Reg = uint8_t(reg | (dst.size() > 1 ? m_BurstFlag : 0));
+            return i2c_master_transmit_receive(m_Handle, &t.m_Reg, 1, dst.data(), dst.size(), -1);
+        }, true, 1, dst.size()));
+        return std::ref(*this);
+    }
+
+    I2CDevice::ExpectedResult I2CDevice::WriteRegsAsync(uint8_t reg, std::span<const uint8_t> src, Transfer &t)
+    {
+        if (m_Burst != BurstMode::AutoIncrement && src.size() > 1)
+            return std::unexpected(Err{"I2CDevice::WriteRegsAsync", ESP_ERR_NOT_SUPPORTED});
+
+        thread::LockGuard busLock{m_Bus.m_pLock};
+        CALL_ESP_EXPECTED("I2CDevice::WriteRegsAsync", submit(t, [&]{
+            t.m_Reg = uint8_t(reg | (src.size() > 1 ? m_BurstFlag : 0));
+            t.m_Bufs[0] = {&t.m_Reg, 1};
+            t.m_Bufs[1] = {(uint8_t*)src.data(), src.size()};
+            return i2c_master_multi_buffer_transmit(m_Handle, t.m_Bufs, 2, -1);
+        }, true, 1 + src.size(), 0));
         return std::ref(*this);
     }
 
     I2CDevice::ExpectedResult I2CDevice::WriteReg8(uint8_t reg, uint8_t data, duration_t d )
     {
         uint8_t _d[] = {reg, data};
-        return Send(_d, sizeof(_d), d);
+        auto r = Send(_d, sizeof(_d), d);
+        if (r && m_pRegCache)
+            m_pRegCache->OnRegWrite(reg, {_d + 1, 1});
+        return r;
     }
 
     I2CDevice::ExpectedResult I2CDevice::WriteReg16(uint8_t reg, uint16_t data, duration_t d )
@@ -256,7 +499,10 @@ namespace i2c
         uint8_t _d[] = {reg, uint8_t(data >> 8), uint8_t(data & 0xff)};
         //printf("WriteReg16: %X %X %X; Size=%d\n", _d[0], _d[1], _d[2], sizeof(_d));
         //fflush(stdout);
-        return Send(_d, sizeof(_d), d);
+        auto r = Send(_d, sizeof(_d), d);
+        if (r && m_pRegCache)
+            m_pRegCache->OnRegWrite(reg, {_d + 1, 2});
+        return r;
     }
 
     I2CDevice::ExpectedValue<uint8_t> I2CDevice::ReadReg8(uint8_t reg, duration_t d )
@@ -288,6 +534,104 @@ namespace i2c
             {&reg, 1},
             {(uint8_t*)src.data(), src.size()}
         };
+        auto r = SendMulti(bufs, d);
+        if (r && m_pRegCache)
+            m_pRegCache->OnRegWrite(uint8_t(reg & ~m_BurstFlag), src);//bursts from WriteRegs carry the increment flag
+        return r;
+    }
+
+    I2CDevice::ExpectedResult I2CDevice::ReadRegs(uint8_t reg, std::span<uint8_t> dst, duration_t d)
+    {
+        if (m_Burst == BurstMode::AutoIncrement || dst.size() <= 1)
+            return ReadRegMulti(reg | (dst.size() > 1 ? m_BurstFlag : 0), dst, d);
+
+        for(size_t i = 0; i < dst.size(); ++i)
+        {
+            if (auto r = ReadReg8(uint8_t(reg + i), d); !r)
+                return std::unexpected(r.error());
+            else
+                dst[i] = r->v;
+        }
+        return std::ref(*this);
+    }
+
+    I2CDevice::ExpectedResult I2CDevice::WriteRegs(uint8_t reg, std::span<const uint8_t> src, duration_t d)
+    {
+        if (m_Burst == BurstMode::AutoIncrement || src.size() <= 1)
+            return WriteRegMulti(reg | (src.size() > 1 ? m_BurstFlag : 0), src, d);
+
+        for(size_t i = 0; i < src.size(); ++i)
+        {
+            if (auto r = WriteReg8(uint8_t(reg + i), src[i], d); !r)
+                return r;
+        }
+        return std::ref(*this);
+    }
+
+    I2CDevice::ExpectedResult I2CDevice::ReadRegMulti16(uint16_t reg, std::span<uint8_t> dst, duration_t d)
+    {
+        uint8_t addr[] = {uint8_t(reg >> 8), uint8_t(reg & 0xff)};
+        return SendRecv(addr, sizeof(addr), dst.data(), dst.size(), d);
+    }
+
+    I2CDevice::ExpectedResult I2CDevice::WriteRegMulti16(uint16_t reg, std::span<const uint8_t> src, duration_t d)
+    {
+        uint8_t addr[] = {uint8_t(reg >> 8), uint8_t(reg & 0xff)};
+        i2c_master_transmit_multi_buffer_info_t bufs[] = {
+            {addr, sizeof(addr)},
+            {(uint8_t*)src.data(), src.size()}
+        };
         return SendMulti(bufs, d);
     }
+
+    I2CDevice::ExpectedResult I2CDevice::ReadRegs16(uint16_t reg, std::span<uint8_t> dst, duration_t d)
+    {
+        if (m_Burst == BurstMode::AutoIncrement)
+            return ReadRegMulti16(reg, dst, d);
+
+        for(size_t i = 0; i < dst.size(); ++i)
+        {
+            if (auto r = ReadRegMulti16(uint16_t(reg + i), dst.subspan(i, 1), d); !r)
+                return r;
+        }
+        return std::ref(*this);
+    }
+
+    I2CDevice::ExpectedResult I2CDevice::WriteRegs16(uint16_t reg, std::span<const uint8_t> src, duration_t d)
+    {
+        if (m_Burst == BurstMode::AutoIncrement)
+            return WriteRegMulti16(reg, src, d);
+
+        for(size_t i = 0; i < src.size(); ++i)
+        {
+            if (auto r = WriteRegMulti16(uint16_t(reg + i), src.subspan(i, 1), d); !r)
+                return r;
+        }
+        return std::ref(*this);
+    }
+
+    void I2CDevice::Stats::reset()
+    {
+        transactions = 0;
+        tx_bytes = 0;
+        rx_bytes = 0;
+        bus_us = 0;
+    }
+
+    I2CDevice::Transaction::Transaction(I2CDevice &d, size_t tx, size_t rx):
+        m_Dev(d),
+        m_Tx(tx),
+        m_Rx(rx),
+        m_StartUs(esp_timer_get_time())
+    {
+    }
+
+    I2CDevice::Transaction::~Transaction()
+    {
+        auto &s = m_Dev.m_Stats;
+        s.transactions.fetch_add(1, std::memory_order_relaxed);
+        s.tx_bytes.fetch_add(m_Tx, std::memory_order_relaxed);
+        s.rx_bytes.fetch_add(m_Rx, std::memory_order_relaxed);
+        s.bus_us.fetch_add(uint32_t(esp_timer_get_time() - m_StartUs), std::memory_order_relaxed);
+    }
 }
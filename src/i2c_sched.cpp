@@ -0,0 +1,244 @@
+#include "ph_i2c_sched.hpp"
+#include <utility>
+#include "esp_timer.h"
+#include "freertos/semphr.h"
+
+namespace i2c
+{
+    BusScheduler::BusScheduler(I2CBusMaster &bus):
+        BusScheduler(bus, Config{})
+    {
+    }
+
+    BusScheduler::BusScheduler(I2CBusMaster &bus, Config cfg):
+        m_Bus(bus),
+        m_Config(cfg)
+    {
+    }
+
+    BusScheduler::~BusScheduler()
+    {
+        Stop();
+        if (m_Lock) vSemaphoreDelete(m_Lock);
+        if (m_Stopped) vSemaphoreDelete(m_Stopped);
+    }
+
+    BusScheduler::ExpectedResult BusScheduler::Start()
+    {
+        if (m_Task)
+            return std::unexpected(Err{"i2c::BusScheduler::Start", ESP_ERR_INVALID_STATE});
+        if (!m_Lock && !(m_Lock = xSemaphoreCreateMutex()))
+            return std::unexpected(Err{"i2c::BusScheduler::Start lock", ESP_ERR_NO_MEM});
+        if (!m_Stopped && !(m_Stopped = xSemaphoreCreateBinary()))
+            return std::unexpected(Err{"i2c::BusScheduler::Start stopped", ESP_ERR_NO_MEM});
+
+        m_Stop = false;
+        m_pLastDev = nullptr;
+        m_BatchLen = 0;
+        if (xTaskCreate(task_loop, "i2c::sched", m_Config.stackSize, this, m_Config.prio, &m_Task) != pdPASS)
+        {
+            m_Task = nullptr;
+            return std::unexpected(Err{"i2c::BusScheduler::Start task", ESP_ERR_NO_MEM});
+        }
+        return std::ref(*this);
+    }
+
+    BusScheduler::ExpectedResult BusScheduler::Stop()
+    {
+        if (!m_Task)
+            return std::ref(*this);
+
+        xSemaphoreTake(m_Stopped, 0);
+        //under the lock: nothing gets queued past the final sweep below
+        xSemaphoreTake(m_Lock, portMAX_DELAY);
+        m_Stop = true;
+        xSemaphoreGive(m_Lock);
+        xTaskNotifyGive(m_Task);
+        xSemaphoreTake(m_Stopped, portMAX_DELAY);
+        m_Task = nullptr;
+
+        Entry left[kMaxJobs];
+        size_t n = 0;
+        xSemaphoreTake(m_Lock, portMAX_DELAY);
+        for(auto &e : m_Jobs)
+        {
+            if (e.used)
+            {
+                left[n++] = std::move(e);
+                e = {};
+            }
+        }
+        m_Stats.depth = 0;
+        xSemaphoreGive(m_Lock);
+
+        //outside the lock: a callback may submit again (and get ESP_ERR_INVALID_STATE)
+        for(size_t i = 0; i < n; ++i)
+            finish(left[i], ESP_ERR_INVALID_STATE);
+        return std::ref(*this);
+    }
+
+    esp_err_t BusScheduler::Run(I2CDevice &d, Request r, Job job)
+    {
+        //a job running another one: it has the bus already
+        if (m_Task && xTaskGetCurrentTaskHandle() == m_Task)
+            return job(d);
+
+        StaticSemaphore_t semBuf;
+        SemaphoreHandle_t sem = xSemaphoreCreateBinaryStatic(&semBuf);
+        esp_err_t result = ESP_FAIL;
+        esp_err_t e = queue(d, r, std::move(job), {}, sem, &result);
+        if (e == ESP_OK)
+            xSemaphoreTake(sem, portMAX_DELAY);
+        vSemaphoreDelete(sem);
+        return e == ESP_OK ? result : e;
+    }
+
+    BusScheduler::ExpectedResult BusScheduler::Submit(I2CDevice &d, Request r, Job job, DoneCallback done)
+    {
+        CALL_ESP_EXPECTED("i2c::BusScheduler::Submit", queue(d, r, std::move(job), std::move(done), nullptr, nullptr));
+        return std::ref(*this);
+    }
+
+    esp_err_t BusScheduler::queue(I2CDevice &d, Request r, Job &&job, DoneCallback &&done, SemaphoreHandle_t waiter, esp_err_t *pResult)
+    {
+        if (!m_Task)
+            return ESP_ERR_INVALID_STATE;
+
+        int64_t now = esp_timer_get_time();
+        xSemaphoreTake(m_Lock, portMAX_DELAY);
+        if (m_Stop)
+        {
+            xSemaphoreGive(m_Lock);
+            return ESP_ERR_INVALID_STATE;
+        }
+        Entry *pE = nullptr;
+        for(auto &e : m_Jobs)
+        {
+            if (!e.used)
+            {
+                pE = &e;
+                break;
+            }
+        }
+        if (!pE)
+        {
+            xSemaphoreGive(m_Lock);
+            m_Stats.rejected.fetch_add(1, std::memory_order_relaxed);
+            return ESP_ERR_NO_MEM;
+        }
+        pE->pDev = &d;
+        pE->job = std::move(job);
+        pE->done = std::move(done);
+        pE->waiter = waiter;
+        pE->pResult = pResult;
+        pE->submittedUs = now;
+        pE->deadlineUs = r.deadline == kForever ? INT64_MAX : now + int64_t(r.deadline.count()) * 1000;
+        pE->seq = m_Seq++;
+        pE->prio = r.prio;
+        pE->used = true;
+        uint32_t depth = m_Stats.depth.fetch_add(1, std::memory_order_relaxed) + 1;
+        if (depth > m_Stats.max_depth.load(std::memory_order_relaxed))
+            m_Stats.max_depth.store(depth, std::memory_order_relaxed);
+        xSemaphoreGive(m_Lock);
+
+        xTaskNotifyGive(m_Task);
+        return ESP_OK;
+    }
+
+    bool BusScheduler::before(const Entry &a, const Entry &b, int64_t now) const
+    {
+        if (m_Config.policy == Policy::EDF)
+        {
+            if (a.deadlineUs != b.deadlineUs)
+                return a.deadlineUs < b.deadlineUs;
+            if (a.prio != b.prio)
+                return a.prio > b.prio;
+        }
+        else
+        {
+            int64_t agingUs = int64_t(m_Config.agingMs) * 1000;
+            auto eff = [&](const Entry &e){ return int64_t(e.prio) + (agingUs ? (now - e.submittedUs) / agingUs : 0); };
+            if (int64_t ea = eff(a), eb = eff(b); ea != eb)
+                return ea > eb;
+        }
+
+        //equal rank: the device just served while the batch lasts, then first come first served
+        bool batching = m_pLastDev && m_BatchLen < m_Config.batch;
+        bool aSame = batching && a.pDev == m_pLastDev;
+        bool bSame = batching && b.pDev == m_pLastDev;
+        if (aSame != bSame)
+            return aSame;
+        return int32_t(a.seq - b.seq) < 0;
+    }
+
+    BusScheduler::Entry* BusScheduler::pick(int64_t now)
+    {
+        Entry *pBest = nullptr;
+        for(auto &e : m_Jobs)
+        {
+            if (e.used && (!pBest || before(e, *pBest, now)))
+                pBest = &e;
+        }
+        return pBest;
+    }
+
+    bool BusScheduler::run_one()
+    {
+        Entry e;
+        int64_t now = esp_timer_get_time();
+        xSemaphoreTake(m_Lock, portMAX_DELAY);
+        Entry *pE = pick(now);
+        if (pE)
+        {
+            e = std::move(*pE);
+            *pE = {};
+            m_Stats.depth.fetch_sub(1, std::memory_order_relaxed);
+            if (e.pDev == m_pLastDev)
+            {
+                ++m_BatchLen;
+                m_Stats.batched.fetch_add(1, std::memory_order_relaxed);
+            }
+            else
+            {
+                m_pLastDev = e.pDev;
+                m_BatchLen = 1;
+            }
+        }
+        xSemaphoreGive(m_Lock);
+        if (!pE)
+            return false;
+
+        uint32_t waitUs = uint32_t(now - e.submittedUs);
+        m_Stats.wait_total_us.fetch_add(waitUs, std::memory_order_relaxed);
+        if (waitUs > m_Stats.wait_max_us.load(std::memory_order_relaxed))
+            m_Stats.wait_max_us.store(waitUs, std::memory_order_relaxed);
+        if (now > e.deadlineUs)
+            m_Stats.late.fetch_add(1, std::memory_order_relaxed);
+        m_Stats.jobs.fetch_add(1, std::memory_order_relaxed);
+
+        finish(e, e.job(*e.pDev));
+        return true;
+    }
+
+    void BusScheduler::finish(Entry &e, esp_err_t err)
+    {
+        if (e.done)
+            e.done(err);
+        if (e.pResult)
+            *e.pResult = err;
+        if (e.waiter)
+            xSemaphoreGive(e.waiter);
+    }
+
+    void BusScheduler::task_loop(void *pArg)
+    {
+        BusScheduler &s = *static_cast<BusScheduler*>(pArg);
+        while(!s.m_Stop)
+        {
+            ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+            while(!s.m_Stop && s.run_one());
+        }
+        xSemaphoreGive(s.m_Stopped);
+        vTaskDelete(nullptr);
+    }
+}
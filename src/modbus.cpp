@@ -0,0 +1,266 @@
+#include "ph_modbus.hpp"
+#include <algorithm>
+#include "esp_timer.h"
+#include "esp_rom_sys.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+namespace modbus
+{
+    namespace
+    {
+        constexpr uint32_t kFastBaudSilenceUs = 1750;//fixed t3.5 above 19200 baud
+        constexpr int64_t kTickUs = portTICK_PERIOD_MS * 1000;
+
+        duration_ms_t us_to_ms_ceil(int64_t us) { return duration_ms_t((us + 999) / 1000); }
+
+        struct SlaveSet
+        {
+            std::array<uint32_t, 8> bits{};
+            void add(uint8_t s) { bits[s / 32] |= 1u << (s % 32); }
+            bool has(uint8_t s) const { return bits[s / 32] & (1u << (s % 32)); }
+        };
+    }
+
+    Master::Master(uart::Channel &c):
+        m_C(c)
+    {
+    }
+
+    Master& Master::SetSlaveTimeout(uint8_t slave, duration_ms_t t)
+    {
+        if (slave < m_SlaveTimeoutMs.size())
+            m_SlaveTimeoutMs[slave] = uint16_t(std::clamp<int64_t>(t.count(), 0, 0xffff));
+        return *this;
+    }
+
+    duration_ms_t Master::GetSlaveTimeout(uint8_t slave) const
+    {
+        if (slave < m_SlaveTimeoutMs.size() && m_SlaveTimeoutMs[slave])
+            return duration_ms_t(m_SlaveTimeoutMs[slave]);
+        return m_DefaultTimeout;
+    }
+
+    uint32_t Master::GetCharTimeUs() const
+    {
+        //in half bits: start + data + parity + stop
+        uint32_t halfBits = 2;
+        halfBits += (5 + uint32_t(m_C.GetDataBits())) * 2;
+        if (m_C.GetParity() != uart::Parity::Disable)
+            halfBits += 2;
+        switch(m_C.GetStopBits())
+        {
+            case uart::StopBits::Bits1_5: halfBits += 3; break;
+            case uart::StopBits::Bits2: halfBits += 4; break;
+            default: halfBits += 2; break;
+        }
+        uint32_t baud = std::max(m_C.GetBaudRate(), 1);
+        return (halfBits * 1'000'000 / 2 + baud - 1) / baud;
+    }
+
+    uint32_t Master::GetFrameSilenceUs() const
+    {
+        if (m_C.GetBaudRate() > 19200)
+            return kFastBaudSilenceUs;
+        return GetCharTimeUs() * 7 / 2;
+    }
+
+    void Master::wait_silence()
+    {
+        int64_t until = m_LineIdleAt + GetFrameSilenceUs();
+        int64_t left = until - esp_timer_get_time();
+        if (left >= kTickUs)
+            vTaskDelay(TickType_t(left / kTickUs));
+        //the rest is shorter than a tick: a tick delay would overshoot by up to a whole tick, busy-wait it instead
+        if (int64_t rest = until - esp_timer_get_time(); rest > 0)
+            esp_rom_delay_us(uint32_t(rest));
+    }
+
+    Master::ExpectedResult Master::send(std::span<const uint8_t> adu)
+    {
+        wait_silence();
+        //whatever came in late since the last exchange must not be taken for the response
+        if (auto r = m_C.Flush(); !r)
+            return std::unexpected(r.error());
+        if (auto r = m_C.Send(adu.data(), adu.size()); !r)
+            return std::unexpected(r.error());
+        m_LineIdleAt = esp_timer_get_time() + int64_t(adu.size()) * GetCharTimeUs();
+        return std::ref(*this);
+    }
+
+    Master::ExpectedValue<ResponseView> Master::receive(const Pdu &req, size_t txLen)
+    {
+        const int64_t charUs = GetCharTimeUs();
+        const int64_t silenceUs = GetFrameSilenceUs();
+
+        //slave address and function code tell how long the frame is going to be
+        auto first = uart::Deadline::after(GetSlaveTimeout(req.slave) + us_to_ms_ceil(int64_t(txLen) * charUs));
+        size_t got = 0;
+        if (auto r = m_C.Read(m_Rx, 2, first); !r)
+            return std::unexpected(r.error());
+        else
+            got = r.value().v;
+        if (!got)
+            return std::unexpected(Err{"modbus::Master no response", ESP_ERR_TIMEOUT});
+
+        if (got < 2)
+        {
+            if (auto r = m_C.Read(m_Rx + got, 1, us_to_ms_ceil(charUs + silenceUs)); !r)
+                return std::unexpected(r.error());
+            else
+                got += r.value().v;
+            if (got < 2)
+                return std::unexpected(Err{"modbus::Master frame incomplete", ESP_ERR_INVALID_SIZE});
+        }
+
+        size_t need = (m_Rx[1] & 0x80) ? kExceptionAdu : response_size(req);
+        if (need > got)
+        {
+            //the rest arrives back to back, a gap of t3.5 ends the frame
+            auto wait = us_to_ms_ceil(int64_t(need - got) * charUs + silenceUs);
+            if (auto r = m_C.Read(m_Rx + got, need - got, wait); !r)
+                return std::unexpected(r.error());
+            else
+                got += r.value().v;
+        }
+        m_LineIdleAt = esp_timer_get_time();
+
+        std::span<const uint8_t> adu(m_Rx, got);
+        if (got < need)
+            return std::unexpected(Err{"modbus::Master frame incomplete", ESP_ERR_INVALID_SIZE});
+        switch(check_response(req, adu))
+        {
+            case Check::Ok: break;
+            case Check::BadCrc: return std::unexpected(Err{"modbus::Master CRC", ESP_ERR_INVALID_CRC});
+            case Check::BadSize: return std::unexpected(Err{"modbus::Master frame size", ESP_ERR_INVALID_SIZE});
+            case Check::Mismatch: return std::unexpected(Err{"modbus::Master unexpected response", ESP_ERR_INVALID_RESPONSE});
+        }
+        return RetVal<ResponseView>{*this, ResponseView(adu)};
+    }
+
+    Master::ExpectedResult Master::store(Request &r, const ResponseView &v)
+    {
+        r.exception = v.empty() ? Exception::None : v.exception();
+        if (r.exception != Exception::None)
+            return std::unexpected(Err{"modbus::Master exception response", ESP_ERR_INVALID_RESPONSE});
+
+        if (!r.read_regs.empty())
+        {
+            size_t n = std::min(r.read_regs.size(), v.reg_count());
+            for(size_t i = 0; i < n; ++i)
+                r.read_regs[i] = v.reg(i);
+        }else if (!r.read_bits.empty())
+        {
+            auto d = v.data();
+            std::copy_n(d.begin(), std::min(r.read_bits.size(), d.size()), r.read_bits.begin());
+        }
+        return std::ref(*this);
+    }
+
+    Master::ExpectedValue<ResponseView> Master::Transact(const Pdu &req)
+    {
+        size_t len = encode_request(req, m_Tx[0]);
+        if (!len)
+            return std::unexpected(Err{"modbus::Master::Transact invalid request", ESP_ERR_INVALID_ARG});
+        if (auto r = send({m_Tx[0], len}); !r)
+            return std::unexpected(r.error());
+
+        if (req.slave == kBroadcast)
+        {
+            vTaskDelay(pdMS_TO_TICKS(m_Turnaround.count()));
+            m_LineIdleAt = esp_timer_get_time();
+            return RetVal<ResponseView>{*this, ResponseView{}};
+        }
+        return receive(req, len);
+    }
+
+    Master::ExpectedValue<size_t> Master::Transact(std::span<Request> batch)
+    {
+        SlaveSet timedOut;
+        auto skip_timed_out = [&](size_t i){
+            for(; i < batch.size() && timedOut.has(batch[i].pdu.slave); ++i)
+            {
+                batch[i].result = ESP_ERR_TIMEOUT;
+                batch[i].exception = Exception::None;
+            }
+            return i;
+        };
+
+        size_t good = 0;
+        int b = 0;
+        size_t cur = skip_timed_out(0);
+        size_t len = cur < batch.size() ? encode_request(batch[cur].pdu, m_Tx[b]) : 0;
+        while(cur < batch.size())
+        {
+            auto &r = batch[cur];
+            r.exception = Exception::None;
+            if (len)
+            {
+                if (auto s = send({m_Tx[b], len}); !s)
+                    return std::unexpected(s.error());
+            }
+
+            //encode the next request while this one is on the wire
+            size_t next = skip_timed_out(cur + 1);
+            size_t nextLen = next < batch.size() ? encode_request(batch[next].pdu, m_Tx[b ^ 1]) : 0;
+
+            if (!len)
+                r.result = ESP_ERR_INVALID_ARG;
+            else if (r.pdu.slave == kBroadcast)
+            {
+                vTaskDelay(pdMS_TO_TICKS(m_Turnaround.count()));
+                m_LineIdleAt = esp_timer_get_time();
+                r.result = ESP_OK;
+            }else if (auto v = receive(r.pdu, len); !v)
+            {
+                r.result = v.error().code;
+                if (r.result == ESP_ERR_TIMEOUT)
+                    timedOut.add(r.pdu.slave);
+            }else if (auto s = store(r, v.value().v); !s)
+                r.result = s.error().code;
+            else
+                r.result = ESP_OK;
+
+            if (r.result == ESP_OK)
+                ++good;
+
+            cur = next;
+            len = nextLen;
+            b ^= 1;
+            if (cur < batch.size() && timedOut.has(batch[cur].pdu.slave))
+            {
+                //the slave has just timed out, the encoded request is void
+                cur = skip_timed_out(cur);
+                len = cur < batch.size() ? encode_request(batch[cur].pdu, m_Tx[b]) : 0;
+            }
+        }
+        return RetVal<size_t>{*this, good};
+    }
+
+    Master::ExpectedResult Master::ReadRegisters(uint8_t slave, uint16_t addr, std::span<uint16_t> dst, bool input)
+    {
+        Request r{.pdu = {.slave = slave, .fn = input ? Function::ReadInputRegisters : Function::ReadHoldingRegisters, .addr = addr, .count = uint16_t(dst.size())}, .read_regs = dst};
+        if (auto v = Transact(r.pdu); !v)
+            return std::unexpected(v.error());
+        else
+            return store(r, v.value().v);
+    }
+
+    Master::ExpectedResult Master::WriteRegister(uint8_t slave, uint16_t addr, uint16_t v)
+    {
+        Request r{.pdu = {.slave = slave, .fn = Function::WriteSingleRegister, .addr = addr, .regs = {&v, 1}}};
+        if (auto res = Transact(r.pdu); !res)
+            return std::unexpected(res.error());
+        else
+            return store(r, res.value().v);
+    }
+
+    Master::ExpectedResult Master::WriteRegisters(uint8_t slave, uint16_t addr, std::span<const uint16_t> src)
+    {
+        Request r{.pdu = {.slave = slave, .fn = Function::WriteMultipleRegisters, .addr = addr, .count = uint16_t(src.size()), .regs = src}};
+        if (auto res = Transact(r.pdu); !res)
+            return std::unexpected(res.error());
+        else
+            return store(r, res.value().v);
+    }
+}
@@ -0,0 +1,249 @@
+#include "ph_modbus_frame.hpp"
+#include <cstring>
+
+namespace modbus
+{
+    namespace
+    {
+        bool is_read(Function fn)
+        {
+            return fn == Function::ReadCoils || fn == Function::ReadDiscreteInputs
+                || fn == Function::ReadHoldingRegisters || fn == Function::ReadInputRegisters;
+        }
+
+        bool is_bit_fn(Function fn)
+        {
+            return fn == Function::ReadCoils || fn == Function::ReadDiscreteInputs || fn == Function::WriteMultipleCoils;
+        }
+
+        bool get_bit(std::span<const uint8_t> bits, size_t i) { return (bits[i / 8] >> (i % 8)) & 1; }
+        void set_bit(std::span<uint8_t> bits, size_t i, bool v)
+        {
+            if (v) bits[i / 8] |= uint8_t(1 << (i % 8));
+            else bits[i / 8] &= uint8_t(~(1 << (i % 8)));
+        }
+
+        size_t append_crc(std::span<uint8_t> out, size_t len)
+        {
+            uint16_t crc = crc16(out.first(len));
+            out[len] = uint8_t(crc & 0xff);
+            out[len + 1] = uint8_t(crc >> 8);
+            return len + 2;
+        }
+
+        bool crc_ok(std::span<const uint8_t> adu)
+        {
+            size_t n = adu.size();
+            return crc16(adu.first(n - 2)) == uint16_t(adu[n - 2] | (adu[n - 1] << 8));
+        }
+
+        uint16_t single_write_value(const Pdu &req)
+        {
+            if (req.fn == Function::WriteSingleCoil)
+                return (req.bits[0] & 1) ? 0xff00 : 0x0000;
+            return req.regs[0];
+        }
+    }
+
+    size_t encode_request(const Pdu &req, std::span<uint8_t> out)
+    {
+        if (req.slave == kBroadcast && is_read(req.fn))
+            return 0;
+        if (out.size() < 8)
+            return 0;
+
+        uint8_t *p = out.data();
+        p[0] = req.slave;
+        p[1] = uint8_t(req.fn);
+        put_be16(p + 2, req.addr);
+        switch(req.fn)
+        {
+            case Function::ReadCoils:
+            case Function::ReadDiscreteInputs:
+                if (!req.count || req.count > kMaxReadBits)
+                    return 0;
+                put_be16(p + 4, req.count);
+                return append_crc(out, 6);
+            case Function::ReadHoldingRegisters:
+            case Function::ReadInputRegisters:
+                if (!req.count || req.count > kMaxReadRegs)
+                    return 0;
+                put_be16(p + 4, req.count);
+                return append_crc(out, 6);
+            case Function::WriteSingleCoil:
+                if (req.bits.empty())
+                    return 0;
+                put_be16(p + 4, single_write_value(req));
+                return append_crc(out, 6);
+            case Function::WriteSingleRegister:
+                if (req.regs.empty())
+                    return 0;
+                put_be16(p + 4, single_write_value(req));
+                return append_crc(out, 6);
+            case Function::WriteMultipleCoils:
+            {
+                size_t bytes = (req.count + 7) / 8;
+                if (!req.count || req.count > kMaxWriteBits || req.bits.size() < bytes || out.size() < 9 + bytes)
+                    return 0;
+                put_be16(p + 4, req.count);
+                p[6] = uint8_t(bytes);
+                std::memcpy(p + 7, req.bits.data(), bytes);
+                //unused high bits of the last byte go out as zeros
+                if (req.count % 8)
+                    p[6 + bytes] &= uint8_t((1 << (req.count % 8)) - 1);
+                return append_crc(out, 7 + bytes);
+            }
+            case Function::WriteMultipleRegisters:
+            {
+                size_t bytes = req.count * 2;
+                if (!req.count || req.count > kMaxWriteRegs || req.regs.size() < req.count || out.size() < 9 + bytes)
+                    return 0;
+                put_be16(p + 4, req.count);
+                p[6] = uint8_t(bytes);
+                for(size_t i = 0; i < req.count; ++i)
+                    put_be16(p + 7 + i * 2, req.regs[i]);
+                return append_crc(out, 7 + bytes);
+            }
+        }
+        return 0;
+    }
+
+    size_t response_size(const Pdu &req)
+    {
+        if (req.slave == kBroadcast)
+            return 0;
+        if (!is_read(req.fn))
+            return 8;
+        size_t bytes = is_bit_fn(req.fn) ? (req.count + 7) / 8 : req.count * 2;
+        return 3 + bytes + 2;
+    }
+
+    std::span<const uint8_t> ResponseView::data() const
+    {
+        if (m_Adu.size() < 5 || exception() != Exception::None || !is_read(fn()))
+            return {};
+        return m_Adu.subspan(3, m_Adu[2]);
+    }
+
+    Check check_response(const Pdu &req, std::span<const uint8_t> adu)
+    {
+        if (adu.size() < kExceptionAdu)
+            return Check::BadSize;
+        if (!crc_ok(adu))
+            return Check::BadCrc;
+        if (adu[0] != req.slave || (adu[1] & 0x7f) != uint8_t(req.fn))
+            return Check::Mismatch;
+        if (adu[1] & 0x80)
+            return adu.size() == kExceptionAdu ? Check::Ok : Check::BadSize;
+        if (adu.size() != response_size(req))
+            return Check::BadSize;
+
+        if (is_read(req.fn))
+            return adu[2] == adu.size() - 5 ? Check::Ok : Check::BadSize;
+
+        if (get_be16(adu.data() + 2) != req.addr)
+            return Check::Mismatch;
+        uint16_t echo = get_be16(adu.data() + 4);
+        if (req.fn == Function::WriteSingleCoil || req.fn == Function::WriteSingleRegister)
+            return echo == single_write_value(req) ? Check::Ok : Check::Mismatch;
+        return echo == req.count ? Check::Ok : Check::Mismatch;
+    }
+
+    size_t SlaveModel::finish(std::span<uint8_t> out, size_t len)
+    {
+        return append_crc(out, len);
+    }
+
+    size_t SlaveModel::exception(Function fn, Exception e, std::span<uint8_t> out)
+    {
+        out[0] = m_Addr;
+        out[1] = uint8_t(fn) | 0x80;
+        out[2] = uint8_t(e);
+        return finish(out, 3);
+    }
+
+    size_t SlaveModel::Handle(std::span<const uint8_t> req, std::span<uint8_t> out)
+    {
+        if (req.size() < 8 || out.size() < kMaxAdu || !crc_ok(req))
+            return 0;
+        const bool broadcast = req[0] == kBroadcast;
+        if (!broadcast && req[0] != m_Addr)
+            return 0;
+
+        auto fn = Function(req[1]);
+        uint16_t addr = get_be16(req.data() + 2);
+        uint16_t val = get_be16(req.data() + 4);
+        auto reply = [&](size_t len) -> size_t { return broadcast ? 0 : len; };
+        auto fail = [&](Exception e) -> size_t { return broadcast ? 0 : exception(fn, e, out); };
+        if (broadcast && is_read(fn))
+            return 0;
+
+        out[0] = m_Addr;
+        out[1] = req[1];
+        switch(fn)
+        {
+            case Function::ReadCoils:
+            case Function::ReadDiscreteInputs:
+            {
+                auto src = fn == Function::ReadCoils ? m_S.coils : m_S.discrete;
+                if (!val || val > kMaxReadBits)
+                    return fail(Exception::IllegalDataValue);
+                if (size_t(addr) + val > src.size() * 8)
+                    return fail(Exception::IllegalDataAddress);
+                size_t bytes = (val + 7) / 8;
+                out[2] = uint8_t(bytes);
+                std::memset(out.data() + 3, 0, bytes);
+                for(size_t i = 0; i < val; ++i)
+                    set_bit(out.subspan(3, bytes), i, get_bit(src, addr + i));
+                return finish(out, 3 + bytes);
+            }
+            case Function::ReadHoldingRegisters:
+            case Function::ReadInputRegisters:
+            {
+                auto src = fn == Function::ReadHoldingRegisters ? m_S.holding : m_S.input;
+                if (!val || val > kMaxReadRegs)
+                    return fail(Exception::IllegalDataValue);
+                if (size_t(addr) + val > src.size())
+                    return fail(Exception::IllegalDataAddress);
+                out[2] = uint8_t(val * 2);
+                for(size_t i = 0; i < val; ++i)
+                    put_be16(out.data() + 3 + i * 2, src[addr + i]);
+                return finish(out, 3 + val * 2);
+            }
+            case Function::WriteSingleCoil:
+                if (val != 0xff00 && val != 0)
+                    return fail(Exception::IllegalDataValue);
+                if (addr >= m_S.coils.size() * 8)
+                    return fail(Exception::IllegalDataAddress);
+                set_bit(m_S.coils, addr, val != 0);
+                std::memcpy(out.data(), req.data(), 6);
+                return reply(finish(out, 6));
+            case Function::WriteSingleRegister:
+                if (addr >= m_S.holding.size())
+                    return fail(Exception::IllegalDataAddress);
+                m_S.holding[addr] = val;
+                std::memcpy(out.data(), req.data(), 6);
+                return reply(finish(out, 6));
+            case Function::WriteMultipleCoils:
+            case Function::WriteMultipleRegisters:
+            {
+                const bool coils = fn == Function::WriteMultipleCoils;
+                size_t bytes = coils ? (val + 7) / 8 : val * 2;
+                if (!val || val > (coils ? kMaxWriteBits : kMaxWriteRegs) || req.size() < 9 + bytes || req[6] != bytes)
+                    return fail(Exception::IllegalDataValue);
+                if (size_t(addr) + val > (coils ? m_S.coils.size() * 8 : m_S.holding.size()))
+                    return fail(Exception::IllegalDataAddress);
+                for(size_t i = 0; i < val; ++i)
+                {
+                    if (coils)
+                        set_bit(m_S.coils, addr + i, get_bit(req.subspan(7, bytes), i));
+                    else
+                        m_S.holding[addr + i] = get_be16(req.data() + 7 + i * 2);
+                }
+                std::memcpy(out.data(), req.data(), 6);
+                return reply(finish(out, 6));
+            }
+        }
+        return fail(Exception::IllegalFunction);
+    }
+}
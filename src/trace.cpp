@@ -0,0 +1,125 @@
+#include "ph_trace.hpp"
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <cstdio>
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+namespace trace
+{
+    namespace
+    {
+        constexpr uint32_t kMask = PH_TRACE_RECORDS - 1;
+
+        Record g_Records[PH_TRACE_RECORDS];
+        std::atomic<uint32_t> g_Seq{0};
+
+        const char* kind_name(Kind k)
+        {
+            switch(k)
+            {
+                case Kind::UartTx: return "uart>";
+                case Kind::UartRx: return "uart<";
+                case Kind::I2CTx: return "i2c>";
+                case Kind::I2CRx: return "i2c<";
+            }
+            return "?";
+        }
+    }
+
+    void record(Kind k, uint16_t id, std::span<const uint8_t> data)
+    {
+        uint32_t seq = g_Seq.fetch_add(1, std::memory_order_relaxed) + 1;
+        Record &r = g_Records[(seq - 1) & kMask];
+        std::atomic_ref<uint32_t> slotSeq(r.seq);
+
+        //invalidate first so that a reader never takes a half written record for a complete one
+        slotSeq.store(0, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+
+        r.ts_us = uint32_t(esp_timer_get_time());
+        r.id = id;
+        r.total = uint16_t(std::min<size_t>(data.size(), 0xffff));
+        r.kind = k;
+        r.len = uint8_t(std::min<size_t>(data.size(), PH_TRACE_PAYLOAD));
+        std::memcpy(r.payload, data.data(), r.len);
+
+        slotSeq.store(seq, std::memory_order_release);
+    }
+
+    bool Reader::next(Record &r)
+    {
+        while(true)
+        {
+            uint32_t head = g_Seq.load(std::memory_order_acquire);
+            if (int32_t(head - m_Next) < 0)
+                return false;
+
+            if (head - m_Next >= PH_TRACE_RECORDS)
+            {
+                uint32_t oldest = head - PH_TRACE_RECORDS + 1;
+                m_Lost += oldest - m_Next;
+                m_Next = oldest;
+            }
+
+            Record &slot = g_Records[(m_Next - 1) & kMask];
+            std::atomic_ref<uint32_t> slotSeq(slot.seq);
+            uint32_t s = slotSeq.load(std::memory_order_acquire);
+            if (s == m_Next)
+            {
+                std::memcpy(&r, &slot, sizeof(Record));
+                std::atomic_thread_fence(std::memory_order_acquire);
+                if (slotSeq.load(std::memory_order_relaxed) == s)
+                {
+                    r.seq = s;
+                    ++m_Next;
+                    return true;
+                }
+                //overwritten while copying
+            }else if (!s || int32_t(s - m_Next) < 0)
+                return false;//still being written
+
+            ++m_Lost;
+            ++m_Next;
+        }
+    }
+
+    size_t format(const Record &r, char *pBuf, size_t len)
+    {
+        int n = snprintf(pBuf, len, "%lu %s %X [%u]:", (unsigned long)r.ts_us, kind_name(r.kind), r.id, r.total);
+        size_t used = n < 0 ? 0 : std::min(size_t(n), len ? len - 1 : 0);
+        for(uint8_t i = 0; i < r.len && (used + 3) < len; ++i)
+            used += snprintf(pBuf + used, len - used, " %02X", r.payload[i]);
+        if (r.total > r.len && (used + 4) < len)
+            used += snprintf(pBuf + used, len - used, " ...");
+        return used;
+    }
+
+    void start_printer(uint32_t period_ms, int prio)
+    {
+        auto printer = +[](void *pArg){
+            const TickType_t period = pdMS_TO_TICKS(uintptr_t(pArg));
+            Reader rd;
+            Record r;
+            uint32_t reportedLost = 0;
+            char line[48 + PH_TRACE_PAYLOAD * 3];
+            while(true)
+            {
+                while(rd.next(r))
+                {
+                    format(r, line, sizeof(line));
+                    printf("%s\n", line);
+                }
+                if (rd.lost() != reportedLost)
+                {
+                    printf("trace: %lu records lost\n", (unsigned long)(rd.lost() - reportedLost));
+                    reportedLost = rd.lost();
+                }
+                vTaskDelay(period ? period : 1);
+            }
+        };
+        xTaskCreate(printer, "trace::printer", 3072, (void*)uintptr_t(period_ms), prio, nullptr);
+    }
+}
@@ -1,23 +1,23 @@
 #include "ph_uart.hpp"
-
-#define DBG_SEND {\
-if (!m_DbgPrintSend) \
-{\
-    m_DbgPrintSend = true;\
-    printf("\nout: ");\
-}\
-}
-
-#define DBG_READ {\
-if (m_DbgPrintSend) \
-{\
-    m_DbgPrintSend = false;\
-    printf("\nin: ");\
-}\
-}
+#include "ph_trace.hpp"
+#include "ph_uart_capture.hpp"
+#include <cstring>
+#include <new>
+#include <utility>
+#include "esp_timer.h"
+#include "esp_heap_caps.h"
 
 namespace uart
 {
+    namespace
+    {
+        void atomic_max(std::atomic<uint32_t> &a, uint32_t v)
+        {
+            uint32_t cur = a.load(std::memory_order_relaxed);
+            while(cur < v && !a.compare_exchange_weak(cur, v, std::memory_order_relaxed));
+        }
+    }
+
     Channel::Channel(Port p, int baud_rate, Parity parity):
         m_Port(uart_port_t(p)),
         m_Config{
@@ -36,6 +36,21 @@ namespace uart
     Channel::~Channel()
     {
         Close();
+        if (m_StageTimer)
+        {
+            esp_timer_stop(m_StageTimer);
+            esp_timer_delete(m_StageTimer);
+        }
+        if (m_StageLock)
+            vSemaphoreDelete(m_StageLock);
+        if (m_EventsStopped)
+            vSemaphoreDelete(m_EventsStopped);
+        if (m_CallbackLock)
+            vSemaphoreDelete(m_CallbackLock);
+        if (m_RxLock)
+            vSemaphoreDelete(m_RxLock);
+        if (m_TxLock)
+            vSemaphoreDelete(m_TxLock);
     }
 
     Channel& Channel::SetPort(Port p)
@@ -137,6 +152,28 @@ namespace uart
         return m_QueueSize;
     }
 
+    Channel& Channel::SetEventTaskStackSize(uint32_t sz)
+    {
+        m_EventStackSize = sz;
+        return *this;
+    }
+
+    uint32_t Channel::GetEventTaskStackSize() const
+    {
+        return m_EventStackSize;
+    }
+
+    Channel& Channel::SetRxWindowSize(size_t sz)
+    {
+        m_RxWindowSize = std::max(sz, size_t(1));
+        return *this;
+    }
+
+    size_t Channel::GetRxWindowSize() const
+    {
+        return m_RxWindowSize;
+    }
+
     Channel::ExpectedResult Channel::Configure()
     {
         CALL_ESP_EXPECTED("uart::Channel::Configure", uart_param_config(m_Port, &m_Config));
@@ -154,168 +191,1101 @@ namespace uart
         return std::ref(*this);
     }
 
+    TickType_t Channel::event_wait_ticks() const
+    {
+        TickType_t w = portMAX_DELAY;
+        if (auto *pW = m_pAsyncWaiter.load(std::memory_order_acquire); pW && !pW->deadline.is_never())
+        {
+            //round up and wait at least a tick: a 0 would spin the event task until the deadline passes
+            uint32_t ms = uint32_t(pW->deadline.remaining().count());
+            w = std::max(TickType_t((ms + portTICK_PERIOD_MS - 1) / portTICK_PERIOD_MS), TickType_t(1));
+        }
+
+        if (!IsTxIdle())
+        {
+            //come back when what's in the driver should have been shifted out
+            size_t freeLen = 0;
+            uart_get_tx_buffer_free_size(m_Port, &freeLen);
+            size_t inDriver = m_TxBufferSize > int(freeLen) ? m_TxBufferSize - freeLen : 0;
+            uint32_t ms = uint32_t((inDriver + 1) * 10 * 1000 / std::max(m_Config.baud_rate, 1));
+            w = std::min(w, std::max(pdMS_TO_TICKS(ms), TickType_t(1)));
+        }
+        return w;
+    }
+
+    void Channel::wake_events()
+    {
+        uart_event_t wake{};
+        wake.type = kWakeEvent;
+        xQueueSend(m_Handle, &wake, 0);//a full queue wakes the task anyway
+    }
+
+    void Channel::poll_pending()
+    {
+        PollAsync();
+        if (!IsTxIdle())
+            pump_tx();
+    }
+
+    size_t Channel::GetTxQueueFree() const
+    {
+        return kTxQueueDepth - (m_TxTail - m_TxHead);
+    }
+
+    bool Channel::IsTxIdle() const
+    {
+        return m_TxHead == m_TxTail;
+    }
+
+    Channel::ExpectedResult Channel::SendAsync(std::span<const uint8_t> data, TxDoneCallback cb)
+    {
+        return queue_tx(data, std::move(cb), nullptr);
+    }
+
+    Channel::ExpectedResult Channel::SendAsync(std::span<const uint8_t> data, TaskHandle_t notify)
+    {
+        return queue_tx(data, {}, notify);
+    }
+
+    Channel::ExpectedResult Channel::queue_tx(std::span<const uint8_t> data, TxDoneCallback &&cb, TaskHandle_t notify)
+    {
+        if (!m_Handle || !m_TxLock)
+            return std::unexpected(Err{"uart::Channel::SendAsync", ESP_ERR_INVALID_STATE});
+        if (auto r = FlushTx(); !r)
+            return r;
+
+        xSemaphoreTake(m_TxLock, portMAX_DELAY);
+        if (m_TxTail - m_TxHead == kTxQueueDepth)
+        {
+            xSemaphoreGive(m_TxLock);
+            return std::unexpected(Err{"uart::Channel::SendAsync queue full", ESP_ERR_NO_MEM});
+        }
+        auto &r = m_TxQueue[m_TxTail % kTxQueueDepth];
+        r.pData = data.data();
+        r.len = data.size();
+        r.pushed = 0;
+        r.cb = std::move(cb);
+        r.notify = notify;
+        ++m_TxTail;
+        xSemaphoreGive(m_TxLock);
+
+        pump_tx();
+
+        //let the event task pick up the new timing
+        wake_events();
+        return std::ref(*this);
+    }
+
+    void Channel::cancel_tx(esp_err_t err)
+    {
+        if (!m_TxLock)
+            return;
+        TxRequest cancelled[kTxQueueDepth];
+        size_t n = 0;
+        xSemaphoreTake(m_TxLock, portMAX_DELAY);
+        for(; m_TxHead != m_TxTail; ++m_TxHead)
+        {
+            auto &r = m_TxQueue[m_TxHead % kTxQueueDepth];
+            cancelled[n++] = std::move(r);
+            r = {};
+        }
+        m_TxPushed = m_TxTail.load();
+        xSemaphoreGive(m_TxLock);
+
+        //outside the lock: a callback may queue the next request
+        for(size_t i = 0; i < n; ++i)
+        {
+            if (cancelled[i].cb)
+                cancelled[i].cb(err);
+            if (cancelled[i].notify)
+                xTaskNotifyGive(cancelled[i].notify);
+        }
+    }
+
+    void Channel::pump_tx()
+    {
+        struct Done
+        {
+            TxDoneCallback cb;
+            TaskHandle_t notify;
+            esp_err_t err;
+        };
+        Done done[kTxQueueDepth];
+        size_t doneCount = 0;
+
+        xSemaphoreTake(m_TxLock, portMAX_DELAY);
+        auto complete = [&](TxRequest &r){
+            done[doneCount++] = {std::move(r.cb), r.notify, r.err};
+            r = {};
+        };
+
+        //everything pushed so far is out once the driver went idle
+        if (m_TxHead != m_TxPushed && uart_wait_tx_done(m_Port, 0) == ESP_OK)
+        {
+            for(; m_TxHead != m_TxPushed; ++m_TxHead)
+                complete(m_TxQueue[m_TxHead % kTxQueueDepth]);
+        }
+
+        while(m_TxPushed != m_TxTail)
+        {
+            auto &r = m_TxQueue[m_TxPushed % kTxQueueDepth];
+            size_t room = 0;
+            if (uart_get_tx_buffer_free_size(m_Port, &room) != ESP_OK || !room)
+                break;
+
+            //fits into the ring: doesn't block
+            int w = uart_write_bytes(m_Port, r.pData + r.pushed, std::min(room, r.len - r.pushed));
+            if (m_Dbg && w > 0)
+                PH_TRACE(trace::Kind::UartTx, m_Port, r.pData + r.pushed, w);
+            if (m_pCapture && w > 0)
+                m_pCapture->Record(capture::Dir::Tx, r.pData + r.pushed, w);
+            if (w < 0)
+            {
+                //give up on the rest, completes with the error in order with the others
+                r.err = ESP_ERR_INVALID_ARG;
+                r.len = r.pushed;
+            }
+            else
+            {
+                r.pushed += w;
+                m_Stats.tx_bytes.fetch_add(w, std::memory_order_relaxed);
+            }
+
+            if (r.pushed < r.len)
+                break;
+            ++m_TxPushed;
+        }
+        xSemaphoreGive(m_TxLock);
+
+        for(size_t i = 0; i < doneCount; ++i)
+        {
+            if (done[i].cb)
+                done[i].cb(done[i].err);
+            if (done[i].notify)
+                xTaskNotifyGive(done[i].notify);
+        }
+    }
+
+    void Channel::SetAsyncWaiter(AsyncWaiter *pW)
+    {
+        m_pAsyncWaiter.store(pW, std::memory_order_release);
+        if (pW && m_Handle)
+        {
+            //wake the event task so it re-evaluates the new waiter and its deadline
+            wake_events();
+        }
+    }
+
+    void Channel::PollAsync()
+    {
+        auto *pW = m_pAsyncWaiter.load(std::memory_order_acquire);
+        if (pW && pW->Poll(*this))
+        {
+            //cleared before resuming: the resumed coroutine may immediately park the next waiter
+            m_pAsyncWaiter.store(nullptr, std::memory_order_release);
+            pW->Resume();
+        }
+    }
+
+    bool ByteRing::allocate(size_t sz, uint32_t caps)
+    {
+        release();
+        m_pBuf = (uint8_t*)heap_caps_malloc(sz, caps);
+        if (!m_pBuf)
+            return false;
+        m_Cap = sz;
+        m_Head = m_Tail = 0;
+        return true;
+    }
+
+    void ByteRing::release()
+    {
+        if (m_pBuf)
+        {
+            heap_caps_free(m_pBuf);
+            m_pBuf = nullptr;
+        }
+        m_Cap = 0;
+        m_Head = m_Tail = 0;
+    }
+
+    size_t ByteRing::write(const uint8_t *pData, size_t len)
+    {
+        size_t head = m_Head.load(std::memory_order_relaxed);
+        size_t tail = m_Tail.load(std::memory_order_acquire);
+        len = std::min(len, m_Cap - (head - tail));
+        size_t off = head % m_Cap;
+        size_t first = std::min(len, m_Cap - off);
+        std::memcpy(m_pBuf + off, pData, first);
+        std::memcpy(m_pBuf, pData + first, len - first);
+        m_Head.store(head + len, std::memory_order_release);
+        return len;
+    }
+
+    size_t ByteRing::read(uint8_t *pDst, size_t len)
+    {
+        size_t tail = m_Tail.load(std::memory_order_relaxed);
+        size_t head = m_Head.load(std::memory_order_acquire);
+        len = std::min(len, head - tail);
+        if (!len)
+            return 0;
+        size_t off = tail % m_Cap;
+        size_t first = std::min(len, m_Cap - off);
+        std::memcpy(pDst, m_pBuf + off, first);
+        std::memcpy(pDst + first, m_pBuf, len - first);
+        m_Tail.store(tail + len, std::memory_order_release);
+        return len;
+    }
+
+    void Channel::Stats::reset()
+    {
+        for(auto *pA : {&rx_bytes, &tx_bytes, &tx_writes, &buffer_full, &fifo_overrun, &dropped_events, &max_rx_fill, &overflow_saved, &overflow_lost})
+            pA->store(0, std::memory_order_relaxed);
+        for(auto &l : read_latency)
+            l.store(0, std::memory_order_relaxed);
+    }
+
+    int Channel::drv_read(uint8_t *pDst, size_t len, TickType_t ticks)
+    {
+        if (!m_RxLock)
+            return drv_read_locked(pDst, len, ticks);
+        //the event task moves driver bytes into the ring on overflow: with the ring and the driver read in
+        //between, those would come out after newer ones
+        xSemaphoreTake(m_RxLock, portMAX_DELAY);
+        int r = drv_read_locked(pDst, len, ticks);
+        xSemaphoreGive(m_RxLock);
+        return r;
+    }
+
+    int Channel::drv_read_locked(uint8_t *pDst, size_t len, TickType_t ticks)
+    {
+        //bytes rescued on overflow are older than anything still in the driver
+        size_t fromRing = m_OverflowRing.valid() ? m_OverflowRing.read(pDst, len) : 0;
+        int r = 0;
+        if (fromRing < len)
+        {
+            //whoever waits for an answer wants the request out first
+            if (ticks && m_StageLen.load(std::memory_order_relaxed))
+                FlushTx();
+
+            int64_t start = ticks ? esp_timer_get_time() : 0;
+            r = m_pBackend ? m_pBackend->Read(pDst + fromRing, len - fromRing, ticks) : uart_read_bytes(m_Port, pDst + fromRing, len - fromRing, ticks);
+            if (r < 0)
+                return r;
+            if (ticks)
+            {
+                uint32_t us = uint32_t(esp_timer_get_time() - start);
+                size_t bucket = 0;
+                while(bucket < std::size(Stats::kLatencyBoundsUs) && us > Stats::kLatencyBoundsUs[bucket])
+                    ++bucket;
+                m_Stats.read_latency[bucket].fetch_add(1, std::memory_order_relaxed);
+            }
+        }
+        //rescued bytes are accounted, traced and captured like the ones straight from the driver
+        r += int(fromRing);
+        if (m_Dbg && r)
+            PH_TRACE(trace::Kind::UartRx, m_Port, pDst, r);
+        if (m_pCapture && r)
+            m_pCapture->Record(capture::Dir::Rx, pDst, r);
+        m_Stats.rx_bytes.fetch_add(r, std::memory_order_relaxed);
+        return r;
+    }
+
+    size_t Channel::drv_available()
+    {
+        if (m_pBackend)
+            return m_pBackend->ReadyToRead();
+        size_t avail = 0;
+        uart_get_buffered_data_len(m_Port, &avail);
+        return avail + m_OverflowRing.size();
+    }
+
+    void Channel::drain_on_overflow()
+    {
+        //a reader in drv_read is emptying the driver already, and may stay blocked there for a while
+        if (xSemaphoreTake(m_RxLock, 0) != pdTRUE)
+            return;
+        drain_on_overflow_locked();
+        xSemaphoreGive(m_RxLock);
+    }
+
+    void Channel::drain_on_overflow_locked()
+    {
+        uint8_t buf[64];
+        while(true)
+        {
+            size_t inDriver = 0;
+            uart_get_buffered_data_len(m_Port, &inDriver);
+            if (!inDriver)
+                break;
+
+            size_t room = std::min(m_OverflowRing.free(), sizeof(buf));
+            if (!room)
+            {
+                m_Stats.overflow_lost.fetch_add(inDriver, std::memory_order_relaxed);
+                uart_flush_input(m_Port);
+                break;
+            }
+
+            int r = uart_read_bytes(m_Port, buf, std::min(room, inDriver), 0);
+            if (r <= 0)
+                break;
+            m_OverflowRing.write(buf, r);
+            m_Stats.overflow_saved.fetch_add(r, std::memory_order_relaxed);
+        }
+    }
+
+    Channel& Channel::SetDataCallback(DataCallback cb, RxFraming framing)
+    {
+        if (m_State.open && m_CallbackLock)
+        {
+            xSemaphoreTakeRecursive(m_CallbackLock, portMAX_DELAY);
+            m_DataCallback = std::move(cb);
+            xSemaphoreGiveRecursive(m_CallbackLock);
+            return *this;
+        }
+        m_DataCallback = std::move(cb);
+        m_Framing = framing;
+        m_Framing.max_chunk = std::max(m_Framing.max_chunk, size_t(1));
+        return *this;
+    }
+
+    Channel::ExpectedResult Channel::apply_rx_framing()
+    {
+        m_pChunk.reset(new (std::nothrow) uint8_t[m_Framing.max_chunk]);
+        m_ChunkLen = 0;
+        if (!m_pChunk)
+            return std::unexpected(Err{"uart::Channel::Open chunk", ESP_ERR_NO_MEM});
+
+        switch(m_Framing.mode)
+        {
+            case RxFraming::Mode::IdleTimeout:
+                CALL_ESP_EXPECTED("uart::Channel::Open rx timeout", uart_set_rx_timeout(m_Port, m_Framing.rx_timeout));
+                break;
+            case RxFraming::Mode::FullThreshold:
+                CALL_ESP_EXPECTED("uart::Channel::Open rx threshold", uart_set_rx_full_threshold(m_Port, m_Framing.full_threshold));
+                break;
+            case RxFraming::Mode::Pattern:
+                CALL_ESP_EXPECTED("uart::Channel::Open pattern", 
+                        uart_enable_pattern_det_baud_intr(m_Port, m_Framing.pattern, m_Framing.pattern_count, m_Framing.pattern_chr_tout, m_Framing.pattern_post_idle, m_Framing.pattern_pre_idle));
+                CALL_ESP_EXPECTED("uart::Channel::Open pattern queue", uart_pattern_queue_reset(m_Port, m_QueueSize));
+                break;
+        }
+        return std::ref(*this);
+    }
+
+    void Channel::deliver_data(const uart_event_t &event)
+    {
+        size_t avail = drv_available();
+        while(avail)
+        {
+            size_t toRead = std::min(avail, m_Framing.max_chunk - m_ChunkLen);
+            int r = drv_read(m_pChunk.get() + m_ChunkLen, toRead, 0);
+            if (r <= 0)
+                break;
+            avail -= r;
+            m_ChunkLen += r;
+            if (m_ChunkLen == m_Framing.max_chunk)
+            {
+                //the callback may have detached itself
+                if (m_DataCallback)
+                    m_DataCallback(std::span<const uint8_t>(m_pChunk.get(), m_ChunkLen));
+                m_ChunkLen = 0;
+            }
+        }
+
+        //with idle timeout framing the chunk is complete once the line went quiet
+        bool complete = (m_Framing.mode != RxFraming::Mode::IdleTimeout) || event.timeout_flag;
+        if (complete && m_ChunkLen)
+        {
+            if (m_DataCallback)
+                m_DataCallback(std::span<const uint8_t>(m_pChunk.get(), m_ChunkLen));
+            m_ChunkLen = 0;
+        }
+    }
+
+    void Channel::deliver_pattern()
+    {
+        int pos = uart_pattern_pop_pos(m_Port);
+        if (pos < 0)
+        {
+            //pattern position queue overflowed, positions are lost - start from scratch
+            uart_flush_input(m_Port);
+            uart_pattern_queue_reset(m_Port, m_QueueSize);
+            return;
+        }
+
+        size_t lineLen = size_t(pos) + m_Framing.pattern_count;
+        size_t toRead = std::min(lineLen, m_Framing.max_chunk);
+        int r = drv_read(m_pChunk.get(), toRead, 0);
+        if (r <= 0)
+            return;
+
+        //drop whatever didn't fit
+        uint8_t skip[16];
+        for(size_t left = lineLen - toRead; left; )
+        {
+            int s = drv_read(skip, std::min(left, sizeof(skip)), 0);
+            if (s <= 0)
+                break;
+            left -= s;
+        }
+        m_DataCallback(std::span<const uint8_t>(m_pChunk.get(), size_t(r)));
+    }
+
+    void Channel::process_event(const uart_event_t &event)
+    {
+        //SetDataCallback on an open channel waits for the callbacks of this event
+        xSemaphoreTakeRecursive(m_CallbackLock, portMAX_DELAY);
+        handle_event(event);
+        xSemaphoreGiveRecursive(m_CallbackLock);
+    }
+
+    void Channel::handle_event(const uart_event_t &event)
+    {
+        if (event.type == kWakeEvent)
+        {
+            poll_pending();
+            return;
+        }
+        if (event.type == UART_DATA)
+        {
+            size_t fill = 0;
+            uart_get_buffered_data_len(m_Port, &fill);
+            atomic_max(m_Stats.max_rx_fill, uint32_t(fill));
+        }
+
+        poll_pending();
+        switch (event.type) 
+        {
+            case UART_DATA:
+                if (m_DataCallback)
+                {
+                    if (m_Framing.mode == RxFraming::Mode::Pattern)
+                        return;//stays in the ring buffer until the pattern arrives
+                    deliver_data(event);
+                }
+                else if (!GetReadyToReadDataLen().value().v)//only if data really available
+                    return;
+                break;
+            case UART_PATTERN_DET:
+                if (m_DataCallback)
+                    deliver_pattern();
+                break;
+            case UART_BUFFER_FULL:
+            case UART_FIFO_OVF:
+                if (event.type == UART_BUFFER_FULL)
+                    m_Stats.buffer_full.fetch_add(1, std::memory_order_relaxed);
+                else
+                    m_Stats.fifo_overrun.fetch_add(1, std::memory_order_relaxed);
+                if (m_OverflowRing.valid() && !m_DataCallback)
+                    drain_on_overflow();
+                if (m_pDispatcher)
+                {
+                    //the queue is a member of the dispatcher's set: a reset would leave the set's entries for
+                    //the dropped events behind, taking them one by one keeps the set's bookkeeping right
+                    uart_event_t stale;
+                    while(xQueueReceive(m_Handle, &stale, 0))
+                        m_Stats.dropped_events.fetch_add(1, std::memory_order_relaxed);
+                }else
+                {
+                    m_Stats.dropped_events.fetch_add(uxQueueMessagesWaiting(m_Handle), std::memory_order_relaxed);
+                    xQueueReset(m_Handle);
+                }
+                break;
+            default:
+                break;
+        }
+        if (m_EventCallback)
+            m_EventCallback(event.type);
+    }
+
     void Channel::uart_event_loop(Channel &c)
     {
         uart_event_t event;
+        c.m_EventTask = xTaskGetCurrentTaskHandle();
         while (true) {
-            if (xQueueReceive(c.m_Handle, &event, pdMS_TO_TICKS(2000))) 
+            if (xQueueReceive(c.m_Handle, &event, c.event_wait_ticks())) 
             {
-                switch (event.type) 
+                if (event.type == UART_EVENT_MAX)
                 {
-                    case UART_DATA:
-                        if (!c.GetReadyToReadDataLen().value().v)//only if data really available
-                            continue;
-                        break;
-                    case UART_BUFFER_FULL:
-                    case UART_FIFO_OVF:
-                        xQueueReset(c.m_Handle);
-                        break;
-                    case UART_EVENT_MAX:
-                        return;//we're done
-                    default:
-                        break;
+                    //we're done
+                    c.m_EventTask = nullptr;
+                    xSemaphoreGive(c.m_EventsStopped);
+                    return;
                 }
-                c.m_EventCallback(event.type);
-            }
+                c.process_event(event);
+            }else
+                c.poll_pending();//deadline of a pending waiter or TX progress
         }
     }
 
     Channel::ExpectedResult Channel::Open()
     {
+        if (m_pBackend)
+        {
+            if (needs_events())
+                return std::unexpected(Err{"uart::Channel::Open events with a backend", ESP_ERR_NOT_SUPPORTED});
+            return std::ref(*this);
+        }
+
+        if (m_State.open)
+            return std::ref(*this);
         if (!m_State.pins_set)
             return std::unexpected(Err{"uart::Channel::Open", ESP_ERR_INVALID_STATE});
 
-        if (m_EventCallback)
+        //only the event side drains into the ring, without events it would stay empty
+        bool rescue = m_OverflowRingSize && needs_events();
+        if (rescue && !m_RxLock && !(m_RxLock = xSemaphoreCreateMutex()))
+            return std::unexpected(Err{"uart::Channel::Open rx lock", ESP_ERR_NO_MEM});
+        if (rescue && !m_OverflowRing.valid())
+        {
+            if (!(m_OverflowPSRAM && m_OverflowRing.allocate(m_OverflowRingSize, MALLOC_CAP_SPIRAM)) 
+                    && !m_OverflowRing.allocate(m_OverflowRingSize, MALLOC_CAP_8BIT))
+                return std::unexpected(Err{"uart::Channel::Open overflow ring", ESP_ERR_NO_MEM});
+        }
+
+        if (needs_events())
         {
             CALL_ESP_EXPECTED("uart::Channel::Open", uart_driver_install(m_Port, m_RxBufferSize, m_TxBufferSize, m_QueueSize, &m_Handle, 0));
-            m_QueueTask = thread::start_task({.pName = "uart::events", .stackSize=2048, .prio=thread::kPrioHigh}, uart_event_loop, std::ref(*this));
+            //Close relies on the events being serviced once the channel is open, so a failure rolls back here
+            if (auto r = start_events(); !r)
+            {
+                uart_driver_delete(m_Port);
+                m_Handle = nullptr;
+                return r;
+            }
+            m_State.open = true;
         }
         else
+        {
             CALL_ESP_EXPECTED("uart::Channel::Open no events", uart_driver_install(m_Port, m_RxBufferSize, m_TxBufferSize, 0, nullptr, 0));
+            m_State.open = true;
+        }
+        return std::ref(*this);
+    }
+
+    Channel::ExpectedResult Channel::start_events()
+    {
+        if (!m_TxLock && !(m_TxLock = xSemaphoreCreateMutex()))
+            return std::unexpected(Err{"uart::Channel::Open tx lock", ESP_ERR_NO_MEM});
+        if (!m_CallbackLock && !(m_CallbackLock = xSemaphoreCreateRecursiveMutex()))
+            return std::unexpected(Err{"uart::Channel::Open callback lock", ESP_ERR_NO_MEM});
+        if (m_DataCallback)
+        {
+            if (auto r = apply_rx_framing(); !r)
+                return r;
+        }
+        if (m_pDispatcher)
+        {
+            if (auto r = m_pDispatcher->Register(*this); !r)
+                return std::unexpected(r.error());
+        }else
+        {
+            if (!m_EventsStopped && !(m_EventsStopped = xSemaphoreCreateBinary()))
+                return std::unexpected(Err{"uart::Channel::Open events stop", ESP_ERR_NO_MEM});
+            xSemaphoreTake(m_EventsStopped, 0);
+            m_QueueTask = thread::start_task({.pName = "uart::events", .stackSize=m_EventStackSize, .prio=thread::kPrioHigh}, uart_event_loop, std::ref(*this));
+        }
         return std::ref(*this);
     }
 
     Channel::ExpectedResult Channel::Close()
     {
+        if (m_State.open)
+        {
+            //the task servicing the events can't wait for itself
+            TaskHandle_t self = xTaskGetCurrentTaskHandle();
+            if (m_Handle && (self == m_EventTask || (m_pDispatcher && self == m_pDispatcher->m_Task)))
+                return std::unexpected(Err{"uart::Channel::Close from an event callback", ESP_ERR_INVALID_STATE});
+            if (m_Handle)
+            {
+                if (m_pDispatcher)
+                    m_pDispatcher->Unregister(*this);
+                else
+                {
+                    //the sentinel goes behind whatever is queued, the task confirms before it returns
+                    uart_event_t stop{};
+                    stop.type = UART_EVENT_MAX;
+                    xQueueSend(m_Handle, &stop, portMAX_DELAY);
+                    xSemaphoreTake(m_EventsStopped, portMAX_DELAY);
+                }
+            }
+            FlushTx();
+            //nobody services the queue anymore
+            cancel_tx(ESP_ERR_INVALID_STATE);
+            CALL_ESP_EXPECTED("uart::Channel::Close", uart_driver_delete(m_Port));
+            m_Handle = nullptr;
+            m_RxBegin = m_RxEnd = 0;
+            m_OverflowRing.clear();
+        }
         m_StateU8 = 0;
         return std::ref(*this);
     }
 
+    Channel::ExpectedResult Channel::Reconfigure(bool drainTx)
+    {
+        if (m_pBackend)
+            return std::unexpected(Err{"uart::Channel::Reconfigure", ESP_ERR_NOT_SUPPORTED});
+        if (!m_State.open)
+            return Configure();
+
+        if (drainTx)
+        {
+            if (auto r = FlushTx(); !r)
+                return r;
+            CALL_ESP_EXPECTED("uart::Channel::Reconfigure drain", uart_wait_tx_done(m_Port, portMAX_DELAY));
+        }
+        //a handful of register writes each, unlike uart_param_config this leaves the clock source alone
+        CALL_ESP_EXPECTED("uart::Channel::Reconfigure baud", uart_set_baudrate(m_Port, m_Config.baud_rate));
+        CALL_ESP_EXPECTED("uart::Channel::Reconfigure data bits", uart_set_word_length(m_Port, m_Config.data_bits));
+        CALL_ESP_EXPECTED("uart::Channel::Reconfigure parity", uart_set_parity(m_Port, m_Config.parity));
+        CALL_ESP_EXPECTED("uart::Channel::Reconfigure stop bits", uart_set_stop_bits(m_Port, m_Config.stop_bits));
+        CALL_ESP_EXPECTED("uart::Channel::Reconfigure flow", uart_set_hw_flow_ctrl(m_Port, m_Config.flow_ctrl, m_Config.rx_flow_ctrl_thresh));
+        return std::ref(*this);
+    }
+
+    Channel::ExpectedValue<uint32_t> Channel::GetActualBaudRate()
+    {
+        if (!m_State.open || m_pBackend)
+            return std::unexpected(Err{"uart::Channel::GetActualBaudRate", ESP_ERR_INVALID_STATE});
+        uint32_t rate = 0;
+        CALL_ESP_EXPECTED("uart::Channel::GetActualBaudRate", uart_get_baudrate(m_Port, &rate));
+        return RetVal<uint32_t>{*this, rate};
+    }
+
     Channel::ExpectedValue<size_t> Channel::GetReadyToReadDataLen()
     {
+        if (m_pBackend)
+            return RetVal<size_t>{*this, m_pBackend->ReadyToRead()};
         size_t len;
         CALL_ESP_EXPECTED("uart::Channel::GetReadyToReadDataLen", uart_get_buffered_data_len(m_Port, &len));
-        return RetVal<size_t>{*this, len};
+        return RetVal<size_t>{*this, len + m_OverflowRing.size()};
     }
 
     Channel::ExpectedValue<size_t> Channel::GetReadyToWriteDataLen()
     {
+        if (m_pBackend)
+            return RetVal<size_t>{*this, m_pBackend->ReadyToWrite()};
         size_t len;
         CALL_ESP_EXPECTED("uart::Channel::GetReadyToWriteDataLen", uart_get_tx_buffer_free_size(m_Port, &len));
         return RetVal<size_t>{*this, len};
     }
 
-    Channel::ExpectedResult Channel::Send(const uint8_t *pData, size_t len)
+    Channel::ExpectedResult Channel::drv_write(const uint8_t *pData, size_t len)
     {
-        if (m_Dbg) 
-        {
-            DBG_SEND;
-            for(int i = 0; i < len; ++i)
-                printf(" %X", pData[i]);
-        }
-        int r = uart_write_bytes(m_Port, pData, len);
+        int r = m_pBackend ? m_pBackend->Write(pData, len) : uart_write_bytes(m_Port, pData, len);
         if (r < 0)
             return std::unexpected(Err{"uart::Channel::Send", ESP_ERR_INVALID_ARG});
+        if (m_Dbg)
+            PH_TRACE(trace::Kind::UartTx, m_Port, pData, r);
+        if (m_pCapture)
+            m_pCapture->Record(capture::Dir::Tx, pData, r);
+        m_Stats.tx_bytes.fetch_add(r, std::memory_order_relaxed);
+        m_Stats.tx_writes.fetch_add(1, std::memory_order_relaxed);
         if (r != len)
             return std::unexpected(Err{"uart::Channel::Send", ESP_ERR_INVALID_SIZE});
         return std::ref(*this);
     }
 
-    Channel::ExpectedResult Channel::SendWithBreak(const uint8_t *pData, size_t len, size_t breakLen)
+    Channel& Channel::SetTxCoalescing(size_t stageSize, uint32_t delayUs)
+    {
+        if (!stageSize)
+            FlushTx();
+        m_StageSize = stageSize;
+        m_StageDelayUs = delayUs;
+        return *this;
+    }
+
+    bool Channel::ensure_stage()
+    {
+        if (!m_StageLock && !(m_StageLock = xSemaphoreCreateMutex()))
+            return false;
+        if (m_StageCapacity < m_StageSize)
+        {
+            //only ever grows, so whatever is staged already stays in place; the timer may be flushing the old one
+            xSemaphoreTake(m_StageLock, portMAX_DELAY);
+            bool ok = true;
+            if (m_StageCapacity < m_StageSize)
+            {
+                std::unique_ptr<uint8_t[]> pNew(new (std::nothrow) uint8_t[m_StageSize]);
+                if (pNew)
+                {
+                    if (m_StageLen)
+                        std::memcpy(pNew.get(), m_pStage.get(), m_StageLen);
+                    m_pStage = std::move(pNew);
+                    m_StageCapacity = m_StageSize;
+                }else
+                    ok = false;
+            }
+            xSemaphoreGive(m_StageLock);
+            if (!ok)
+                return false;
+        }
+        if (!m_StageTimer)
+        {
+            esp_timer_create_args_t args{
+                .callback = stage_timer_cb,
+                .arg = this,
+                .dispatch_method = ESP_TIMER_TASK,
+                .name = "uart::stage",
+                .skip_unhandled_events = true,
+            };
+            if (esp_timer_create(&args, &m_StageTimer) != ESP_OK)
+                return false;
+        }
+        return true;
+    }
+
+    void Channel::stage_timer_cb(void *pArg)
+    {
+        //runs on the esp_timer task, which must never block: a writer holding the stage is flushing it or
+        //about to, and only what fits into the driver's TX ring goes out from here, the rest waits for the
+        //next round
+        Channel &c = *static_cast<Channel*>(pArg);
+        if (xSemaphoreTake(c.m_StageLock, 0) != pdTRUE)
+        {
+            esp_timer_start_once(c.m_StageTimer, c.m_StageDelayUs);
+            return;
+        }
+        c.m_StageArmed = false;
+        size_t len = c.m_StageLen;
+        size_t room = 0;
+        if (auto r = c.GetReadyToWriteDataLen(); r)
+            room = r->v;
+        if (size_t n = std::min(len, room))
+        {
+            if (auto r = c.drv_write(c.m_pStage.get(), n); !r)
+                c.m_StageErr = r.error().code;
+            std::memmove(c.m_pStage.get(), c.m_pStage.get() + n, len - n);
+            c.m_StageLen = len - n;
+        }
+        //without a TX ring nothing ever fits
+        if (c.m_StageLen && (c.m_TxBufferSize > 0 || c.m_pBackend))
+            c.m_StageArmed = esp_timer_start_once(c.m_StageTimer, c.m_StageDelayUs) == ESP_OK;
+        xSemaphoreGive(c.m_StageLock);
+    }
+
+    Channel::ExpectedResult Channel::flush_stage_locked()
     {
-        if (m_Dbg) 
+        if (m_StageArmed)
         {
-            DBG_SEND;
-            for(int i = 0; i < len; ++i)
-                printf(" %X", pData[i]);
+            esp_timer_stop(m_StageTimer);
+            m_StageArmed = false;
         }
+        if (!m_StageLen)
+            return std::ref(*this);
+        size_t len = m_StageLen;
+        m_StageLen = 0;
+        return drv_write(m_pStage.get(), len);
+    }
+
+    Channel::ExpectedResult Channel::FlushTx()
+    {
+        if (!m_StageLock)
+            return std::ref(*this);
+        xSemaphoreTake(m_StageLock, portMAX_DELAY);
+        auto r = flush_stage_locked();
+        esp_err_t deferred = std::exchange(m_StageErr, ESP_OK);
+        xSemaphoreGive(m_StageLock);
+        if (r && deferred != ESP_OK)
+            return std::unexpected(Err{"uart::Channel::FlushTx deferred", deferred});
+        return r;
+    }
+
+    Channel::ExpectedResult Channel::write_raw(const uint8_t *pData, size_t len)
+    {
+        if (!m_StageSize || !ensure_stage())
+        {
+            if (m_StageLen.load(std::memory_order_relaxed))
+            {
+                if (auto r = FlushTx(); !r)
+                    return r;
+            }
+            return drv_write(pData, len);
+        }
+
+        xSemaphoreTake(m_StageLock, portMAX_DELAY);
+        ExpectedResult r = std::ref(*this);
+        if (esp_err_t deferred = std::exchange(m_StageErr, ESP_OK); deferred != ESP_OK)
+            r = std::unexpected(Err{"uart::Channel::Send deferred", deferred});
+        else
+        {
+            if (m_StageLen + len > m_StageSize)
+                r = flush_stage_locked();
+            if (r)
+            {
+                if (len >= m_StageSize)
+                    r = drv_write(pData, len);//nothing to gain from copying it
+                else
+                {
+                    std::memcpy(m_pStage.get() + m_StageLen, pData, len);
+                    m_StageLen += len;
+                    if (m_StageLen == m_StageSize)
+                        r = flush_stage_locked();
+                    else if (!m_StageArmed)
+                        m_StageArmed = esp_timer_start_once(m_StageTimer, m_StageDelayUs) == ESP_OK;
+                }
+            }
+        }
+        xSemaphoreGive(m_StageLock);
+        return r;
+    }
+
+    Channel::ExpectedResult Channel::Send(const uint8_t *pData, size_t len)
+    {
+        return write_raw(pData, len);
+    }
+
+    Channel::ExpectedResult Channel::SendV(std::span<const std::span<const uint8_t>> chunks)
+    {
+        uint8_t buf[kSendVStackBuf];
+        size_t used = 0;
+        for(auto ch : chunks)
+        {
+            if (used && (used + ch.size() > sizeof(buf)))
+            {
+                if (auto r = write_raw(buf, used); !r)
+                    return r;
+                used = 0;
+            }
+
+            if (ch.size() >= sizeof(buf))
+            {
+                if (auto r = write_raw(ch.data(), ch.size()); !r)
+                    return r;
+            }else
+            {
+                std::memcpy(buf + used, ch.data(), ch.size());
+                used += ch.size();
+            }
+        }
+
+        if (used)
+            return write_raw(buf, used);
+        return std::ref(*this);
+    }
+
+    Channel::ExpectedResult Channel::SendWithBreak(const uint8_t *pData, size_t len, size_t breakLen)
+    {
+        if (m_pBackend)
+            return std::unexpected(Err{"uart::Channel::SendWithBreak", ESP_ERR_NOT_SUPPORTED});
+        if (auto f = FlushTx(); !f)
+            return f;
         int r = uart_write_bytes_with_break(m_Port, pData, len, breakLen);
         if (r < 0)
             return std::unexpected(Err{"uart::Channel::Send", ESP_ERR_INVALID_ARG});
+        if (m_Dbg)
+            PH_TRACE(trace::Kind::UartTx, m_Port, pData, r);
+        if (m_pCapture)
+            m_pCapture->Record(capture::Dir::Tx, pData, r);
+        m_Stats.tx_bytes.fetch_add(r, std::memory_order_relaxed);
+        m_Stats.tx_writes.fetch_add(1, std::memory_order_relaxed);
         if (r != len)
             return std::unexpected(Err{"uart::Channel::Send", ESP_ERR_INVALID_SIZE});
 
         return std::ref(*this);
     }
 
-    Channel::ExpectedValue<size_t> Channel::Read(uint8_t *pBuf, size_t len, duration_ms_t wait)
+    bool Channel::ensure_rx_window()
     {
-        if (!len) return RetVal<size_t>{*this, size_t(0)};
-        if (wait == kDefaultWait) wait = m_DefaultWait;
-        bool addedPeek = m_HasPeekByte;
-        if (m_HasPeekByte)
+        if (m_RxWindowCapacity >= m_RxWindowSize)
+            return true;
+        size_t used = m_RxEnd - m_RxBegin;
+        size_t cap = std::max(m_RxWindowSize, used);
+        std::unique_ptr<uint8_t[]> pNew(new (std::nothrow) uint8_t[cap]);
+        if (!pNew)
+            return false;
+        if (used)
+            std::memcpy(pNew.get(), m_pRxWindow.get() + m_RxBegin, used);
+        m_pRxWindow = std::move(pNew);
+        m_RxWindowCapacity = cap;
+        m_RxBegin = 0;
+        m_RxEnd = used;
+        return true;
+    }
+
+    TickType_t Channel::wait_ticks(duration_ms_t wait) const
+    {
+        if (wait == kDefaultWait)
         {
-            pBuf[0] = m_PeekByte;
-            m_HasPeekByte = false;
-            --len;
-            ++pBuf;
-            if (!len) return RetVal<size_t>{*this, 1};
+            if (!m_OpDeadline.is_never())
+                wait = m_OpDeadline.remaining();
+            else
+                wait = m_DefaultWait;
         }
+        else if (!m_OpDeadline.is_never())
+            wait = std::min(wait, m_OpDeadline.remaining());
+
+        if (wait == kForever)
+            return portMAX_DELAY;
+        return TickType_t((wait.count() + portTICK_PERIOD_MS - 1) / portTICK_PERIOD_MS);
+    }
 
-        int r = uart_read_bytes(m_Port, pBuf, len, wait.count() / portTICK_PERIOD_MS);
+    Channel::ExpectedValue<size_t> Channel::fill_window(size_t need, TickType_t ticks)
+    {
+        if (!ensure_rx_window())
+            return std::unexpected(Err{"uart::Channel::Fill", ESP_ERR_NO_MEM});
+
+        if (m_RxBegin == m_RxEnd)
+            m_RxBegin = m_RxEnd = 0;
+        else if (m_RxEnd == m_RxWindowCapacity && m_RxBegin)
+        {
+            std::memmove(m_pRxWindow.get(), m_pRxWindow.get() + m_RxBegin, m_RxEnd - m_RxBegin);
+            m_RxEnd -= m_RxBegin;
+            m_RxBegin = 0;
+        }
+
+        size_t freeLen = m_RxWindowCapacity - m_RxEnd;
+        if (!freeLen)
+            return std::unexpected(Err{"uart::Channel::Fill window full", ESP_ERR_NO_MEM});
+
+        //whatever the driver already has costs nothing extra to take in the same call
+        size_t avail = drv_available();
+        size_t toRead = std::min(freeLen, std::max(need, avail));
+
+        uint8_t *pDst = m_pRxWindow.get() + m_RxEnd;
+        int r = drv_read(pDst, toRead, ticks);
         if (r < 0)
-            return std::unexpected(Err{"uart::Channel::Read", ESP_ERR_INVALID_ARG});
+            return std::unexpected(Err{"uart::Channel::Fill", ESP_ERR_INVALID_ARG});
+
+        m_RxEnd += r;
+        return RetVal<size_t>{*this, size_t(r)};
+    }
+
+    Channel::ExpectedValue<size_t> Channel::Fill(duration_ms_t wait, size_t need)
+    {
+        if (auto e = fill_window(std::max(need, size_t(1)), wait_ticks(wait)); !e)
+            return e;
+        else if (!e.value().v)
+            return std::unexpected(::Err{"Channel::Fill no data", ESP_OK});
+        return RetVal<size_t>{*this, m_RxEnd - m_RxBegin};
+    }
+
+    Channel::ExpectedResult Channel::Unread(std::span<const uint8_t> bytes)
+    {
+        if (bytes.empty())
+            return std::ref(*this);
+
+        if (bytes.size() <= m_RxBegin)
+        {
+            m_RxBegin -= bytes.size();
+            std::memcpy(m_pRxWindow.get() + m_RxBegin, bytes.data(), bytes.size());
+            return std::ref(*this);
+        }
+
+        size_t used = m_RxEnd - m_RxBegin;
+        size_t required = used + bytes.size();
+        if (required > m_RxWindowCapacity)
+        {
+            size_t cap = std::max(required, m_RxWindowSize);
+            std::unique_ptr<uint8_t[]> pNew(new (std::nothrow) uint8_t[cap]);
+            if (!pNew)
+                return std::unexpected(Err{"uart::Channel::Unread", ESP_ERR_NO_MEM});
+            if (used)
+                std::memcpy(pNew.get() + bytes.size(), m_pRxWindow.get() + m_RxBegin, used);
+            m_pRxWindow = std::move(pNew);
+            m_RxWindowCapacity = cap;
+        }else if (used)
+            std::memmove(m_pRxWindow.get() + bytes.size(), m_pRxWindow.get() + m_RxBegin, used);
+
+        std::memcpy(m_pRxWindow.get(), bytes.data(), bytes.size());
+        m_RxBegin = 0;
+        m_RxEnd = required;
+        return std::ref(*this);
+    }
+
+    Channel::ExpectedValue<size_t> Channel::Read(uint8_t *pBuf, size_t len, duration_ms_t wait)
+    {
+        if (!len) return RetVal<size_t>{*this, size_t(0)};
+
+        size_t fromWindow = std::min(len, m_RxEnd - m_RxBegin);
+        if (fromWindow)
+        {
+            std::memcpy(pBuf, m_pRxWindow.get() + m_RxBegin, fromWindow);
+            m_RxBegin += fromWindow;
+            if (fromWindow == len) return RetVal<size_t>{*this, len};
+            pBuf += fromWindow;
+            len -= fromWindow;
+        }
 
-        if (m_Dbg) 
+        TickType_t ticks = wait_ticks(wait);
+        if (len >= m_RxWindowSize)
         {
-            DBG_READ;
-            for(int i = 0; i < (int(r) + int(addedPeek)); ++i)
-                printf(" %X", pBuf[i]);
+            //big reads go straight to the destination, no point in staging them
+            int r = drv_read(pBuf, len, ticks);
+            if (r < 0)
+                return std::unexpected(Err{"uart::Channel::Read", ESP_ERR_INVALID_ARG});
+            return RetVal<size_t>{*this, size_t(r) + fromWindow};
         }
 
-        return RetVal<size_t>{*this, size_t(r) + size_t(addedPeek)};
+        if (auto e = fill_window(len, ticks); !e)
+            return e;
+
+        size_t fromFill = std::min(len, m_RxEnd - m_RxBegin);
+        std::memcpy(pBuf, m_pRxWindow.get() + m_RxBegin, fromFill);
+        m_RxBegin += fromFill;
+        return RetVal<size_t>{*this, fromFill + fromWindow};
+    }
+
+    Channel::ExpectedValue<size_t> Channel::Read(uint8_t *pBuf, size_t len, Deadline deadline)
+    {
+        DeadlineScope scope(*this, deadline);
+        return Read(pBuf, len, kDefaultWait);
     }
 
     Channel::ExpectedValue<uint8_t> Channel::ReadByte(duration_ms_t wait)
     {
-        if (wait == kDefaultWait) wait = m_DefaultWait;
-        uint8_t b;
+        if (m_RxBegin != m_RxEnd)
+            return RetVal<uint8_t>{std::ref(*this), m_pRxWindow[m_RxBegin++]};
+
+        TickType_t ticks = wait_ticks(wait);
         CHECK_STACK(3500);
-        if (auto e = Read(&b, 1, wait); !e)
+        if (auto e = fill_window(1, ticks); !e)
             return std::unexpected(e.error());
         else if (auto l = e.value().v; !l)
         {
             CHECK_STACK(100);
-            if (m_Dbg)
-                printf("Nothing to read. Wait: %d\n", wait.count());
             return std::unexpected(::Err{"Channel::ReadByte no data", ESP_OK});
         }else
-            return RetVal<uint8_t>{std::ref(*this), b};
+            return RetVal<uint8_t>{std::ref(*this), m_pRxWindow[m_RxBegin++]};
     }
 
     Channel::ExpectedValue<uint8_t> Channel::PeekByte(duration_ms_t wait)
     {
-        if (m_HasPeekByte)
-            return RetVal<uint8_t>{std::ref(*this), m_PeekByte};
-        if (wait == kDefaultWait) wait = m_DefaultWait;
+        if (m_RxBegin != m_RxEnd)
+            return RetVal<uint8_t>{std::ref(*this), m_pRxWindow[m_RxBegin]};
         if (auto e = ReadByte(wait); !e) return e;
         else{
-            m_HasPeekByte = true;
-            m_PeekByte = e.value().v;
-            return RetVal<uint8_t>{std::ref(*this), m_PeekByte};
+            --m_RxBegin;
+            return e;
         }
     }
 
     Channel::ExpectedResult Channel::Flush()
     {
-        CALL_ESP_EXPECTED("uart::Channel::Flush", uart_flush_input(m_Port));
-        m_HasPeekByte = false;
+        if (m_pBackend)
+            m_pBackend->FlushInput();
+        else
+        {
+            CALL_ESP_EXPECTED("uart::Channel::Flush", uart_flush_input(m_Port));
+        }
+        m_RxBegin = m_RxEnd = 0;
+        if (m_OverflowRing.valid())
+        {
+            xSemaphoreTake(m_RxLock, portMAX_DELAY);
+            m_OverflowRing.clear();
+            xSemaphoreGive(m_RxLock);
+        }
         return std::ref(*this);
     }
 
     Channel::ExpectedResult Channel::WaitAllSent()
     {
-        CALL_ESP_EXPECTED("uart::Channel::WaitAllSent", uart_wait_tx_idle_polling(m_Port));
+        if (auto r = FlushTx(); !r)
+            return r;
+        esp_err_t e = m_pBackend ? m_pBackend->WaitAllSent(portMAX_DELAY) : uart_wait_tx_done(m_Port, portMAX_DELAY);
+        CALL_ESP_EXPECTED("uart::Channel::WaitAllSent", e);
         return std::ref(*this);
     }
 }
@@ -0,0 +1,40 @@
+#include "ph_uart_async.hpp"
+#include <bit>
+
+namespace uart
+{
+    namespace async
+    {
+        namespace
+        {
+            alignas(std::max_align_t) uint8_t g_FrameBlocks[FramePool::kBlocks][FramePool::kBlockSize];
+            std::atomic<uint32_t> g_UsedBlocks{0};
+        }
+
+        void* FramePool::allocate(size_t sz) noexcept
+        {
+            if (sz > kBlockSize)
+                return nullptr;
+
+            constexpr uint32_t kAllMask = kBlocks == 32 ? ~uint32_t(0) : ((uint32_t(1) << kBlocks) - 1);
+            uint32_t used = g_UsedBlocks.load(std::memory_order_relaxed);
+            while(true)
+            {
+                uint32_t freeMask = ~used & kAllMask;
+                if (!freeMask)
+                    return nullptr;
+                uint32_t bit = freeMask & (~freeMask + 1);
+                if (g_UsedBlocks.compare_exchange_weak(used, used | bit, std::memory_order_acquire, std::memory_order_relaxed))
+                    return g_FrameBlocks[std::countr_zero(bit)];
+            }
+        }
+
+        void FramePool::free(void *p) noexcept
+        {
+            if (!p)
+                return;
+            size_t idx = ((uint8_t*)p - &g_FrameBlocks[0][0]) / kBlockSize;
+            g_UsedBlocks.fetch_and(~(uint32_t(1) << idx), std::memory_order_release);
+        }
+    }
+}
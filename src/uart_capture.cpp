@@ -0,0 +1,352 @@
+#include "ph_uart_capture.hpp"
+#include <cstring>
+#include "esp_timer.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+
+namespace uart
+{
+    namespace capture
+    {
+        namespace
+        {
+            size_t put_varint(uint8_t *p, uint64_t v)
+            {
+                size_t n = 0;
+                while(v >= 0x80)
+                {
+                    p[n++] = uint8_t(v | 0x80);
+                    v >>= 7;
+                }
+                p[n++] = uint8_t(v);
+                return n;
+            }
+
+            size_t total_size(std::span<const std::span<const uint8_t>> parts)
+            {
+                size_t sz = 0;
+                for(auto p : parts)
+                    sz += p.size();
+                return sz;
+            }
+        }
+
+        bool MemorySink::Write(std::span<const std::span<const uint8_t>> parts)
+        {
+            if (total_size(parts) > m_Buf.size() - m_Len)
+                return false;
+            for(auto p : parts)
+            {
+                if (p.empty())
+                    continue;
+                std::memcpy(m_Buf.data() + m_Len, p.data(), p.size());
+                m_Len += p.size();
+            }
+            return true;
+        }
+
+        bool FileSink::Write(std::span<const std::span<const uint8_t>> parts)
+        {
+            for(auto p : parts)
+            {
+                if (!p.empty() && fwrite(p.data(), 1, p.size(), m_pF) != p.size())
+                    return false;
+            }
+            return true;
+        }
+
+        bool PartitionSink::program(const uint8_t *pData, size_t len)
+        {
+            if (m_Off + len > m_Erased)
+            {
+                size_t sector = m_pPart->erase_size ? m_pPart->erase_size : 4096;
+                size_t to = (m_Off + len + sector - 1) / sector * sector;
+                if (to > m_pPart->size || esp_partition_erase_range(m_pPart, m_Erased, to - m_Erased) != ESP_OK)
+                    return false;
+                m_Erased = to;
+            }
+            if (esp_partition_write(m_pPart, m_Off, pData, len) != ESP_OK)
+                return false;
+            m_Off += len;
+            return true;
+        }
+
+        bool PartitionSink::Write(std::span<const std::span<const uint8_t>> parts)
+        {
+            if (Size() + total_size(parts) > m_pPart->size)
+                return false;
+            for(auto p : parts)
+            {
+                while(!p.empty())
+                {
+                    size_t n = std::min(p.size(), kPageSize - m_PageLen);
+                    std::memcpy(m_Page + m_PageLen, p.data(), n);
+                    m_PageLen += n;
+                    p = p.subspan(n);
+                    if (m_PageLen == kPageSize)
+                    {
+                        if (!program(m_Page, kPageSize))
+                            return false;
+                        m_PageLen = 0;
+                    }
+                }
+            }
+            return true;
+        }
+
+        void PartitionSink::Flush()
+        {
+            if (m_PageLen && program(m_Page, m_PageLen))
+                m_PageLen = 0;
+        }
+
+        Recorder::Recorder(Sink &s):
+            m_Sink(s)
+        {
+        }
+
+        Recorder::~Recorder()
+        {
+            Stop();
+            if (m_Lock)
+                vSemaphoreDelete(m_Lock);
+        }
+
+        Recorder::ExpectedResult Recorder::Start()
+        {
+            if (m_Running)
+                return std::unexpected(Err{"uart::capture::Recorder::Start", ESP_ERR_INVALID_STATE});
+            if (!m_Lock && !(m_Lock = xSemaphoreCreateMutex()))
+                return std::unexpected(Err{"uart::capture::Recorder::Start lock", ESP_ERR_NO_MEM});
+
+            const uint8_t version[] = {kVersion};
+            std::span<const uint8_t> hdr[] = {kMagic, version};
+            if (!m_Sink.Write(hdr))
+                return std::unexpected(Err{"uart::capture::Recorder::Start header", ESP_FAIL});
+            m_LastUs = esp_timer_get_time();
+            m_Running = true;
+            return std::ref(*this);
+        }
+
+        Recorder::ExpectedResult Recorder::Stop()
+        {
+            if (!m_Running)
+                return std::ref(*this);
+            xSemaphoreTake(m_Lock, portMAX_DELAY);
+            m_Running = false;
+            m_Sink.Flush();
+            xSemaphoreGive(m_Lock);
+            return std::ref(*this);
+        }
+
+        void Recorder::Record(Dir d, const uint8_t *pData, size_t len)
+        {
+            if (!m_Running || !len)
+                return;
+
+            //a sink write may erase flash, callers are the timer and event tasks: don't queue up behind it
+            if (!xSemaphoreTake(m_Lock, 0))
+            {
+                m_Stats.busy.fetch_add(1, std::memory_order_relaxed);
+                return;
+            }
+            if (m_Running)
+            {
+                //timestamp taken under the lock: deltas never go negative
+                int64_t now = esp_timer_get_time();
+                uint8_t hdr[20];
+                size_t n = put_varint(hdr, uint64_t(now - m_LastUs));
+                n += put_varint(hdr + n, (uint64_t(len) << 1) | uint64_t(d));
+                std::span<const uint8_t> parts[] = {{hdr, n}, {pData, len}};
+                if (m_Sink.Write(parts))
+                {
+                    m_LastUs = now;
+                    m_Stats.chunks.fetch_add(1, std::memory_order_relaxed);
+                    m_Stats.bytes.fetch_add(len, std::memory_order_relaxed);
+                }
+                else
+                    m_Stats.dropped.fetch_add(1, std::memory_order_relaxed);
+            }
+            xSemaphoreGive(m_Lock);
+        }
+
+        Reader::Reader(std::span<const uint8_t> log):
+            m_Log(log)
+        {
+            m_Valid = log.size() >= kHeaderSize
+                && std::memcmp(log.data(), kMagic, sizeof(kMagic)) == 0
+                && log[sizeof(kMagic)] == kVersion;
+        }
+
+        void Reader::Rewind()
+        {
+            m_Off = kHeaderSize;
+            m_Ts = 0;
+        }
+
+        bool Reader::varint(uint64_t &v)
+        {
+            v = 0;
+            for(int shift = 0; shift < 64 && m_Off < m_Log.size(); shift += 7)
+            {
+                uint8_t b = m_Log[m_Off++];
+                v |= uint64_t(b & 0x7f) << shift;
+                if (!(b & 0x80))
+                    return true;
+            }
+            return false;
+        }
+
+        bool Reader::Next(Chunk &c)
+        {
+            if (!m_Valid || m_Off == m_Log.size())
+                return false;
+
+            uint64_t delta, lenDir;
+            if (!varint(delta) || !varint(lenDir) || (lenDir >> 1) > m_Log.size() - m_Off)
+            {
+                m_Valid = false;
+                return false;
+            }
+            size_t len = size_t(lenDir >> 1);
+            m_Ts += delta;
+            c.ts_us = m_Ts;
+            c.dir = Dir(lenDir & 1);
+            c.data = m_Log.subspan(m_Off, len);
+            m_Off += len;
+            return true;
+        }
+
+        Replay::Replay(std::span<const uint8_t> log):
+            Replay(log, Config{})
+        {
+        }
+
+        Replay::Replay(std::span<const uint8_t> log, Config cfg):
+            m_Reader(log),
+            m_Config(cfg)
+        {
+        }
+
+        void Replay::Rewind()
+        {
+            m_Reader.Rewind();
+            m_Stats = {};
+            m_Rx = {};
+            m_TxCount = 0;
+            m_TxRecorded = 0;
+            m_TxWritten = 0;
+            m_StartUs = -1;
+            m_End = false;
+        }
+
+        bool Replay::advance()
+        {
+            Chunk c;
+            while(m_Reader.Next(c))
+            {
+                if (c.dir == Dir::Rx)
+                {
+                    ++m_Stats.rx_chunks;
+                    m_Rx = c;
+                    return true;
+                }
+                ++m_Stats.tx_chunks;
+                m_TxRecorded += c.data.size();
+                //kept for comparison as far as there's room
+                if (m_TxCount < std::size(m_TxExpected))
+                    m_TxExpected[m_TxCount++] = c.data;
+            }
+            m_End = true;
+            return false;
+        }
+
+        int64_t Replay::due_in(int64_t now)
+        {
+            if (m_StartUs < 0)
+                m_StartUs = now - int64_t(m_Rx.ts_us / std::max(m_Config.speed, 1e-6f));//the first chunk is due right away
+            if (m_Config.speed <= 0)
+                return 0;
+            int64_t due = m_StartUs + int64_t(m_Rx.ts_us / m_Config.speed);
+            return due > now ? due - now : 0;
+        }
+
+        int Replay::Read(uint8_t *pDst, size_t len, TickType_t ticks)
+        {
+            int64_t start = esp_timer_get_time();
+            int64_t waitUs = ticks == portMAX_DELAY ? INT64_MAX : int64_t(ticks) * portTICK_PERIOD_MS * 1000;
+            size_t got = 0;
+            while(got < len)
+            {
+                if (m_Rx.data.empty() && !advance())
+                    break;//end of the log
+
+                int64_t now = esp_timer_get_time();
+                int64_t left = waitUs == INT64_MAX ? INT64_MAX : waitUs - (now - start);
+                if (blocked())
+                {
+                    //the code under test hasn't sent the request this answers yet; an endless wait would
+                    //never end when the reader is the writer as well (see Config::syncTx)
+                    if (left <= 0 || waitUs == INT64_MAX)
+                        break;
+                    vTaskDelay(1);
+                    continue;
+                }
+
+                if (int64_t d = due_in(now))
+                {
+                    if (left <= 0)
+                        break;
+                    vTaskDelay(std::max<TickType_t>(pdMS_TO_TICKS(std::min(d, left) / 1000), 1));
+                    continue;
+                }
+
+                size_t n = std::min(len - got, m_Rx.data.size());
+                std::memcpy(pDst + got, m_Rx.data.data(), n);
+                m_Rx.data = m_Rx.data.subspan(n);
+                got += n;
+            }
+            return int(got);
+        }
+
+        int Replay::Write(const uint8_t *pData, size_t len)
+        {
+            //the chunks recorded up to the next RX one become visible
+            if (!m_TxCount && m_Rx.data.empty() && !m_End)
+                advance();
+            m_TxWritten += len;
+            for(size_t left = len; left && m_TxCount; )
+            {
+                auto &e = m_TxExpected[0];
+                size_t n = std::min(left, e.size());
+                for(size_t i = 0; i < n; ++i)
+                    m_Stats.tx_mismatch += pData[i] != e[i];
+                pData += n;
+                left -= n;
+                e = e.subspan(n);
+                if (e.empty())
+                {
+                    std::move(m_TxExpected + 1, m_TxExpected + m_TxCount, m_TxExpected);
+                    --m_TxCount;
+                }
+            }
+            return int(len);
+        }
+
+        size_t Replay::ReadyToRead()
+        {
+            if (m_Rx.data.empty() && !advance())
+                return 0;
+            if (blocked() || due_in(esp_timer_get_time()))
+                return 0;
+            return m_Rx.data.size();
+        }
+
+        void Replay::FlushInput()
+        {
+            //drops what has arrived by now
+            while(ReadyToRead())
+                m_Rx.data = {};
+        }
+    }
+}
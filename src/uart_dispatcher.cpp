@@ -0,0 +1,232 @@
+#include "ph_uart.hpp"
+
+namespace uart
+{
+    namespace
+    {
+        enum class DispatchCmd: uint8_t
+        {
+            Wake,
+            Exit,
+        };
+
+        //reset + join (drain + leave) rounds before giving up on a channel that keeps receiving
+        constexpr int kJoinAttempts = 8;
+    }
+
+    EventDispatcher::EventDispatcher():
+        EventDispatcher(Config{})
+    {
+    }
+
+    EventDispatcher::EventDispatcher(Config cfg):
+        m_Config(cfg)
+    {
+    }
+
+    EventDispatcher::~EventDispatcher()
+    {
+        Stop();
+    }
+
+    EventDispatcher::ExpectedResult EventDispatcher::Start()
+    {
+        if (m_Task)
+            return std::ref(*this);
+
+        //+1 slot for the control queue; events taken from a member queue directly (dropped on overflow, drained
+        //on Unregister) leave their set entry behind until it's selected, hence twice the events
+        m_Set = xQueueCreateSet(2 * m_Config.maxEvents + 1);
+        m_Ctrl = xQueueCreate(1, sizeof(DispatchCmd));
+        m_Lock = xSemaphoreCreateRecursiveMutex();
+        m_Stopped = xSemaphoreCreateBinary();
+        if (!m_Set || !m_Ctrl || !m_Lock || !m_Stopped)
+        {
+            Stop();
+            return std::unexpected(Err{"uart::EventDispatcher::Start", ESP_ERR_NO_MEM});
+        }
+        xQueueAddToSet(m_Ctrl, m_Set);
+
+        if (xTaskCreatePinnedToCore(dispatch_loop, m_Config.pName, m_Config.stackSize, this, m_Config.prio, &m_Task, m_Config.core) != pdPASS)
+        {
+            m_Task = nullptr;
+            Stop();
+            return std::unexpected(Err{"uart::EventDispatcher::Start task", ESP_ERR_NO_MEM});
+        }
+        return std::ref(*this);
+    }
+
+    EventDispatcher::ExpectedResult EventDispatcher::Stop()
+    {
+        if (m_Task)
+        {
+            DispatchCmd cmd = DispatchCmd::Exit;
+            xQueueSend(m_Ctrl, &cmd, portMAX_DELAY);
+            xSemaphoreTake(m_Stopped, portMAX_DELAY);
+            m_Task = nullptr;
+        }
+
+        if (m_Set)
+        {
+            for(auto *&pC : m_Channels)
+            {
+                if (pC)
+                {
+                    leave_set(*pC);
+                    pC = nullptr;
+                }
+            }
+            m_UsedEvents = 0;
+            if (m_Ctrl)
+            {
+                DispatchCmd cmd;
+                while(xQueueReceive(m_Ctrl, &cmd, 0));
+                xQueueRemoveFromSet(m_Ctrl, m_Set);
+            }
+            vQueueDelete(m_Set);
+            m_Set = nullptr;
+        }
+        if (m_Ctrl) { vQueueDelete(m_Ctrl); m_Ctrl = nullptr; }
+        if (m_Lock) { vSemaphoreDelete(m_Lock); m_Lock = nullptr; }
+        if (m_Stopped) { vSemaphoreDelete(m_Stopped); m_Stopped = nullptr; }
+        return std::ref(*this);
+    }
+
+    EventDispatcher::ExpectedResult EventDispatcher::Register(Channel &c)
+    {
+        if (!m_Task || !c.m_Handle)
+            return std::unexpected(Err{"uart::EventDispatcher::Register", ESP_ERR_INVALID_STATE});
+
+        xSemaphoreTakeRecursive(m_Lock, portMAX_DELAY);
+        Channel **ppFree = nullptr;
+        for(auto *&pC : m_Channels)
+        {
+            if (pC == &c)
+            {
+                xSemaphoreGiveRecursive(m_Lock);
+                return std::ref(*this);
+            }
+            if (!pC && !ppFree)
+                ppFree = &pC;
+        }
+
+        esp_err_t err = ESP_OK;
+        if (!ppFree || (m_UsedEvents + c.m_QueueSize > m_Config.maxEvents))
+            err = ESP_ERR_NO_MEM;
+        else
+        {
+            //a queue can only join a set while it's empty, and the ISR may post again right after the reset
+            err = ESP_FAIL;
+            for(int attempt = 0; attempt < kJoinAttempts && err != ESP_OK; ++attempt)
+            {
+                c.m_Stats.dropped_events.fetch_add(uxQueueMessagesWaiting(c.m_Handle), std::memory_order_relaxed);
+                xQueueReset(c.m_Handle);
+                if (xQueueAddToSet(c.m_Handle, m_Set) == pdPASS)
+                    err = ESP_OK;
+            }
+            if (err == ESP_OK)
+            {
+                *ppFree = &c;
+                m_UsedEvents += c.m_QueueSize;
+            }
+        }
+        xSemaphoreGiveRecursive(m_Lock);
+
+        if (err != ESP_OK)
+            return std::unexpected(Err{"uart::EventDispatcher::Register", err});
+        kick();
+        return std::ref(*this);
+    }
+
+    EventDispatcher::ExpectedResult EventDispatcher::Unregister(Channel &c)
+    {
+        if (!m_Lock)
+            return std::ref(*this);
+
+        //the dispatcher holds the lock while handling events, so once we have it the channel is not in use
+        xSemaphoreTakeRecursive(m_Lock, portMAX_DELAY);
+        for(auto *&pC : m_Channels)
+        {
+            if (pC == &c)
+            {
+                leave_set(c);
+                m_UsedEvents -= c.m_QueueSize;
+                pC = nullptr;
+                break;
+            }
+        }
+        xSemaphoreGiveRecursive(m_Lock);
+        return std::ref(*this);
+    }
+
+    void EventDispatcher::leave_set(Channel &c)
+    {
+        //only an empty queue can leave the set, and a reset would leave the set entries of its events behind:
+        //drain it, again if the ISR posted in between
+        for(int attempt = 0; attempt < kJoinAttempts; ++attempt)
+        {
+            uart_event_t event;
+            while(xQueueReceive(c.m_Handle, &event, 0))
+                c.m_Stats.dropped_events.fetch_add(1, std::memory_order_relaxed);
+            if (xQueueRemoveFromSet(c.m_Handle, m_Set) == pdPASS)
+                return;
+        }
+    }
+
+    void EventDispatcher::kick()
+    {
+        DispatchCmd cmd = DispatchCmd::Wake;
+        xQueueSend(m_Ctrl, &cmd, 0);//if the queue is full a wake up is pending anyway
+    }
+
+    TickType_t EventDispatcher::wait_ticks() const
+    {
+        TickType_t w = portMAX_DELAY;
+        for(auto *pC : m_Channels)
+        {
+            if (pC)
+                w = std::min(w, pC->event_wait_ticks());
+        }
+        return w;
+    }
+
+    void EventDispatcher::dispatch_loop(void *p)
+    {
+        EventDispatcher &d = *static_cast<EventDispatcher*>(p);
+        while(true)
+        {
+            xSemaphoreTakeRecursive(d.m_Lock, portMAX_DELAY);
+            TickType_t w = d.wait_ticks();
+            xSemaphoreGiveRecursive(d.m_Lock);
+
+            QueueSetMemberHandle_t member = xQueueSelectFromSet(d.m_Set, w);
+            if (member == d.m_Ctrl)
+            {
+                DispatchCmd cmd;
+                if (xQueueReceive(d.m_Ctrl, &cmd, 0) && cmd == DispatchCmd::Exit)
+                    break;
+                continue;
+            }
+
+            xSemaphoreTakeRecursive(d.m_Lock, portMAX_DELAY);
+            for(auto *pC : d.m_Channels)
+            {
+                if (!pC)
+                    continue;
+
+                uart_event_t event;
+                if (member == pC->m_Handle && xQueueReceive(pC->m_Handle, &event, 0))
+                {
+                    if (event.type != UART_EVENT_MAX)
+                        pC->process_event(event);
+                }
+                else
+                    pC->poll_pending();//deadline of a pending waiter or TX progress
+            }
+            xSemaphoreGiveRecursive(d.m_Lock);
+        }
+
+        xSemaphoreGive(d.m_Stopped);
+        vTaskDelete(nullptr);
+    }
+}
@@ -0,0 +1,312 @@
+#include "ph_uart_framing.hpp"
+#include <cstring>
+
+namespace uart
+{
+    namespace
+    {
+        constexpr uint8_t kSlipEnd = 0xc0;
+        constexpr uint8_t kSlipEsc = 0xdb;
+        constexpr uint8_t kSlipEscEnd = 0xdc;
+        constexpr uint8_t kSlipEscEsc = 0xdd;
+        constexpr uint8_t kSlipEscapedEnd[] = {kSlipEsc, kSlipEscEnd};
+        constexpr uint8_t kSlipEscapedEsc[] = {kSlipEsc, kSlipEscEsc};
+        constexpr uint8_t kSlipEndByte[] = {kSlipEnd};
+        constexpr uint8_t kCobsDelimiter[] = {0};
+        constexpr size_t kMaxFillsPerProcess = 16;
+
+        //collects the pieces of an encoded frame and hands them to Channel::SendV in batches
+        class Emitter
+        {
+        public:
+            static constexpr size_t kMaxChunks = 16;
+
+            Emitter(Channel &c): m_C(c) {}
+
+            bool add(std::span<const uint8_t> s)
+            {
+                if (s.empty())
+                    return true;
+                if (m_N == kMaxChunks && !flush())
+                    return false;
+                m_Chunks[m_N++] = s;
+                return true;
+            }
+
+            bool add_byte(uint8_t b)
+            {
+                if (m_N == kMaxChunks && !flush())
+                    return false;
+                m_Bytes[m_N] = b;
+                m_Chunks[m_N] = {&m_Bytes[m_N], 1};
+                ++m_N;
+                return true;
+            }
+
+            bool flush()
+            {
+                if (!m_N)
+                    return true;
+                auto r = m_C.SendV({m_Chunks, m_N});
+                m_N = 0;
+                if (!r)
+                    m_Err = r.error();
+                return (bool)r;
+            }
+
+            const Err& error() const { return m_Err; }
+        private:
+            Channel &m_C;
+            std::span<const uint8_t> m_Chunks[kMaxChunks];
+            uint8_t m_Bytes[kMaxChunks];
+            size_t m_N = 0;
+            Err m_Err{"uart::FramedLink::Send", ESP_OK};
+        };
+
+        bool encode_cobs(Emitter &e, std::span<const uint8_t> (&seg)[2])
+        {
+            size_t si = 0, off = 0;
+            auto normalize = [&]{ while(si < 2 && off == seg[si].size()) { ++si; off = 0; } };
+            while(true)
+            {
+                std::span<const uint8_t> parts[2];
+                size_t np = 0, runLen = 0;
+                bool hitZero = false;
+                while(runLen < 254)
+                {
+                    normalize();
+                    if (si == 2)
+                        break;
+                    auto s = seg[si].subspan(off, std::min(seg[si].size() - off, 254 - runLen));
+                    auto *pZ = (const uint8_t*)std::memchr(s.data(), 0, s.size());
+                    size_t k = pZ ? size_t(pZ - s.data()) : s.size();
+                    if (k)
+                        parts[np++] = s.first(k);
+                    runLen += k;
+                    off += k;
+                    if (pZ)
+                    {
+                        hitZero = true;
+                        ++off;
+                        break;
+                    }
+                }
+
+                if (!e.add_byte(uint8_t(runLen + 1)))
+                    return false;
+                for(size_t i = 0; i < np; ++i)
+                    if (!e.add(parts[i]))
+                        return false;
+
+                if (hitZero)
+                    continue;//a zero at the very end still needs its (empty) block
+                if (runLen < 254)
+                    break;
+                normalize();
+                if (si == 2)
+                    break;
+            }
+            return e.add(kCobsDelimiter);
+        }
+
+        bool encode_slip(Emitter &e, std::span<const uint8_t> (&seg)[2])
+        {
+            //a leading END flushes whatever line noise the receiver has collected
+            if (!e.add(kSlipEndByte))
+                return false;
+            for(auto s : seg)
+            {
+                size_t from = 0;
+                for(size_t i = 0; i < s.size(); ++i)
+                {
+                    if (s[i] != kSlipEnd && s[i] != kSlipEsc)
+                        continue;
+                    if (!e.add(s.subspan(from, i - from)) || !e.add(s[i] == kSlipEnd ? kSlipEscapedEnd : kSlipEscapedEsc))
+                        return false;
+                    from = i + 1;
+                }
+                if (!e.add(s.subspan(from)))
+                    return false;
+            }
+            return e.add(kSlipEndByte);
+        }
+    }
+
+    FramedLink::FramedLink(Channel &c, Encoding e):
+        m_C(c),
+        m_Encoding(e)
+    {
+    }
+
+    FramedLink::ExpectedResult FramedLink::Send(std::span<const uint8_t> payload)
+    {
+        uint32_t crc = crc32(payload);
+        uint8_t trailer[kCrcSize] = {uint8_t(crc), uint8_t(crc >> 8), uint8_t(crc >> 16), uint8_t(crc >> 24)};
+        std::span<const uint8_t> seg[2] = {payload, trailer};
+
+        Emitter e(m_C);
+        bool ok = m_Encoding == Encoding::COBS ? encode_cobs(e, seg) : encode_slip(e, seg);
+        if (!ok || !e.flush())
+            return std::unexpected(e.error());
+        return std::ref(*this);
+    }
+
+    void FramedLink::reset_frame()
+    {
+        m_RxLen = 0;
+        m_InFrame = false;
+        m_Dropping = false;
+        m_CobsLeft = 0;
+        m_CobsZero = false;
+        m_SlipEsc = false;
+    }
+
+    void FramedLink::put(const uint8_t *pData, size_t len)
+    {
+        m_InFrame = true;
+        if (m_Dropping)
+            return;
+        if (m_RxLen + len > m_Rx.size())
+        {
+            ++m_Stats.oversize;
+            m_Dropping = true;
+            return;
+        }
+        std::memcpy(m_Rx.data() + m_RxLen, pData, len);
+        m_RxLen += len;
+    }
+
+    void FramedLink::end_frame()
+    {
+        if (m_InFrame && !m_Dropping)
+        {
+            if (m_RxLen < kCrcSize)
+                ++m_Stats.bad_encoding;
+            else
+            {
+                auto payload = m_Rx.first(m_RxLen - kCrcSize);
+                const uint8_t *pT = m_Rx.data() + payload.size();
+                uint32_t expected = uint32_t(pT[0]) | (uint32_t(pT[1]) << 8) | (uint32_t(pT[2]) << 16) | (uint32_t(pT[3]) << 24);
+                if (crc32(payload) != expected)
+                    ++m_Stats.crc_errors;
+                else
+                {
+                    ++m_Stats.frames;
+                    ++m_Reported;
+                    if (m_FrameCallback)
+                        m_FrameCallback(payload);
+                }
+            }
+        }
+        reset_frame();
+    }
+
+    void FramedLink::feed_cobs(std::span<const uint8_t> bytes)
+    {
+        const uint8_t *p = bytes.data(), *pEnd = p + bytes.size();
+        while(p != pEnd)
+        {
+            if (m_CobsLeft)
+            {
+                size_t n = std::min<size_t>(m_CobsLeft, pEnd - p);
+                if (auto *pZ = (const uint8_t*)std::memchr(p, 0, n))
+                {
+                    //delimiter in the middle of a block: truncated frame
+                    ++m_Stats.bad_encoding;
+                    reset_frame();
+                    p = pZ + 1;
+                    continue;
+                }
+                put(p, n);
+                p += n;
+                m_CobsLeft -= uint8_t(n);
+                continue;
+            }
+
+            uint8_t code = *p++;
+            if (!code)
+            {
+                end_frame();
+                continue;
+            }
+            if (m_CobsZero)
+            {
+                const uint8_t z = 0;
+                put(&z, 1);
+            }
+            m_InFrame = true;
+            m_CobsLeft = code - 1;
+            m_CobsZero = code != 0xff;
+        }
+    }
+
+    void FramedLink::feed_slip(std::span<const uint8_t> bytes)
+    {
+        const uint8_t *p = bytes.data(), *pEnd = p + bytes.size();
+        while(p != pEnd)
+        {
+            if (m_SlipEsc)
+            {
+                uint8_t b = *p++;
+                m_SlipEsc = false;
+                if (b == kSlipEscEnd)
+                    put(&kSlipEnd, 1);
+                else if (b == kSlipEscEsc)
+                    put(&kSlipEsc, 1);
+                else
+                {
+                    ++m_Stats.bad_encoding;
+                    m_Dropping = true;
+                }
+                continue;
+            }
+
+            const uint8_t *q = p;
+            while(q != pEnd && *q != kSlipEnd && *q != kSlipEsc)
+                ++q;
+            if (q != p)
+            {
+                put(p, q - p);
+                p = q;
+                continue;
+            }
+
+            if (*p++ == kSlipEnd)
+                end_frame();
+            else
+            {
+                m_InFrame = true;
+                m_SlipEsc = true;
+            }
+        }
+    }
+
+    void FramedLink::Feed(std::span<const uint8_t> bytes)
+    {
+        if (m_Encoding == Encoding::COBS)
+            feed_cobs(bytes);
+        else
+            feed_slip(bytes);
+    }
+
+    FramedLink::ExpectedValue<size_t> FramedLink::Process(duration_ms_t wait)
+    {
+        m_Reported = 0;
+        for(size_t i = 0; i < kMaxFillsPerProcess; ++i)
+        {
+            if (m_C.Buffered().empty())
+            {
+                if (auto f = m_C.Fill(i ? duration_ms_t{0} : wait); !f)
+                {
+                    if (f.error().code != ESP_OK)
+                        return std::unexpected(f.error());
+                    break;//no more data
+                }
+            }
+            auto w = m_C.Buffered();
+            Feed(w);
+            m_C.Consume(w.size());
+        }
+        return RetVal<size_t>{*this, m_Reported};
+    }
+}
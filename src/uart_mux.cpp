@@ -0,0 +1,502 @@
+#include "ph_uart_mux.hpp"
+#include <algorithm>
+#include <array>
+#include <cstring>
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+
+namespace uart
+{
+    namespace
+    {
+        constexpr uint8_t kFlag = 0xf9;
+        constexpr uint8_t kEA = 0x01;
+        constexpr uint8_t kCR = 0x02;
+        constexpr uint8_t kPF = 0x10;
+
+        constexpr uint8_t kSABM = 0x2f;
+        constexpr uint8_t kUA = 0x63;
+        constexpr uint8_t kDM = 0x0f;
+        constexpr uint8_t kDISC = 0x43;
+        constexpr uint8_t kUIH = 0xef;
+        constexpr uint8_t kUI = 0x03;
+
+        //multiplexer control messages on DLCI 0
+        constexpr uint8_t kMsgMSC = 0xe0;//modem status command, type byte without C/R and EA
+        constexpr uint8_t kSigFC = 0x02;
+        constexpr uint8_t kSigReady = kEA | 0x04 | 0x08;//RTC, RTR
+
+        constexpr std::array<uint8_t, 256> make_fcs_table()
+        {
+            std::array<uint8_t, 256> t{};
+            for(uint32_t i = 0; i < 256; ++i)
+            {
+                uint8_t c = uint8_t(i);
+                for(int b = 0; b < 8; ++b)
+                    c = (c & 1) ? uint8_t((c >> 1) ^ 0xe0) : uint8_t(c >> 1);
+                t[i] = c;
+            }
+            return t;
+        }
+        constexpr std::array<uint8_t, 256> kFcsTable = make_fcs_table();
+
+        constexpr uint8_t fcs_of(std::span<const uint8_t> bytes)
+        {
+            uint8_t fcs = 0xff;
+            for(uint8_t b : bytes)
+                fcs = kFcsTable[fcs ^ b];
+            return uint8_t(0xff - fcs);
+        }
+
+        //UI frames cover the information field as well, UIH only the header
+        constexpr bool fcs_ok(std::span<const uint8_t> hdr, uint8_t fcs, std::span<const uint8_t> info = {})
+        {
+            uint8_t f = 0xff;
+            for(uint8_t b : hdr)
+                f = kFcsTable[f ^ b];
+            for(uint8_t b : info)
+                f = kFcsTable[f ^ b];
+            return kFcsTable[f ^ fcs] == 0xcf;
+        }
+        static_assert(fcs_ok(std::array<const uint8_t, 3>{0x03, 0x3f, 0x01}, fcs_of(std::array<const uint8_t, 3>{0x03, 0x3f, 0x01})));
+    }
+
+    Mux::Mux(Channel &phys):
+        m_Phys(phys)
+    {
+    }
+
+    Mux::Mux(Channel &phys, Config cfg):
+        m_Phys(phys),
+        m_Config(cfg)
+    {
+        m_Config.n1 = std::clamp<size_t>(m_Config.n1, 1, kMaxN1);
+    }
+
+    Mux::~Mux()
+    {
+        Stop();
+        for(size_t i = 0; i < m_Count; ++i)
+        {
+            auto &v = m_Channels[i];
+            if (v.rx) vStreamBufferDelete(v.rx);
+            if (v.tx) vStreamBufferDelete(v.tx);
+        }
+        if (m_TxLock) vSemaphoreDelete(m_TxLock);
+        if (m_Ack) vSemaphoreDelete(m_Ack);
+    }
+
+    Mux::ExpectedChannel Mux::AddChannel(uint8_t dlci, size_t rxBufSize, size_t txBufSize)
+    {
+        if (m_Task)
+            return std::unexpected(Err{"uart::Mux::AddChannel", ESP_ERR_INVALID_STATE});
+        if (!dlci || dlci > 63 || find(dlci))
+            return std::unexpected(Err{"uart::Mux::AddChannel dlci", ESP_ERR_INVALID_ARG});
+        if (m_Count == kMaxChannels)
+            return std::unexpected(Err{"uart::Mux::AddChannel", ESP_ERR_NO_MEM});
+
+        auto &v = m_Channels[m_Count];
+        v.rx = xStreamBufferCreate(rxBufSize, 1);
+        v.tx = xStreamBufferCreate(txBufSize, 1);
+        if (!v.rx || !v.tx)
+        {
+            if (v.rx) vStreamBufferDelete(v.rx);
+            if (v.tx) vStreamBufferDelete(v.tx);
+            v.rx = v.tx = nullptr;
+            return std::unexpected(Err{"uart::Mux::AddChannel buffers", ESP_ERR_NO_MEM});
+        }
+        v.pMux = this;
+        v.dlci = dlci;
+        v.rxSize = rxBufSize;
+        v.txSize = txBufSize;
+        v.ch.SetBackend(&v);
+        ++m_Count;
+        return std::ref(v.ch);
+    }
+
+    Mux::Virtual* Mux::find(uint8_t dlci)
+    {
+        for(size_t i = 0; i < m_Count; ++i)
+            if (m_Channels[i].dlci == dlci)
+                return &m_Channels[i];
+        return nullptr;
+    }
+
+    Mux::ExpectedResult Mux::Start()
+    {
+        if (m_Task)
+            return std::unexpected(Err{"uart::Mux::Start", ESP_ERR_INVALID_STATE});
+        if (!m_TxLock && !(m_TxLock = xSemaphoreCreateMutex()))
+            return std::unexpected(Err{"uart::Mux::Start tx lock", ESP_ERR_NO_MEM});
+        if (!m_Ack && !(m_Ack = xSemaphoreCreateBinary()))
+            return std::unexpected(Err{"uart::Mux::Start ack", ESP_ERR_NO_MEM});
+
+        //the mux opens the physical channel itself: its framing and events only get set up by Open, so an open
+        //one is only taken over if it's still the one left open by Stop
+        if (m_Phys.IsOpen() && !m_PhysOpened)
+            return std::unexpected(Err{"uart::Mux::Start phys already open", ESP_ERR_INVALID_STATE});
+
+        m_RxState = RxState::Flag;
+        m_Phys.SetDataCallback([this](std::span<const uint8_t> bytes){ on_data(bytes); });
+        if (auto r = m_Phys.Open(); !r)
+        {
+            m_Phys.SetDataCallback({});
+            return std::unexpected(r.error());
+        }
+        m_PhysOpened = true;
+
+        m_Stop = false;
+        if (xTaskCreate(task_loop, "uart::mux", m_Config.stackSize, this, m_Config.prio, &m_Task) != pdPASS)
+        {
+            m_Task = nullptr;
+            m_Phys.SetDataCallback({});
+            return std::unexpected(Err{"uart::Mux::Start task", ESP_ERR_NO_MEM});
+        }
+
+        auto r = connect(0);
+        for(size_t i = 0; r && i < m_Count; ++i)
+        {
+            if ((r = connect(m_Channels[i].dlci)))
+                m_Channels[i].connected = true;
+        }
+        if (!r)
+        {
+            //a partial start is torn down like a Stop would
+            (void)Stop();
+            return r;
+        }
+        return std::ref(*this);
+    }
+
+    Mux::ExpectedResult Mux::Stop()
+    {
+        if (!m_Task)
+            return std::ref(*this);
+
+        for(size_t i = 0; i < m_Count; ++i)
+        {
+            auto &v = m_Channels[i];
+            if (v.connected)
+            {
+                v.connected = false;
+                m_AckDlci = v.dlci;
+                xSemaphoreTake(m_Ack, 0);
+                if (send_frame(v.dlci, kDISC | kPF, true, {}))
+                    xSemaphoreTake(m_Ack, pdMS_TO_TICKS(m_Config.connect_timeout.count()));
+            }
+        }
+        m_AckDlci = 0;
+        xSemaphoreTake(m_Ack, 0);
+        if (send_frame(0, kDISC | kPF, true, {}))
+            xSemaphoreTake(m_Ack, pdMS_TO_TICKS(m_Config.connect_timeout.count()));
+        m_AckDlci = 0xff;
+
+        //the task confirms its exit through m_Ack
+        xSemaphoreTake(m_Ack, 0);
+        m_Stop = true;
+        kick();
+        xSemaphoreTake(m_Ack, portMAX_DELAY);
+        m_Task = nullptr;
+        //waits for a callback in progress, no bytes reach this object afterwards
+        m_Phys.SetDataCallback({});
+        return std::ref(*this);
+    }
+
+    Mux::ExpectedResult Mux::connect(uint8_t dlci)
+    {
+        m_AckOk = false;
+        m_AckDlci = dlci;
+        xSemaphoreTake(m_Ack, 0);
+        if (!send_frame(dlci, kSABM | kPF, true, {}))
+            return std::unexpected(Err{"uart::Mux::connect send", ESP_FAIL});
+        bool acked = xSemaphoreTake(m_Ack, pdMS_TO_TICKS(m_Config.connect_timeout.count())) == pdTRUE;
+        m_AckDlci = 0xff;
+        if (!acked)
+            return std::unexpected(Err{"uart::Mux::connect no UA", ESP_ERR_TIMEOUT});
+        if (!m_AckOk)
+            return std::unexpected(Err{"uart::Mux::connect DM", ESP_FAIL});
+        return std::ref(*this);
+    }
+
+    void Mux::kick()
+    {
+        if (m_Task)
+            xTaskNotifyGive(m_Task);
+    }
+
+    bool Mux::send_frame(uint8_t dlci, uint8_t control, bool command, std::span<const uint8_t> info)
+    {
+        uint8_t frame[kMaxN1 + 6];
+        size_t len = std::min(info.size(), kMaxN1);
+        frame[0] = kFlag;
+        frame[1] = uint8_t((dlci << 2) | (command ? kCR : 0) | kEA);
+        frame[2] = control;
+        frame[3] = uint8_t((len << 1) | kEA);
+        if (len)
+            std::memcpy(frame + 4, info.data(), len);
+        frame[4 + len] = fcs_of({frame + 1, 3});
+        frame[5 + len] = kFlag;
+
+        xSemaphoreTake(m_TxLock, portMAX_DELAY);
+        bool ok = (bool)m_Phys.Send(frame, len + 6);
+        xSemaphoreGive(m_TxLock);
+        if (ok)
+            m_Stats.frames_tx.fetch_add(1, std::memory_order_relaxed);
+        return ok;
+    }
+
+    bool Mux::send_msc(Virtual &v, bool stop)
+    {
+        const uint8_t msg[] = {kMsgMSC | kCR | kEA, (2 << 1) | kEA, uint8_t((v.dlci << 2) | kCR | kEA), uint8_t(kSigReady | (stop ? kSigFC : 0))};
+        return send_frame(0, kUIH, true, msg);
+    }
+
+    size_t Mux::pump_round()
+    {
+        size_t sent = 0;
+        for(size_t i = 0; i < m_Count; ++i)
+        {
+            auto &v = m_Channels[(m_RoundRobin + i) % m_Count];
+            if (!v.connected || v.remoteStopped)
+                continue;
+
+            //the payload goes straight into its place in the frame
+            size_t n = xStreamBufferReceive(v.tx, m_TxFrame + 4, m_Config.n1, 0);
+            if (!n)
+                continue;
+            m_TxFrame[0] = kFlag;
+            m_TxFrame[1] = uint8_t((v.dlci << 2) | kCR | kEA);
+            m_TxFrame[2] = kUIH;
+            m_TxFrame[3] = uint8_t((n << 1) | kEA);
+            m_TxFrame[4 + n] = fcs_of({m_TxFrame + 1, 3});
+            m_TxFrame[5 + n] = kFlag;
+
+            xSemaphoreTake(m_TxLock, portMAX_DELAY);
+            bool ok = (bool)m_Phys.Send(m_TxFrame, n + 6);
+            xSemaphoreGive(m_TxLock);
+            if (ok)
+                m_Stats.frames_tx.fetch_add(1, std::memory_order_relaxed);
+            ++sent;
+        }
+        if (m_Count)
+            m_RoundRobin = (m_RoundRobin + 1) % m_Count;
+        return sent;
+    }
+
+    void Mux::task_loop(void *pArg)
+    {
+        Mux &m = *static_cast<Mux*>(pArg);
+        while(!m.m_Stop)
+        {
+            ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+            while(!m.m_Stop && m.pump_round());
+        }
+        xSemaphoreGive(m.m_Ack);
+        vTaskDelete(nullptr);
+    }
+
+    void Mux::on_data(std::span<const uint8_t> bytes)
+    {
+        const uint8_t *p = bytes.data(), *pEnd = p + bytes.size();
+        while(p != pEnd)
+        {
+            uint8_t b = *p;
+            switch(m_RxState)
+            {
+                case RxState::Flag:
+                    if (b == kFlag)
+                        m_RxState = RxState::Address;
+                    break;
+                case RxState::Address:
+                    if (b != kFlag)
+                    {
+                        m_RxAddr = b;
+                        m_RxState = RxState::Control;
+                    }
+                    break;
+                case RxState::Control:
+                    m_RxCtrl = b;
+                    m_RxState = RxState::Length;
+                    break;
+                case RxState::Length:
+                    m_RxLen = b >> 1;
+                    m_RxGot = 0;
+                    //2 byte lengths don't occur with N1 <= 127
+                    if (!(b & kEA) || m_RxLen > kMaxN1)
+                        m_RxState = RxState::Flag;
+                    else
+                        m_RxState = m_RxLen ? RxState::Data : RxState::Fcs;
+                    break;
+                case RxState::Data:
+                {
+                    size_t n = std::min<size_t>(m_RxLen - m_RxGot, pEnd - p);
+                    std::memcpy(m_RxData + m_RxGot, p, n);
+                    m_RxGot += uint8_t(n);
+                    p += n;
+                    if (m_RxGot == m_RxLen)
+                        m_RxState = RxState::Fcs;
+                    continue;
+                }
+                case RxState::Fcs:
+                    m_RxFcs = b;
+                    m_RxState = RxState::End;
+                    break;
+                case RxState::End:
+                    if (b == kFlag)
+                    {
+                        on_frame();
+                        //the closing flag may open the next frame as well
+                        m_RxState = RxState::Address;
+                    }else
+                        m_RxState = RxState::Flag;
+                    break;
+            }
+            ++p;
+        }
+    }
+
+    void Mux::on_frame()
+    {
+        const uint8_t hdr[] = {m_RxAddr, m_RxCtrl, uint8_t((m_RxLen << 1) | kEA)};
+        std::span<const uint8_t> info(m_RxData, m_RxLen);
+        if (!fcs_ok(hdr, m_RxFcs, (m_RxCtrl & ~kPF) == kUI ? info : std::span<const uint8_t>{}))
+        {
+            m_Stats.bad_fcs.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+        m_Stats.frames_rx.fetch_add(1, std::memory_order_relaxed);
+
+        uint8_t dlci = m_RxAddr >> 2;
+        switch(m_RxCtrl & ~kPF)
+        {
+            case kUA:
+            case kDM:
+                if (dlci == m_AckDlci)
+                {
+                    m_AckOk = (m_RxCtrl & ~kPF) == kUA;
+                    xSemaphoreGive(m_Ack);
+                }
+                break;
+            case kSABM:
+                if (auto *pV = find(dlci))
+                    pV->connected = true;
+                send_frame(dlci, kUA | kPF, false, {});
+                break;
+            case kDISC:
+                if (auto *pV = find(dlci))
+                    pV->connected = false;
+                send_frame(dlci, kUA | kPF, false, {});
+                break;
+            case kUIH:
+            case kUI:
+                if (!dlci)
+                    on_control(info);
+                else if (auto *pV = find(dlci))
+                {
+                    size_t n = xStreamBufferSend(pV->rx, info.data(), info.size(), 0);
+                    if (n < info.size())
+                        m_Stats.rx_dropped.fetch_add(info.size() - n, std::memory_order_relaxed);
+                    //throttle while a couple of frames still fit
+                    if (!pV->throttled && xStreamBufferSpacesAvailable(pV->rx) < 2 * kMaxN1)
+                    {
+                        pV->throttled = true;
+                        send_msc(*pV, true);
+                    }
+                }
+                break;
+        }
+    }
+
+    void Mux::on_control(std::span<const uint8_t> info)
+    {
+        if (info.size() < 2)
+            return;
+        uint8_t type = info[0];
+        size_t len = info[1] >> 1;
+        if (info.size() < 2 + len)
+            return;
+        auto value = info.subspan(2, len);
+
+        if ((type & ~(kCR | kEA)) == kMsgMSC && (type & kCR) && value.size() >= 2)
+        {
+            if (auto *pV = find(value[0] >> 2))
+            {
+                bool stop = value[1] & kSigFC;
+                bool wasStopped = pV->remoteStopped.exchange(stop);
+                if (wasStopped && !stop)
+                    kick();
+            }
+            //the response echoes the command with C/R cleared
+            uint8_t resp[2 + 4];
+            resp[0] = uint8_t(type & ~kCR);
+            resp[1] = info[1];
+            size_t n = std::min(len, sizeof(resp) - 2);
+            std::memcpy(resp + 2, value.data(), n);
+            send_frame(0, kUIH, true, {resp, 2 + n});
+        }
+    }
+
+    int Mux::Virtual::Read(uint8_t *pDst, size_t len, TickType_t ticks)
+    {
+        size_t got = 0;
+        TickType_t start = xTaskGetTickCount();
+        while(true)
+        {
+            TickType_t waited = xTaskGetTickCount() - start;
+            TickType_t left = ticks == portMAX_DELAY ? portMAX_DELAY : (waited < ticks ? ticks - waited : 0);
+            got += xStreamBufferReceive(rx, pDst + got, len - got, left);
+            if (got == len || !left)
+                break;
+        }
+
+        if (throttled && xStreamBufferSpacesAvailable(rx) >= rxSize / 2)
+        {
+            throttled = false;
+            pMux->send_msc(*this, false);
+        }
+        return int(got);
+    }
+
+    int Mux::Virtual::Write(const uint8_t *pData, size_t len)
+    {
+        if (!connected)
+            return -1;
+        size_t done = 0;
+        while(done < len)
+        {
+            if (!connected)
+                return -1;
+            //first whatever fits, then wait for the mux task to make room
+            done += xStreamBufferSend(tx, pData + done, std::min(len - done, txSize), done ? pdMS_TO_TICKS(10) : 0);
+            pMux->kick();
+        }
+        return int(len);
+    }
+
+    size_t Mux::Virtual::ReadyToRead()
+    {
+        return xStreamBufferBytesAvailable(rx);
+    }
+
+    size_t Mux::Virtual::ReadyToWrite()
+    {
+        return xStreamBufferSpacesAvailable(tx);
+    }
+
+    void Mux::Virtual::FlushInput()
+    {
+        xStreamBufferReset(rx);
+    }
+
+    esp_err_t Mux::Virtual::WaitAllSent(TickType_t ticks)
+    {
+        TickType_t start = xTaskGetTickCount();
+        while(!xStreamBufferIsEmpty(tx))
+        {
+            if (ticks != portMAX_DELAY && (xTaskGetTickCount() - start) >= ticks)
+                return ESP_ERR_TIMEOUT;
+            vTaskDelay(1);
+        }
+        return ESP_OK;
+    }
+}
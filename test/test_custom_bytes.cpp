@@ -0,0 +1,70 @@
+#include "ph_i2c_layout.hpp"
+
+//i2c::helpers::CustomBytesLayout is resolved at compile time, so are its checks: this only has to build
+namespace
+{
+    using namespace i2c::helpers;
+
+    template<class L, size_t S = L::kSpan>
+    constexpr uint64_t extract(std::array<uint8_t, S> raw)
+    {
+        return L::extract(raw.data(), std::make_index_sequence<L::N>());
+    }
+
+    template<class L, size_t S = L::kSpan>
+    constexpr std::array<uint8_t, S> insert(std::array<uint8_t, S> raw, uint64_t v)
+    {
+        L::insert(raw.data(), v, std::make_index_sequence<L::N>());
+        return raw;
+    }
+
+    //20-bit pressure as on the BMP280: msb, lsb, then xlsb[7:4]; the low nibble of xlsb isn't part of it
+    constexpr auto kPress = ConfigBytes(0xf7, RegAccess::RW, ByteCfg{2, 4, 4}, ByteCfg{1}, ByteCfg{0});
+    using Press = CustomBytesLayout<kPress>;
+
+    static_assert(Press::valid());
+    static_assert(Press::N == 3);
+    static_assert(Press::kShift == std::array<uint8_t, 3>{0, 4, 12});
+    static_assert(Press::kBits == 20);
+    static_assert(Press::kSpan == 3);
+    static_assert(!Press::kFullBytes);
+    static_assert(Press::kMask<0> == 0x0f && Press::kMask<1> == 0xff);
+
+    static_assert(extract<Press>({0x65, 0x5a, 0xc0}) == 0x655ac);
+    static_assert(extract<Press>({0x65, 0x5a, 0xcf}) == 0x655ac);//the foreign nibble stays out
+    static_assert(extract<Press>({0xff, 0xff, 0xf0}) == 0xfffff);
+    //the foreign nibble survives a write, value bits above 20 are dropped
+    static_assert(insert<Press>({0x00, 0x00, 0x0a}, 0x655ac) == std::array<uint8_t, 3>{0x65, 0x5a, 0xca});
+    static_assert(insert<Press>({0xff, 0xff, 0xff}, 0xf00000) == std::array<uint8_t, 3>{0x00, 0x00, 0x0f});
+
+    constexpr bool round_trips()
+    {
+        for(uint64_t v: {0x00000ull, 0x00001ull, 0x80000ull, 0x12345ull, 0xfffffull})
+            if (extract<Press>(insert<Press>({0, 0, 0}, v)) != v)
+                return false;
+        return true;
+    }
+    static_assert(round_trips());
+
+    //24-bit big endian value: every bit owned, a write needs no read first
+    constexpr auto kBe24 = ConfigBytes(0x10, RegAccess::Write, ByteCfg{2}, ByteCfg{1}, ByteCfg{0});
+    using Be24 = CustomBytesLayout<kBe24>;
+    static_assert(Be24::kFullBytes && Be24::kBits == 24);
+    static_assert(extract<Be24>({0x12, 0x34, 0x56}) == 0x123456);
+    static_assert(insert<Be24>({}, 0x123456) == std::array<uint8_t, 3>{0x12, 0x34, 0x56});
+
+    //12-bit field with a gap: bits 3:0 of reg 0, nothing of reg 1, bits 7:0 of reg 2
+    constexpr auto kGap = ConfigBytes(0x20, RegAccess::Read, ByteCfg{0, 0, 4}, ByteCfg{2});
+    using Gap = CustomBytesLayout<kGap>;
+    static_assert(Gap::kSpan == 3 && Gap::kBits == 12 && !Gap::kFullBytes);
+    static_assert(extract<Gap>({0xab, 0xff, 0xcd}) == 0xcdb);
+
+    //out of byte bounds and zero-length fields are rejected
+    static_assert(!CustomBytesLayout<ConfigBytes(0, RegAccess::Read, ByteCfg{0, 6, 4})>::valid());
+    static_assert(!CustomBytesLayout<ConfigBytes(0, RegAccess::Read, ByteCfg{0, 0, 0})>::valid());
+}
+
+int main()
+{
+    return 0;
+}
@@ -0,0 +1,113 @@
+#include "ph_modbus_frame.hpp"
+#include <cstdio>
+#include <cstring>
+
+//master side (encode_request, check_response, ResponseView) against the simulated slave (SlaveModel)
+namespace
+{
+    int g_Failed = 0;
+
+#define CHECK(cond) do { if (!(cond)) { std::printf("%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #cond); ++g_Failed; } } while(0)
+
+    uint8_t g_Coils[4];
+    uint8_t g_Discrete[2] = {0b1010'0101, 0b0000'0011};
+    uint16_t g_Holding[16];
+    uint16_t g_Input[8] = {100, 101, 102, 103, 104, 105, 106, 107};
+
+    modbus::SlaveModel g_Slave{7, {g_Coils, g_Discrete, g_Holding, g_Input}};
+
+    //request through the slave, returns the checked response (empty if there was none)
+    modbus::ResponseView exchange(const modbus::Pdu &req, modbus::Check expect = modbus::Check::Ok)
+    {
+        static uint8_t reqBuf[modbus::kMaxAdu];
+        static uint8_t respBuf[modbus::kMaxAdu];
+        size_t n = modbus::encode_request(req, reqBuf);
+        CHECK(n != 0);
+        size_t m = g_Slave.Handle({reqBuf, n}, respBuf);
+        if (!m)
+            return {};
+        CHECK(modbus::check_response(req, {respBuf, m}) == expect);
+        return modbus::ResponseView({respBuf, m});
+    }
+
+    void test_registers()
+    {
+        using namespace modbus;
+        const uint16_t regs[] = {0x1234, 0xabcd, 0x0001};
+        auto w = exchange({.slave = 7, .fn = Function::WriteMultipleRegisters, .addr = 3, .count = 3, .regs = regs});
+        CHECK(!w.empty() && w.exception() == Exception::None);
+        CHECK(g_Holding[3] == 0x1234 && g_Holding[4] == 0xabcd && g_Holding[5] == 0x0001);
+
+        auto r = exchange({.slave = 7, .fn = Function::ReadHoldingRegisters, .addr = 2, .count = 4});
+        CHECK(r.reg_count() == 4);
+        CHECK(r.reg(0) == 0 && r.reg(1) == 0x1234 && r.reg(2) == 0xabcd && r.reg(3) == 0x0001);
+
+        const uint16_t one[] = {0xbeef};
+        exchange({.slave = 7, .fn = Function::WriteSingleRegister, .addr = 15, .regs = one});
+        CHECK(g_Holding[15] == 0xbeef);
+
+        auto in = exchange({.slave = 7, .fn = Function::ReadInputRegisters, .addr = 5, .count = 3});
+        CHECK(in.reg_count() == 3 && in.reg(0) == 105 && in.reg(2) == 107);
+    }
+
+    void test_bits()
+    {
+        using namespace modbus;
+        const uint8_t bits[] = {0b1100'1011, 0b0000'0101};
+        exchange({.slave = 7, .fn = Function::WriteMultipleCoils, .addr = 4, .count = 11, .bits = bits});
+        auto r = exchange({.slave = 7, .fn = Function::ReadCoils, .addr = 4, .count = 11});
+        for(size_t i = 0; i < 11; ++i)
+            CHECK(r.bit(i) == bool((bits[i / 8] >> (i % 8)) & 1));
+
+        const uint8_t on[] = {1};
+        exchange({.slave = 7, .fn = Function::WriteSingleCoil, .addr = 31, .bits = on});
+        CHECK(g_Coils[3] & 0x80);
+
+        auto d = exchange({.slave = 7, .fn = Function::ReadDiscreteInputs, .addr = 0, .count = 10});
+        CHECK(d.bit(0) && !d.bit(1) && d.bit(2) && d.bit(7) && d.bit(8) && d.bit(9));
+    }
+
+    void test_failures()
+    {
+        using namespace modbus;
+        //out of range: exception response, still a valid frame for the request
+        auto e = exchange({.slave = 7, .fn = Function::ReadHoldingRegisters, .addr = 14, .count = 4});
+        CHECK(e.exception() == Exception::IllegalDataAddress && e.data().empty());
+
+        //other slave and broadcast reads get no answer, broadcast writes are applied silently
+        CHECK(exchange({.slave = 8, .fn = Function::ReadHoldingRegisters}).empty());
+        const uint16_t v[] = {42};
+        CHECK(exchange({.slave = kBroadcast, .fn = Function::WriteSingleRegister, .addr = 0, .regs = v}).empty());
+        CHECK(g_Holding[0] == 42);
+        uint8_t buf[kMaxAdu];
+        CHECK(encode_request({.slave = kBroadcast, .fn = Function::ReadCoils}, buf) == 0);
+
+        //corrupted request is dropped, corrupted response is reported
+        Pdu req{.slave = 7, .fn = Function::ReadInputRegisters, .addr = 0, .count = 2};
+        size_t n = encode_request(req, buf);
+        uint8_t resp[kMaxAdu];
+        buf[3] ^= 0x01;
+        CHECK(g_Slave.Handle({buf, n}, resp) == 0);
+        buf[3] ^= 0x01;
+        size_t m = g_Slave.Handle({buf, n}, resp);
+        CHECK(m == response_size(req));
+        resp[4] ^= 0x80;
+        CHECK(check_response(req, {resp, m}) == Check::BadCrc);
+
+        //response of another request
+        resp[4] ^= 0x80;
+        Pdu other = req;
+        other.slave = 9;
+        CHECK(check_response(other, {resp, m}) == Check::Mismatch);
+    }
+}
+
+int main()
+{
+    test_registers();
+    test_bits();
+    test_failures();
+    if (g_Failed)
+        std::printf("%d check(s) failed\n", g_Failed);
+    return g_Failed ? 1 : 0;
+}